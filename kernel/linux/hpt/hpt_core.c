@@ -13,6 +13,7 @@
 #include <linux/uaccess.h>
 #include <linux/sched/signal.h>
 #include <linux/hrtimer.h>
+#include <linux/log2.h>
 
 MODULE_VERSION(HPT_VERSION);
 MODULE_LICENSE("GPL");
@@ -41,6 +42,12 @@ static inline bool hpt_capable(void);
 **************************************************************************************************/
 static int hpt_run_thread(struct hpt_net_device_info *hpt);
 
+/**********************************************************************************************//**
+* @brief hpt_stop_thread: Stop the kernel thread of the device, or take it out of the RX pool
+* @param hpt: Pointer to the hpt_net_device_info structure
+**************************************************************************************************/
+static void hpt_stop_thread(struct hpt_net_device_info *hpt);
+
 /**********************************************************************************************//**
 * @brief hpt_open: Open function for the HPT device file
 * @param inode: Pointer to the inode structure representing the device file
@@ -65,6 +72,29 @@ static int hpt_release(struct inode *inode, struct file *file);
 **************************************************************************************************/
 static int hpt_mmap(struct file *file, struct vm_area_struct *vma);
 
+/**********************************************************************************************//**
+* @brief hpt_resize_rings: Apply a pending resize: quiesce the device, move both rings to new memory and resume
+* Elements that do not fit in the new rings are dropped and counted. Must not be called with
+* mmap_lock held, read() and write() fault on user buffers while holding the io mutexes.
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @return 0 on success or if no resize is pending, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_resize_rings(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_destroy_device: Stop the RX thread, unregister the netdev and drop the ring memory
+* Called with rtnl_lock held.
+* @param dev_info: Pointer to the hpt_net_device_info structure
+**************************************************************************************************/
+static void hpt_destroy_device(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_fill_info: Fill the parameters userspace needs to map the device
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param info: Parameters to fill
+**************************************************************************************************/
+static void hpt_fill_info(struct hpt_net_device_info *dev_info, struct hpt_net_device_param *info);
+
 /**********************************************************************************************//**
 * @brief hpt_ioctl_create: Handle an ioctl create request for the HPT device
 * @param file: Pointer to the file structure for the device
@@ -86,6 +116,77 @@ static int hpt_ioctl_create(struct file *file, struct net *net,
 static long hpt_ioctl(struct file *file, uint32_t ioctl_num,
                       unsigned long ioctl_param);
 
+/**********************************************************************************************//**
+* @brief hpt_ioctl_info: Report the name, flags and ring size userspace has to map
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @param ioctl_param: IOCTL parameter
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_info(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_set_pacing: Set the token bucket applied to the RX ring of the device
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @param ioctl_param: IOCTL parameter
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_set_pacing(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_set_persist: Keep the device alive after its last fd is closed, or not
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @param ioctl_param: IOCTL parameter
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_set_persist(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_attach: Bind a detached persistent device to the file, ring state is kept
+* @param file: Pointer to the file structure for the device
+* @param net: Pointer to the net structure for the associated network namespace
+* @param ioctl_num: IOCTL command number
+* @param ioctl_param: IOCTL parameter
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_attach(struct file *file, struct net *net, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_kick: Schedule the RX pool worker of the device after userspace published packets
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_kick(struct file *file, uint32_t ioctl_num);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_flush_rx: Run the RX ring sweep in the caller's context, HPT_DEV_F_NO_KTHREAD only
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @param ioctl_param: IOCTL parameter, the budget
+* @return Number of packets handed to the network stack, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_flush_rx(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_batch: Move many packets between userspace buffers and the rings in one call
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number, HPT_IOCTL_READ_BATCH or HPT_IOCTL_WRITE_BATCH
+* @param ioctl_param: IOCTL parameter
+* @return Number of packets moved, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_batch(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param);
+
+/**********************************************************************************************//**
+* @brief hpt_ioctl_resize: Move the rings to memory of the size requested with ethtool -G
+* @param file: Pointer to the file structure for the device
+* @param ioctl_num: IOCTL command number
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_ioctl_resize(struct file *file, uint32_t ioctl_num);
+
 /**********************************************************************************************//**
 * @brief hpt_init: Initialize the HPT driver
 * @return 0 on success, or a negative error code on failure
@@ -115,7 +216,7 @@ static int hpt_kernel_thread(void *param)
         if (schedule_hrtimeout(&waittime, HRTIMER_MODE_REL) != 0) {
             pr_info("Woke early due to signal.\n");
         } else {
-			hpt_net_rx(dev_info);
+			hpt_net_rx(dev_info, HPT_RX_BUDGET_ALL);
         }
         
         if (kthread_should_stop())
@@ -134,6 +235,18 @@ static inline bool hpt_capable(void)
 
 static int hpt_run_thread(struct hpt_net_device_info *dev_info)
 {
+	/* Userspace drives the RX ring through HPT_IOCTL_FLUSH_RX */
+	if(dev_info->flags & HPT_DEV_F_NO_KTHREAD)
+	{
+		return 0;
+	}
+
+	if(hpt_rx_pool)
+	{
+		hpt_rx_pool_add(dev_info);
+		return 0;
+	}
+
 	dev_info->pthread = kthread_create(hpt_kernel_thread, (void *)dev_info, "%s", dev_info->name);
 
 	if (IS_ERR(dev_info->pthread)) {
@@ -147,6 +260,20 @@ static int hpt_run_thread(struct hpt_net_device_info *dev_info)
 	return 0;
 }
 
+static void hpt_stop_thread(struct hpt_net_device_info *dev_info)
+{
+	if(hpt_rx_pool)
+	{
+		hpt_rx_pool_remove(dev_info);
+		return;
+	}
+
+	if (dev_info->pthread) {
+		kthread_stop(dev_info->pthread);
+		dev_info->pthread = NULL;
+	}
+}
+
 static unsigned int hpt_poll(struct file *file, struct poll_table_struct *poll_table)
 {
     struct hpt_net_device_info *dev_info = file->private_data;
@@ -156,10 +283,24 @@ static unsigned int hpt_poll(struct file *file, struct poll_table_struct *poll_t
 	if(dev_info) 
 	{
 		poll_wait(file, &dev_info->tx_busy, poll_table);
-		if(hpt_count_items(dev_info->ring_info_tx)) 
+		poll_wait(file, &dev_info->rx_space, poll_table);
+		if(!dev_info->ring_info_tx)
+		{
+			return mask;
+		}
+		if(hpt_net_tx_readable(dev_info))
 		{
 			mask |= POLLIN | POLLRDNORM; /* readable */
 		}
+		if(dev_info->flags & HPT_DEV_F_UMEM ? hpt_umem_count(dev_info->umem.rx) < dev_info->umem.items :
+		                                      hpt_free_items(dev_info->ring_info_rx, dev_info->ring_buffer_items) > 0)
+		{
+			mask |= POLLOUT | POLLWRNORM; /* room in the RX ring */
+		}
+		if(ACQUIRE(&dev_info->ring_info_tx->flags) & HPT_RING_F_RESIZE)
+		{
+			mask |= POLLPRI; /* remap */
+		}
 	}
 
 	return mask;
@@ -191,36 +332,17 @@ static int hpt_release(struct inode *inode, struct file *file)
 	rtnl_lock();
 
 	dev_info = file->private_data;
+	file->private_data = NULL;
 
-	if(dev_info) 
+	if(dev_info && dev_info->persist)
 	{
-		if (dev_info->pthread) {
-			kthread_stop(dev_info->pthread);
-			dev_info->pthread = NULL;
-		}
-
-		pr_info("Stopped pthread\n");
-
-		if(dev_info->ring_memory)
-		{
-			for(size_t b = 0; b < dev_info->num_blocks; b++) 
-			{
-				if(dev_info->pages_memory[b])
-				{
-					__free_pages(virt_to_page(dev_info->pages_memory[b]), dev_info->order);
-				}
-			}
-			
-			dev_info->pages_memory = NULL;
-			dev_info->ring_memory = NULL;
-		}
-
-		if(dev_info->net_dev)
-		{
-			unregister_netdevice(dev_info->net_dev);
-			free_netdev(dev_info->net_dev);
-			file->private_data = NULL;
-		}
+		/* The RX thread keeps draining, TX fills the ring until the next process attaches */
+		dev_info->attached = false;
+		pr_info("Detached persistent device %s\n", dev_info->name);
+	}
+	else if(dev_info) 
+	{
+		hpt_destroy_device(dev_info);
 	}
 
 	pr_info("HPT close!\n");
@@ -229,22 +351,55 @@ static int hpt_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static void hpt_destroy_device(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_ring_mem *mem;
+
+	list_del(&dev_info->list);
+
+	hpt_stop_thread(dev_info);
+
+	pr_info("Stopped pthread\n");
+
+	/* Freed once the netdev is gone, hpt_net_tx() writes to it until then */
+	mem = dev_info->mem;
+	dev_info->mem = NULL;
+
+	unregister_netdevice(dev_info->net_dev);
+	hpt_net_coalesce_stop(dev_info);
+	hpt_net_skb_cache_purge(dev_info);
+	free_netdev(dev_info->net_dev);
+
+	if(mem)
+	{
+		hpt_ring_mem_put(mem);
+	}
+}
+
 static int hpt_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int ret = 0;
 	struct hpt_net_device_info *dev_info;
-    unsigned long pfn;
+	struct hpt_ring_mem *mem;
 	unsigned long size;
 	unsigned long num_ring_memory;
-	unsigned long virt_addr;
+	uint32_t ring_buffer_items;
 
 	mutex_lock(&hpt_device->device_mutex);
 
 	size = vma->vm_end - vma->vm_start;
 
 	dev_info = file->private_data;
+	if(!dev_info)
+	{
+		ret = -EINVAL;
+		goto end;
+	}
 
-	num_ring_memory = 2 * dev_info->ring_buffer_items * HPT_RB_ELEMENT_SIZE;
+	/* A pending resize of existing rings is applied by HPT_IOCTL_RESIZE, never here under mmap_lock */
+	ring_buffer_items = dev_info->mem ? dev_info->ring_buffer_items : hpt_alloc_ring_items(dev_info);
+
+	num_ring_memory = hpt_memory_size(dev_info->flags, ring_buffer_items, dev_info->umem_frames, dev_info->elem_size);
 	if(size < num_ring_memory) 
 	{
 		pr_info("User requested mmap size: %lu, kernel size: %lu\n", size, num_ring_memory);
@@ -252,86 +407,186 @@ static int hpt_mmap(struct file *file, struct vm_area_struct *vma)
 		goto end;
 	}
 
-	size_t aligned_size = PAGE_ALIGN(num_ring_memory);
-	size_t num_pages = aligned_size / PAGE_SIZE;
-	size_t num_blocks = num_pages / PAGES_PER_BLOCK;
+	if(dev_info->mem)
+	{
+		ret = hpt_ring_mem_map(dev_info->mem, vma);
+		goto end;
+	}
 
-	size_t order = get_order(PAGES_PER_BLOCK * PAGE_SIZE);
+	mem = hpt_ring_mem_alloc(num_ring_memory);
+	if(!mem)
+	{
+		pr_err("Cannot allocate %u ring buffer items\n", ring_buffer_items);
+		ret = -ENOMEM;
+		goto end;
+	}
 
-	for(size_t b = 0; b < num_blocks; b++) 
+	ret = hpt_ring_mem_map(mem, vma);
+	if(ret)
 	{
-		struct page *page = alloc_pages(GFP_KERNEL, order);
-		if (!page) {
-			pr_err("Cannot allocate memory block %zu\n", b);
-			ret = -ENOMEM;
-			goto free_memory;
-		}
+		hpt_ring_mem_put(mem);
+		goto end;
+	}
 
-		dev_info->pages_memory[b] = page_address(page);
-		phys_addr_t phys_base = page_to_phys(page);
-		
-		pr_info("Block %zu: vaddr=%px, pa=0x%llx\n", b, dev_info->pages_memory[b], (unsigned long long)phys_base);
+	hpt_ring_mem_attach(dev_info, mem, ring_buffer_items);
+	/* Lets the pool worker arm HPT_RING_F_NEED_WAKEUP on the fresh rings */
+	hpt_rx_pool_kick(dev_info);
 
-		for(size_t i = 0; i < PAGES_PER_BLOCK; i++) 
-		{
-			phys_addr_t pa = phys_base + (i * PAGE_SIZE);
-			unsigned long pfn = PHYS_PFN(pa);
-
-			if(remap_pfn_range(vma, vma->vm_start + (b * PAGES_PER_BLOCK + i) * PAGE_SIZE, pfn, PAGE_SIZE, vma->vm_page_prot)) 
-			{
-				pr_err("Failed to remap block %zu page %zu\n", b, i);
-				ret = -EIO;
-				goto free_memory;
-			}
-
-			pr_info("Page %zu-%zu: vaddr=%px, pa=0x%llx, pfn=0x%lx\n", 
-					b, i, dev_info->pages_memory[b] + (i * PAGE_SIZE), 
-					(unsigned long long)pa, pfn);
-		}
-	}
+	pr_info("Allocated %zu bytes with vmap: %p\n", mem->size, mem->vaddr);
 
-	dev_info->order = order;
-	dev_info->num_blocks = num_blocks;
+end:
+	mutex_unlock(&hpt_device->device_mutex);
+	return ret;
+}
 
-	size_t block_ind_tx = 0;
-	size_t block_ind_rx = (num_blocks >> 1) - 1;
+static int hpt_resize_rings(struct hpt_net_device_info *dev_info)
+{
+	struct net_device *net_dev = dev_info->net_dev;
+	struct hpt_ring_mem *old_mem = NULL;
+	struct hpt_ring_mem *mem;
+	struct netdev_queue *txq;
+	struct hpt_ring_buffer *old_info_tx, *old_info_rx, *old_info_tx_prio, *old_info_rx_prio;
+	uint8_t *old_data_tx, *old_data_rx, *old_data_tx_prio, *old_data_rx_prio;
+	uint32_t old_items = 0, ring_buffer_items;
+	size_t dropped;
+	bool pending;
+	int ret = 0;
 
-	uint8_t *ring_info_tx = (uint8_t *)dev_info->pages_memory[block_ind_tx] + PAGE_SIZE - sizeof(struct hpt_ring_buffer);
-	uint8_t *ring_info_rx = (uint8_t *)dev_info->pages_memory[block_ind_rx] + PAGE_SIZE - sizeof(struct hpt_ring_buffer);
-	
-	dev_info->ring_info_tx = (struct hpt_ring_buffer *)ring_info_tx;
-	dev_info->ring_info_rx = (struct hpt_ring_buffer *)ring_info_rx;
-    dev_info->ring_data_tx = (uint8_t *)dev_info->pages_memory[block_ind_tx];
-    dev_info->ring_data_rx = (uint8_t *)dev_info->pages_memory[block_ind_rx];
+	mutex_lock(&hpt_device->device_mutex);
+	pending = dev_info->mem && dev_info->resize_items;
+	mutex_unlock(&hpt_device->device_mutex);
 
-	memset(dev_info->ring_info_tx, 0, sizeof(struct hpt_ring_buffer));
-	memset(dev_info->ring_info_rx, 0, sizeof(struct hpt_ring_buffer));
+	if(!pending)
+	{
+		return 0;
+	}
 
-	dev_info->ring_info_rx->block_ind = block_ind_rx;
-	dev_info->ring_data_rx->min_block_ind = block_ind_rx + 1;
-	dev_info->ring_data_rx->max_block_ind = num_blocks;
-	dev_info->ring_data_tx->min_block_ind = 0;
-	dev_info->ring_data_tx->max_block_ind = num_blocks >> 1;
+	/* Quiesce both producers and consumers on the kernel side, userspace is in hpt_remap().
+	 * device_mutex comes last: hpt_mmap() takes it under mmap_lock, and read()/write() fault
+	 * on user buffers with the io mutexes held */
+	mutex_lock(&dev_info->rx_mutex);
+	hpt_stop_thread(dev_info);
+	mutex_lock(&dev_info->io_read_mutex);
+	mutex_lock(&dev_info->io_write_mutex);
+	mutex_lock(&hpt_device->device_mutex);
 
-	pr_info("Allocated %zu bytes with vmap: %p\n", aligned_size, dev_info->ring_memory);
+	ring_buffer_items = dev_info->resize_items;
+	if(!dev_info->mem || !ring_buffer_items)
+	{
+		goto unlock;
+	}
+
+	mem = hpt_ring_mem_alloc(hpt_memory_size(dev_info->flags, ring_buffer_items, dev_info->umem_frames, dev_info->elem_size));
+	if(!mem)
+	{
+		pr_err("Cannot allocate %u ring buffer items\n", ring_buffer_items);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	old_mem = dev_info->mem;
+	old_info_tx = dev_info->ring_info_tx;
+	old_info_rx = dev_info->ring_info_rx;
+	old_data_tx = dev_info->ring_data_tx;
+	old_data_rx = dev_info->ring_data_rx;
+	old_info_tx_prio = dev_info->ring_info_tx_prio;
+	old_info_rx_prio = dev_info->ring_info_rx_prio;
+	old_data_tx_prio = dev_info->ring_data_tx_prio;
+	old_data_rx_prio = dev_info->ring_data_rx_prio;
+	old_items = dev_info->ring_buffer_items;
+
+	netif_tx_disable(net_dev);
+
+	/* ndo_xdp_xmit does not look at the stopped queue, it checks tx_resizing under the queue lock */
+	txq = netdev_get_tx_queue(net_dev, 0);
+	__netif_tx_lock_bh(txq);
+	dev_info->tx_resizing = true;
+	__netif_tx_unlock_bh(txq);
+
+	hpt_ring_mem_attach(dev_info, mem, ring_buffer_items);
+
+	dropped = hpt_ring_mem_migrate(old_info_tx, old_data_tx, old_items, dev_info->ring_info_tx, dev_info->ring_data_tx, ring_buffer_items, dev_info->elem_size);
+	net_dev->stats.tx_dropped += dropped;
+	dropped = hpt_ring_mem_migrate(old_info_rx, old_data_rx, old_items, dev_info->ring_info_rx, dev_info->ring_data_rx, ring_buffer_items, dev_info->elem_size);
+	net_dev->stats.rx_dropped += dropped;
+
+	if(dev_info->flags & HPT_DEV_F_PRIO_LANE)
+	{
+		/* Same size on both sides, nothing is dropped */
+		hpt_ring_mem_migrate(old_info_tx_prio, old_data_tx_prio, HPT_PRIO_ITEMS, dev_info->ring_info_tx_prio, dev_info->ring_data_tx_prio, HPT_PRIO_ITEMS, dev_info->elem_size);
+		hpt_ring_mem_migrate(old_info_rx_prio, old_data_rx_prio, HPT_PRIO_ITEMS, dev_info->ring_info_rx_prio, dev_info->ring_data_rx_prio, HPT_PRIO_ITEMS, dev_info->elem_size);
+	}
+
+	__netif_tx_lock_bh(txq);
+	dev_info->tx_resizing = false;
+	__netif_tx_unlock_bh(txq);
 
+unlock:
 	mutex_unlock(&hpt_device->device_mutex);
-	return 0;
+	mutex_unlock(&dev_info->io_write_mutex);
+	mutex_unlock(&dev_info->io_read_mutex);
 
-unmap_vmalloc:
-	for(size_t b = 0; b < num_blocks; b++) 
+	if(old_mem)
 	{
-    	if(dev_info->pages_memory[b])
+		/* Userspace mappings of the old memory keep it alive until they are gone */
+		hpt_ring_mem_put(old_mem);
+
+		if(netif_running(net_dev))
 		{
-        	__free_pages(virt_to_page(dev_info->pages_memory[b]), order);
+			netif_tx_wake_all_queues(net_dev);
 		}
+
+		pr_info("Resized %s from %u to %u ring buffer items\n", dev_info->name, old_items, ring_buffer_items);
 	}
 
-end:
-	mutex_unlock(&hpt_device->device_mutex);
+	if(hpt_run_thread(dev_info))
+	{
+		pr_err("Couldn't restart rx kernel thread of %s\n", dev_info->name);
+	}
+	mutex_unlock(&dev_info->rx_mutex);
+
 	return ret;
 }
 
+int hpt_request_resize(struct hpt_net_device_info *dev_info, uint32_t ring_buffer_items)
+{
+	if(!hpt_ring_items_valid(ring_buffer_items))
+	{
+		return -EINVAL;
+	}
+
+	/* Frames may be held by userspace, there is nothing to migrate them with */
+	if(dev_info->flags & HPT_DEV_F_UMEM)
+	{
+		return -EOPNOTSUPP;
+	}
+
+	mutex_lock(&hpt_device->device_mutex);
+
+	if(ring_buffer_items == dev_info->ring_buffer_items)
+	{
+		dev_info->resize_items = 0;
+	}
+	else
+	{
+		dev_info->resize_items = ring_buffer_items;
+	}
+
+	if(dev_info->mem)
+	{
+		uint32_t set = dev_info->resize_items ? HPT_RING_F_RESIZE : 0;
+
+		/* The RX pool worker owns HPT_RING_F_NEED_WAKEUP of the same word */
+		hpt_ring_update_flags(dev_info->ring_info_tx, set, HPT_RING_F_RESIZE & ~set);
+		hpt_ring_update_flags(dev_info->ring_info_rx, set, HPT_RING_F_RESIZE & ~set);
+		wake_up_interruptible(&dev_info->tx_busy);
+	}
+
+	mutex_unlock(&hpt_device->device_mutex);
+
+	return 0;
+}
+
 /*static int hpt_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int ret = 0;
@@ -445,6 +700,12 @@ static int hpt_ioctl_create(struct file *file, struct net *net, uint32_t ioctl_n
 		return -EINVAL;
 	}
 
+	if(file->private_data)
+	{
+		pr_err("File is already bound to a device\n");
+		return -EBUSY;
+	}
+
 	if(copy_from_user(&net_dev_name, (void *)ioctl_param, sizeof(net_dev_name))) 
 	{
 		pr_err("Error copy hpt info from user space\n");
@@ -457,12 +718,50 @@ static int hpt_ioctl_create(struct file *file, struct net *net, uint32_t ioctl_n
 		return -EINVAL;
 	}
 
-	if(net_dev_name.ring_buffer_items == 0 || net_dev_name.ring_buffer_items > HPT_MAX_ITEMS)
+	if(!hpt_ring_items_valid(net_dev_name.ring_buffer_items))
     {
-        pr_err("Cannot allocate %zu buffers\n", net_dev_name.ring_buffer_items);
+        pr_err("Cannot allocate %zu buffers, the ring size must be a power of two\n", net_dev_name.ring_buffer_items);
         return -EINVAL;
     }
 
+	if(!net_dev_name.elem_size)
+	{
+		net_dev_name.elem_size = HPT_RB_ELEMENT_SIZE;
+	}
+
+	if(!hpt_elem_size_valid(net_dev_name.elem_size))
+	{
+		pr_err("Invalid element size %u\n", net_dev_name.elem_size);
+		return -EINVAL;
+	}
+
+	if(net_dev_name.flags & HPT_DEV_F_UMEM)
+	{
+		/* Frames have a fixed size of their own */
+		if(net_dev_name.elem_size != HPT_RB_ELEMENT_SIZE)
+		{
+			pr_err("UMEM devices use HPT_UMEM_FRAME_SIZE frames, not elements\n");
+			return -EINVAL;
+		}
+
+		if(net_dev_name.flags & (HPT_DEV_F_RX_MPSC | HPT_DEV_F_PRIO_LANE))
+		{
+			pr_err("UMEM needs a single producer and no priority lane\n");
+			return -EINVAL;
+		}
+
+		if(!net_dev_name.umem_frames)
+		{
+			net_dev_name.umem_frames = HPT_UMEM_DEFAULT_FRAMES(net_dev_name.ring_buffer_items);
+		}
+
+		if(net_dev_name.umem_frames > HPT_UMEM_MAX_FRAMES)
+		{
+			pr_err("Cannot allocate %u UMEM frames\n", net_dev_name.umem_frames);
+			return -EINVAL;
+		}
+	}
+
 	net_dev = alloc_netdev(sizeof(struct hpt_net_device_info), net_dev_name.name,
 #ifdef NET_NAME_USER
 			       NET_NAME_USER,
@@ -487,9 +786,29 @@ static int hpt_ioctl_create(struct file *file, struct net *net, uint32_t ioctl_n
 	memset(dev_info, 0, sizeof(struct hpt_net_device_info));
 
 	dev_info->ring_buffer_items = net_dev_name.ring_buffer_items;
+	dev_info->flags = net_dev_name.flags;
+	dev_info->umem_frames = net_dev_name.umem_frames;
+	dev_info->elem_size = net_dev_name.elem_size;
 	dev_info->net_dev = net_dev;
+
+	if(dev_info->flags & HPT_DEV_F_CSUM_OFFLOAD)
+	{
+		net_dev->features |= NETIF_F_HW_CSUM | NETIF_F_SG | NETIF_F_FRAGLIST;
+	}
+
+	/* Packets have to fit in one element, only small elements lower the MTU */
+	net_dev->mtu = min_t(uint32_t, HPT_MTU, dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE);
+	net_dev->max_mtu = net_dev->mtu;
+	net_dev->min_mtu = net_dev->mtu;
 	
 	init_waitqueue_head(&dev_info->tx_busy);
+	init_waitqueue_head(&dev_info->rx_space);
+	mutex_init(&dev_info->rx_mutex);
+	mutex_init(&dev_info->io_read_mutex);
+	mutex_init(&dev_info->io_write_mutex);
+	__skb_queue_head_init(&dev_info->tx_done);
+	hpt_net_rx_init(dev_info);
+	hpt_net_coalesce_init(dev_info);
 
 	strncpy(dev_info->name, net_dev_name.name, HPT_NAMESIZE);
 
@@ -513,6 +832,8 @@ static int hpt_ioctl_create(struct file *file, struct net *net, uint32_t ioctl_n
 		goto clean_up;
 	}
 	
+	dev_info->attached = true;
+	list_add_tail(&dev_info->list, &hpt_device->devices);
 	file->private_data = dev_info;
 
 	return 0;
@@ -524,6 +845,276 @@ clean_up:
 	return ret;
 }
 
+static int hpt_ioctl_info(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+	struct hpt_net_device_param info;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(info))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	hpt_fill_info(dev_info, &info);
+
+	if(copy_to_user((void *)ioctl_param, &info, sizeof(info)))
+	{
+		pr_err("Error copy hpt info to user space\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static void hpt_fill_info(struct hpt_net_device_info *dev_info, struct hpt_net_device_param *info)
+{
+	memset(info, 0, sizeof(*info));
+
+	mutex_lock(&hpt_device->device_mutex);
+	strscpy(info->name, dev_info->name, sizeof(info->name));
+	/* The size the next mmap maps, a pending resize of existing rings needs HPT_IOCTL_RESIZE first */
+	info->ring_buffer_items = dev_info->mem ? dev_info->ring_buffer_items : hpt_alloc_ring_items(dev_info);
+	info->flags = dev_info->flags;
+	info->umem_frames = dev_info->umem_frames;
+	info->elem_size = dev_info->elem_size;
+	mutex_unlock(&hpt_device->device_mutex);
+}
+
+static int hpt_ioctl_set_persist(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+	uint32_t persist;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(persist))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	if(copy_from_user(&persist, (void *)ioctl_param, sizeof(persist)))
+	{
+		pr_err("Error copy persist flag from user space\n");
+		return -EFAULT;
+	}
+
+	dev_info->persist = persist != 0;
+
+	return 0;
+}
+
+static int hpt_ioctl_attach(struct file *file, struct net *net, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info;
+	struct hpt_net_device_param param;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(param))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(file->private_data)
+	{
+		pr_err("File is already bound to a device\n");
+		return -EBUSY;
+	}
+
+	if(copy_from_user(&param, (void *)ioctl_param, sizeof(param)))
+	{
+		pr_err("Error copy hpt name from user space\n");
+		return -EFAULT;
+	}
+
+	if(strnlen(param.name, sizeof(param.name)) == sizeof(param.name)) 
+	{
+		pr_err("hpt.name not zero-terminated");
+		return -EINVAL;
+	}
+
+	list_for_each_entry(dev_info, &hpt_device->devices, list)
+	{
+		if(strncmp(dev_info->name, param.name, HPT_NAMESIZE) || !net_eq(dev_net(dev_info->net_dev), net))
+		{
+			continue;
+		}
+
+		/* A device without persist goes away with its fd, one with an fd has an owner */
+		if(!dev_info->persist || dev_info->attached)
+		{
+			return -EBUSY;
+		}
+
+		hpt_fill_info(dev_info, &param);
+
+		if(copy_to_user((void *)ioctl_param, &param, sizeof(param)))
+		{
+			pr_err("Error copy hpt info to user space\n");
+			return -EFAULT;
+		}
+
+		dev_info->attached = true;
+		file->private_data = dev_info;
+
+		pr_info("Attached persistent device %s\n", dev_info->name);
+
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+static int hpt_ioctl_kick(struct file *file, uint32_t ioctl_num)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+
+	if(_IOC_SIZE(ioctl_num) != 0)
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	hpt_rx_pool_kick(dev_info);
+
+	return 0;
+}
+
+static int hpt_ioctl_flush_rx(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+	uint32_t budget;
+	size_t num;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(budget))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	/* The RX ring has a single consumer, a kernel thread may already be it */
+	if(!(dev_info->flags & HPT_DEV_F_NO_KTHREAD))
+	{
+		return -EINVAL;
+	}
+
+	if(copy_from_user(&budget, (void *)ioctl_param, sizeof(budget)))
+	{
+		pr_err("Error copy flush budget from user space\n");
+		return -EFAULT;
+	}
+
+	if(mutex_lock_interruptible(&dev_info->rx_mutex))
+	{
+		return -ERESTARTSYS;
+	}
+
+	if(!dev_info->ring_info_rx)
+	{
+		mutex_unlock(&dev_info->rx_mutex);
+		return -ENODEV;
+	}
+
+	num = hpt_net_rx(dev_info, budget ? budget : HPT_RX_BUDGET_ALL);
+
+	mutex_unlock(&dev_info->rx_mutex);
+
+	return min_t(size_t, num, INT_MAX);
+}
+
+static int hpt_ioctl_batch(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+	struct hpt_batch batch;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(batch))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	if(copy_from_user(&batch, (void *)ioctl_param, sizeof(batch)))
+	{
+		pr_err("Error copy batch from user space\n");
+		return -EFAULT;
+	}
+
+	if(_IOC_NR(ioctl_num) == _IOC_NR(HPT_IOCTL_READ_BATCH))
+	{
+		return hpt_io_read_batch(dev_info, &batch, nonblock);
+	}
+
+	return hpt_io_write_batch(dev_info, &batch, nonblock);
+}
+
+static int hpt_ioctl_resize(struct file *file, uint32_t ioctl_num)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+
+	if(_IOC_SIZE(ioctl_num) != 0)
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	return hpt_resize_rings(dev_info);
+}
+
+static int hpt_ioctl_set_pacing(struct file *file, uint32_t ioctl_num, unsigned long ioctl_param)
+{
+	struct hpt_net_device_info *dev_info = file->private_data;
+	struct hpt_pacing_param param;
+
+	if(_IOC_SIZE(ioctl_num) != sizeof(param))
+	{
+		pr_err("Error check the buffer size\n");
+		return -EINVAL;
+	}
+
+	if(!dev_info)
+	{
+		return -ENODEV;
+	}
+
+	if(copy_from_user(&param, (void *)ioctl_param, sizeof(param)))
+	{
+		pr_err("Error copy pacing parameters from user space\n");
+		return -EFAULT;
+	}
+
+	return hpt_net_set_pacing(dev_info, &param);
+}
+
 static long hpt_ioctl(struct file *file, uint32_t ioctl_num,
 		      unsigned long ioctl_param)
 {
@@ -537,6 +1128,36 @@ static long hpt_ioctl(struct file *file, uint32_t ioctl_num,
 		ret = hpt_ioctl_create(file, net, ioctl_num, ioctl_param);
 		rtnl_unlock();
 		break;
+	case _IOC_NR(HPT_IOCTL_INFO):
+		ret = hpt_ioctl_info(file, ioctl_num, ioctl_param);
+		break;
+	case _IOC_NR(HPT_IOCTL_SET_PACING):
+		ret = hpt_ioctl_set_pacing(file, ioctl_num, ioctl_param);
+		break;
+	case _IOC_NR(HPT_IOCTL_SET_PERSIST):
+		rtnl_lock();
+		ret = hpt_ioctl_set_persist(file, ioctl_num, ioctl_param);
+		rtnl_unlock();
+		break;
+	case _IOC_NR(HPT_IOCTL_ATTACH):
+		rtnl_lock();
+		net = current->nsproxy->net_ns;
+		ret = hpt_ioctl_attach(file, net, ioctl_num, ioctl_param);
+		rtnl_unlock();
+		break;
+	case _IOC_NR(HPT_IOCTL_KICK):
+		ret = hpt_ioctl_kick(file, ioctl_num);
+		break;
+	case _IOC_NR(HPT_IOCTL_FLUSH_RX):
+		ret = hpt_ioctl_flush_rx(file, ioctl_num, ioctl_param);
+		break;
+	case _IOC_NR(HPT_IOCTL_READ_BATCH):
+	case _IOC_NR(HPT_IOCTL_WRITE_BATCH):
+		ret = hpt_ioctl_batch(file, ioctl_num, ioctl_param);
+		break;
+	case _IOC_NR(HPT_IOCTL_RESIZE):
+		ret = hpt_ioctl_resize(file, ioctl_num);
+		break;
 	default:
 		pr_info("IOCTL default\n");
 		break;
@@ -551,6 +1172,8 @@ static struct file_operations hpt_fops = {
     .release = hpt_release,
     .mmap = hpt_mmap,
 	.poll = hpt_poll,
+	.read_iter = hpt_io_read_iter,
+	.write_iter = hpt_io_write_iter,
 	.unlocked_ioctl = hpt_ioctl,
 };
 
@@ -560,6 +1183,8 @@ static int __init hpt_init(void)
 
     int ret;
 
+	BUILD_BUG_ON(offsetof(struct hpt_ring_buffer_element, data) != HPT_RB_ELEMENT_HEADER_SIZE);
+
     hpt_device = kzalloc(sizeof(struct hpt_dev), GFP_KERNEL);
     if (!hpt_device) { return -ENOMEM; }
 	
@@ -594,9 +1219,19 @@ static int __init hpt_init(void)
     }
 
 	mutex_init(&hpt_device->device_mutex);
+	INIT_LIST_HEAD(&hpt_device->devices);
+
+	ret = hpt_rx_pool_init();
+	if (ret) {
+		pr_err("Failed to start the RX pool\n");
+		goto destroy_device;
+	}
 
     return 0;
 
+destroy_device:
+	device_destroy(hpt_device->class, hpt_device->devt);
+
 destroy_class:
     class_destroy(hpt_device->class);
 del_cdev:
@@ -611,8 +1246,20 @@ free_hpt_device:
 
 static void __exit hpt_exit(void)
 {
+	struct hpt_net_device_info *dev_info, *tmp;
+
 	if(hpt_device)
 	{
+		/* Open files hold the module, only detached persistent devices can be left */
+		rtnl_lock();
+		list_for_each_entry_safe(dev_info, tmp, &hpt_device->devices, list)
+		{
+			hpt_destroy_device(dev_info);
+		}
+		rtnl_unlock();
+
+		hpt_rx_pool_exit();
+
 		device_destroy(hpt_device->class, hpt_device->devt);
 		class_destroy(hpt_device->class);
 		cdev_del(&hpt_device->cdev);
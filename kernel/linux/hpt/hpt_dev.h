@@ -26,18 +26,159 @@
 #include <linux/debugfs.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/hrtimer.h>
+#include <net/xdp.h>
 
 #include <hpt/hpt_common.h>
 
+#if KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE
+#define HAVE_NETDEV_XMIT_MORE
+#endif
+
 #if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
 #define HAVE_TX_TIMEOUT_TXQUEUE
 #endif
 
+#if KERNEL_VERSION(5, 7, 0) <= LINUX_VERSION_CODE
+#define HAVE_ETHTOOL_COALESCE_PARAMS
+#endif
+
+#if KERNEL_VERSION(5, 15, 0) <= LINUX_VERSION_CODE
+#define HAVE_ETHTOOL_COALESCE_KERNEL
+#endif
+
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+#define HAVE_HRTIMER_SETUP
+#endif
+
+#if KERNEL_VERSION(6, 1, 0) <= LINUX_VERSION_CODE
+#define HAVE_NETIF_NAPI_ADD_NO_WEIGHT
+#endif
+
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+#define HAVE_ETHTOOL_RINGPARAM_KERNEL
+#define HAVE_BPF_WARN_INVALID_XDP_ACTION_DEV
+#endif
+
+#if KERNEL_VERSION(6, 3, 0) <= LINUX_VERSION_CODE
+#define HAVE_XDP_FEATURES
+#endif
+
+#if KERNEL_VERSION(6, 11, 0) <= LINUX_VERSION_CODE
+#define HAVE_BPF_NET_CONTEXT
+#endif
+
 #define HPT_KTHREAD_RESCHEDULE_INTERVAL 0 /* us */
 #define HPT_BUFFER_COUNT 64000
 #define HPT_BUFFER_SIZE 4096
 #define HPT_BUFFER_HALF_SIZE (HPT_BUFFER_SIZE >> 1)
-#define HPT_SKB_COUNT 1024
+#define HPT_SKB_COUNT 64 /* preallocated RX skbs per device, about one sweep of a busy ring */
+#define HPT_SKB_CACHE_LEN (SKB_WITH_OVERHEAD(2048) - NET_SKB_PAD) /* larger packets bypass the skb cache */
+#define HPT_TX_BATCH 64 /* skbs held back for bulk freeing before a forced flush */
+#define HPT_COALESCE_MAX_USECS 100000
+#define HPT_RX_BUDGET_ALL SIZE_MAX
+#define HPT_RX_QUEUE_MAX 1024 /* skbs waiting for NAPI, like netdev_max_backlog for netif_rx() */
+
+/**********************************************************************************************//**
+* @brief Ring memory shared with userspace
+* Refcounted by the device and by every userspace mapping, so memory replaced by a resize stays
+* valid until userspace has unmapped it.
+**************************************************************************************************/
+struct hpt_ring_mem
+{
+    struct kref ref;
+    size_t size;
+    size_t num_blocks;
+    unsigned int order;
+    void *vaddr;
+    struct page *blocks[];
+};
+
+/**********************************************************************************************//**
+* @brief Token bucket pacing the RX thread, tokens are scaled by NSEC_PER_SEC to avoid divisions
+**************************************************************************************************/
+struct hpt_pacer
+{
+    spinlock_t lock; /* ioctl updates against the RX thread */
+    uint64_t rate_pps;
+    uint64_t rate_bytes; /* per second */
+    int64_t max_pkts;
+    int64_t max_bytes;
+    int64_t tokens_pkts;
+    int64_t tokens_bytes;
+    uint64_t last_ns;
+    uint32_t gen; /* bumped on every configuration change */
+    uint64_t throttle_start_ns;
+    uint64_t throttled;
+    uint64_t delay_ns;
+};
+
+/**********************************************************************************************//**
+* @brief Tokens one RX sweep may spend, taken from the pacer without holding its lock
+**************************************************************************************************/
+struct hpt_pacer_budget
+{
+    bool enabled;
+    bool throttled;
+    uint32_t gen;
+    uint64_t now_ns;
+    int64_t pkts;
+    int64_t bytes;
+};
+
+/**********************************************************************************************//**
+* @brief Moderation of TX ring notifications, set with ethtool -C tx-usecs/tx-frames/adaptive-tx
+* With usecs set, POLLIN is only reported once frames packets are queued or usecs have passed
+* since the first packet that was not signalled yet. Priority lane packets are signalled at once.
+**************************************************************************************************/
+struct hpt_tx_coalesce
+{
+    spinlock_t lock; /* TX paths against the timer and ethtool */
+    struct hrtimer timer;
+    uint32_t usecs; /* 0 signals every packet */
+    uint32_t frames; /* 0 for no packet limit */
+    bool adaptive; /* sparse traffic is signalled at once */
+    bool armed;
+    bool signalled; /* POLLIN may be reported for the queued packets */
+    uint32_t pending; /* packets queued since the last signal */
+    uint64_t last_ns; /* adaptive: time of the previous notification */
+};
+
+/**********************************************************************************************//**
+* @brief Preallocated RX skbs, only touched by the RX consumer of the device
+* Topped up between sweeps in process context, so the RX loop does not call the allocator and a
+* burst is not dropped because an atomic allocation failed.
+**************************************************************************************************/
+struct hpt_skb_cache
+{
+    unsigned int count;
+    unsigned int len; /* linear room of the cached skbs */
+    struct sk_buff *skbs[HPT_SKB_COUNT];
+};
+
+/**********************************************************************************************//**
+* @brief RX worker of the shared pool, services the devices on its run list round-robin
+**************************************************************************************************/
+struct hpt_rx_worker
+{
+    struct task_struct *thread;
+    spinlock_t lock; /* run_list and the rx_* state of its devices */
+    struct mutex run_mutex; /* held while a device is serviced */
+    struct list_head run_list;
+    wait_queue_head_t wait;
+    unsigned int cpu;
+};
+
+/**********************************************************************************************//**
+* @brief Pool of RX workers replacing the per-device kernel threads, see the rx_workers parameter
+**************************************************************************************************/
+struct hpt_rx_pool
+{
+    unsigned int nr_workers;
+    atomic_t next; /* round-robin assignment of new devices */
+    struct hpt_rx_worker *workers;
+};
 
 /**********************************************************************************************//**
 * @brief Structure containing information about a network device
@@ -45,18 +186,46 @@
 struct hpt_net_device_info
 {
 	char name[HPT_NAMESIZE];
+	struct list_head list; /* hpt_dev.devices */
+	bool persist;
+	bool attached; /* a file refers to the device, see HPT_IOCTL_ATTACH */
 	struct task_struct *pthread;
+	struct hpt_rx_worker *rx_worker; /* pool mode, set instead of pthread */
+	struct list_head rx_node;
+	bool rx_active;
+	bool rx_scheduled; /* on the run list or being serviced */
 	struct net_device *net_dev;
+    struct napi_struct napi;
+    struct sk_buff_head rx_queue;
+    struct hpt_skb_cache skb_cache;
+    struct bpf_prog __rcu *xdp_prog;
+    struct xdp_rxq_info xdp_rxq;
+    struct hpt_pacer pacer;
     wait_queue_head_t tx_busy;
+    struct hpt_tx_coalesce coal;
+    wait_queue_head_t rx_space; /* poll() waiters for room in the RX ring */
+    struct mutex rx_mutex; /* HPT_IOCTL_FLUSH_RX callers against each other and resizes */
+    struct mutex io_read_mutex; /* read() consumers of the TX rings against each other and resizes */
+    struct mutex io_write_mutex; /* write() producers of the RX ring against each other and resizes */
+    uint32_t tx_pending; /* copied into the TX ring, published at the end of an xmit_more burst */
+    uint32_t tx_pending_prio;
+    bool tx_resizing; /* the TX rings are being swapped, set and cleared under the TX queue lock */
+    struct sk_buff_head tx_done; /* sent skbs of the burst, freed together, under the TX queue lock */
     uint32_t ring_buffer_items;
+    uint32_t resize_items;
+    uint32_t flags;
+    uint32_t umem_frames;
+    uint32_t elem_size; /* bytes per ring element */
+    struct hpt_umem umem;
     struct hpt_ring_buffer *ring_info_rx;
     struct hpt_ring_buffer *ring_info_tx;
-    void *ring_memory;
-    size_t num_blocks;
-	size_t order;
+    struct hpt_ring_mem *mem;
     uint8_t *ring_data_rx;
     uint8_t *ring_data_tx;
-    void *pages_memory[8];
+    struct hpt_ring_buffer *ring_info_rx_prio; /* HPT_DEV_F_PRIO_LANE only */
+    struct hpt_ring_buffer *ring_info_tx_prio;
+    uint8_t *ring_data_rx_prio;
+    uint8_t *ring_data_tx_prio;
 };
 
 /**********************************************************************************************//**
@@ -69,14 +238,197 @@ struct hpt_dev
     struct cdev cdev;
     dev_t devt;
     struct mutex device_mutex;
+    struct list_head devices; /* all netdevs created by the module, under rtnl_lock */
 };
 
+extern struct hpt_rx_pool *hpt_rx_pool;
+
+/**********************************************************************************************//**
+* @brief hpt_ring_update_flags: Set and clear ring flags shared with userspace atomically
+* Fully ordered, like every successful cmpxchg.
+* @param ring: Ring header
+* @param set: Flags to set
+* @param clear: Flags to clear
+**************************************************************************************************/
+static inline void hpt_ring_update_flags(struct hpt_ring_buffer *ring, uint32_t set, uint32_t clear)
+{
+	uint32_t old, new;
+
+	do
+	{
+		old = READ_ONCE(ring->flags);
+		new = (old & ~clear) | set;
+	} while(cmpxchg(&ring->flags, old, new) != old);
+}
+
 /**********************************************************************************************//**
 * @brief hpt_net_rx: Handle transmitted network data for the network stack
 * @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+* @param budget: Maximum number of ring elements to consume, HPT_RX_BUDGET_ALL for no limit
 * @return Number of bytes received and processed
 **************************************************************************************************/
-size_t hpt_net_rx(struct hpt_net_device_info *hpt);
+size_t hpt_net_rx(struct hpt_net_device_info *hpt, size_t budget);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_init: Set up the GRO context and backlog queue used to deliver RX packets
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_net_rx_init(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_net_skb_cache_purge: Free the preallocated RX skbs, the RX consumer must be stopped
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_net_skb_cache_purge(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_net_coalesce_init: Set up TX notification moderation, disabled until ethtool -C
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_net_coalesce_init(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_net_coalesce_stop: Cancel the moderation timer once the device no longer transmits
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_net_coalesce_stop(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_readable: Check if POLLIN is to be reported for the TX rings
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+* @return true if userspace has packets to read and they were signalled
+**************************************************************************************************/
+bool hpt_net_tx_readable(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_net_set_pacing: Configure the token bucket applied to packets taken from the RX ring
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+* @param param: Rates and bursts, zero rates disable pacing
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+int hpt_net_set_pacing(struct hpt_net_device_info *hpt, const struct hpt_pacing_param *param);
+
+/**********************************************************************************************//**
+* @brief hpt_request_resize: Ask userspace to move both rings to memory for a new item count
+* The rings are migrated by HPT_IOCTL_RESIZE, see hpt_remap().
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+* @param ring_buffer_items: New number of items per ring, a power of two
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+int hpt_request_resize(struct hpt_net_device_info *hpt, uint32_t ring_buffer_items);
+
+/* Items of the rings the next allocation creates, a resize requested before there are rings needs no migration */
+static inline uint32_t hpt_alloc_ring_items(const struct hpt_net_device_info *dev_info)
+{
+	return dev_info->resize_items ? dev_info->resize_items : dev_info->ring_buffer_items;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_alloc: Allocate zeroed memory to share with userspace
+* @param size: Size in bytes, see hpt_memory_size()
+* @return Ring memory holding one reference, or NULL on failure
+**************************************************************************************************/
+struct hpt_ring_mem *hpt_ring_mem_alloc(size_t size);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_put: Drop a reference to ring memory, freeing it with the last one
+* @param mem: Ring memory
+**************************************************************************************************/
+void hpt_ring_mem_put(struct hpt_ring_mem *mem);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_map: Map ring memory into a userspace vma, the mapping holds a reference
+* @param mem: Ring memory
+* @param vma: Pointer to the vm_area_struct representing the memory area to map
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+int hpt_ring_mem_map(struct hpt_ring_mem *mem, struct vm_area_struct *vma);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_attach: Point the device rings at new ring memory and reset all rings
+* Hands the reference of mem over to the device. HPT_DEV_F_UMEM devices get the UMEM layout.
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+* @param mem: Ring memory
+* @param ring_buffer_items: Number of items per ring
+**************************************************************************************************/
+void hpt_ring_mem_attach(struct hpt_net_device_info *hpt, struct hpt_ring_mem *mem, uint32_t ring_buffer_items);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_migrate: Copy the unread elements of a ring to the start of an empty ring
+* @param old_ring: Header of the ring being replaced
+* @param old_data: Start of the data of the ring being replaced
+* @param old_items: Number of items of the ring being replaced
+* @param new_ring: Header of the new ring
+* @param new_data: Start of the data of the new ring
+* @param ring_buffer_items: Number of items of the new ring
+* @param elem_size: Bytes per element of both rings
+* @return Number of elements that did not fit and were dropped
+**************************************************************************************************/
+size_t hpt_ring_mem_migrate(struct hpt_ring_buffer *old_ring, uint8_t *old_data, size_t old_items,
+                            struct hpt_ring_buffer *new_ring, uint8_t *new_data, size_t ring_buffer_items, size_t elem_size);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pool_init: Start the shared RX workers if the rx_workers parameter asks for them
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+int hpt_rx_pool_init(void);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pool_exit: Stop the shared RX workers, no device may be in the pool any more
+**************************************************************************************************/
+void hpt_rx_pool_exit(void);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pool_add: Hand the RX rings of a device to a pool worker
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_rx_pool_add(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pool_remove: Take a device out of the pool, waits for a sweep in progress
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_rx_pool_remove(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pool_kick: Put a device with RX work on the run list of its worker
+* @param hpt: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+void hpt_rx_pool_kick(struct hpt_net_device_info *hpt);
+
+/**********************************************************************************************//**
+* @brief hpt_io_read_iter: Copy one TX ring packet to userspace, the read() of a TUN device
+* @param iocb: I/O control block of the file
+* @param to: Destination, a packet longer than it is truncated
+* @return Bytes copied, or a negative error code on failure
+**************************************************************************************************/
+ssize_t hpt_io_read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+/**********************************************************************************************//**
+* @brief hpt_io_write_iter: Copy one packet from userspace to the RX ring, the write() of a TUN device
+* @param iocb: I/O control block of the file
+* @param from: The whole packet
+* @return Packet length, or a negative error code on failure
+**************************************************************************************************/
+ssize_t hpt_io_write_iter(struct kiocb *iocb, struct iov_iter *from);
+
+/**********************************************************************************************//**
+* @brief hpt_io_read_batch: Copy up to batch->count TX ring packets to userspace buffers
+* @param hpt: Pointer to the hpt_net_device_info structure, NULL if the file has no device
+* @param batch: Buffers from HPT_IOCTL_READ_BATCH
+* @param nonblock: Fail with -EAGAIN instead of waiting for the first packet
+* @return Number of packets copied, or a negative error code if there was none
+**************************************************************************************************/
+int hpt_io_read_batch(struct hpt_net_device_info *hpt, const struct hpt_batch *batch, bool nonblock);
+
+/**********************************************************************************************//**
+* @brief hpt_io_write_batch: Copy up to batch->count packets from userspace to the RX ring
+* @param hpt: Pointer to the hpt_net_device_info structure, NULL if the file has no device
+* @param batch: Buffers from HPT_IOCTL_WRITE_BATCH
+* @param nonblock: Fail with -EAGAIN instead of waiting for room for the first packet
+* @return Number of packets copied, or a negative error code if there was none
+**************************************************************************************************/
+int hpt_io_write_batch(struct hpt_net_device_info *hpt, const struct hpt_batch *batch, bool nonblock);
 
 /**********************************************************************************************//**
 * @brief hpt_net_init: Initialize the network settings for the HPT device
@@ -0,0 +1,523 @@
+#include <hpt/hpt_common.h>
+#include "hpt_dev.h"
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+#include <net/checksum.h>
+
+extern struct hpt_dev *hpt_device;
+
+/**********************************************************************************************//**
+* @brief hpt_io_rings: Check the device can be used with read()/write() and give it rings
+* Rings are normally allocated by the first mmap, a TUN-style user may never map them. A later
+* mmap maps the same memory.
+* @param dev_info: Pointer to the hpt_net_device_info structure, NULL if the file has no device
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_io_rings(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_io_csum: Fill in the checksum of an HPT_CSUM_PARTIAL element, as skb_checksum_help() does
+* @param item: TX ring element
+**************************************************************************************************/
+static void hpt_io_csum(struct hpt_ring_buffer_element *item);
+
+/**********************************************************************************************//**
+* @brief hpt_io_tx_peek: Get the oldest TX ring packet, the priority ring first
+* Partial checksums are completed, read()/write() users have no way to see the checksum state.
+* Called with io_read_mutex held.
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param ring_info: Set to the ring the element belongs to, for hpt_set_read_item()
+* @return Pointer to the element, or NULL if both rings are empty
+**************************************************************************************************/
+static struct hpt_ring_buffer_element *hpt_io_tx_peek(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer **ring_info);
+
+/**********************************************************************************************//**
+* @brief hpt_io_rx_reserve: Get a free RX ring element to copy a packet to
+* Called with io_write_mutex held.
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param pending: Elements filled by the caller and not published yet
+* @return Pointer to the element, or NULL if the ring is full
+**************************************************************************************************/
+static struct hpt_ring_buffer_element *hpt_io_rx_reserve(struct hpt_net_device_info *dev_info, uint32_t pending);
+
+/**********************************************************************************************//**
+* @brief hpt_io_rx_commit: Fill the header of a reserved RX ring element
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param item: Element from hpt_io_rx_reserve()
+* @param len: Packet length, 0 if copying the packet failed
+* @param pending: Elements waiting for hpt_io_rx_publish(), incremented for a valid packet
+**************************************************************************************************/
+static void hpt_io_rx_commit(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer_element *item, uint32_t len, uint32_t *pending);
+
+/**********************************************************************************************//**
+* @brief hpt_io_rx_publish: Make the committed elements visible and wake the RX consumer
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param pending: Elements committed since the last publish
+**************************************************************************************************/
+static void hpt_io_rx_publish(struct hpt_net_device_info *dev_info, uint32_t pending);
+
+/**********************************************************************************************//**
+* @brief hpt_io_wait_tx: Sleep until the TX ring has packets for the reader
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param nonblock: Fail instead of sleeping
+* @return 0 once there are packets, or a negative error code
+**************************************************************************************************/
+static int hpt_io_wait_tx(struct hpt_net_device_info *dev_info, bool nonblock);
+
+/**********************************************************************************************//**
+* @brief hpt_io_wait_rx: Sleep until the RX ring has a free element
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param nonblock: Fail instead of sleeping
+* @return 0 once there is room, or a negative error code
+**************************************************************************************************/
+static int hpt_io_wait_rx(struct hpt_net_device_info *dev_info, bool nonblock);
+
+static int hpt_io_rings(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_ring_mem *mem;
+	uint32_t items;
+	size_t size;
+	int ret = 0;
+
+	if(!dev_info)
+	{
+		return -EBADFD;
+	}
+
+	/* Packets live in frames owned by userspace, there is no ring element to copy */
+	if(dev_info->flags & HPT_DEV_F_UMEM)
+	{
+		return -EOPNOTSUPP;
+	}
+
+	/* Pairs with the release in hpt_ring_mem_attach(), the ring pointers are set once mem is */
+	if(smp_load_acquire(&dev_info->mem))
+	{
+		return 0;
+	}
+
+	mutex_lock(&hpt_device->device_mutex);
+
+	if(!dev_info->mem)
+	{
+		items = hpt_alloc_ring_items(dev_info);
+		size = hpt_memory_size(dev_info->flags, items, dev_info->umem_frames, dev_info->elem_size);
+		mem = hpt_ring_mem_alloc(size);
+		if(mem)
+		{
+			hpt_ring_mem_attach(dev_info, mem, items);
+			hpt_rx_pool_kick(dev_info);
+		}
+		else
+		{
+			pr_err("Cannot allocate %u ring buffer items\n", items);
+			ret = -ENOMEM;
+		}
+	}
+
+	mutex_unlock(&hpt_device->device_mutex);
+
+	return ret;
+}
+
+static void hpt_io_csum(struct hpt_ring_buffer_element *item)
+{
+	unsigned int start = item->csum_start;
+	unsigned int offset = start + item->csum_offset;
+	__sum16 csum;
+
+	if(unlikely(start >= item->len || offset + sizeof(csum) > item->len))
+	{
+		return;
+	}
+
+	csum = csum_fold(csum_partial(item->data + start, item->len - start, 0)) ?: CSUM_MANGLED_0;
+	memcpy(item->data + offset, &csum, sizeof(csum));
+	item->csum_state = HPT_CSUM_UNNECESSARY;
+}
+
+static struct hpt_ring_buffer_element *hpt_io_tx_peek(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer **ring_info)
+{
+	struct hpt_ring_buffer_element *item;
+	size_t ring_buffer_items;
+	uint8_t *ring_data;
+
+	for(;;)
+	{
+		if(dev_info->ring_info_tx_prio && hpt_count_items(dev_info->ring_info_tx_prio))
+		{
+			*ring_info = dev_info->ring_info_tx_prio;
+			ring_data = dev_info->ring_data_tx_prio;
+			ring_buffer_items = HPT_PRIO_ITEMS;
+		}
+		else if(hpt_count_items(dev_info->ring_info_tx))
+		{
+			*ring_info = dev_info->ring_info_tx;
+			ring_data = dev_info->ring_data_tx;
+			ring_buffer_items = dev_info->ring_buffer_items;
+		}
+		else
+		{
+			return NULL;
+		}
+
+		item = hpt_get_item_at(*ring_info, ring_buffer_items, ring_data, dev_info->elem_size, 0);
+		if(likely(item))
+		{
+			break;
+		}
+
+		/* Only a userspace writer to the shared memory can corrupt a length, skip the element */
+		dev_info->net_dev->stats.tx_errors++;
+		hpt_set_read_item(*ring_info);
+	}
+
+	if(item->csum_state == HPT_CSUM_PARTIAL)
+	{
+		hpt_io_csum(item);
+	}
+
+	return item;
+}
+
+static struct hpt_ring_buffer_element *hpt_io_rx_reserve(struct hpt_net_device_info *dev_info, uint32_t pending)
+{
+	struct hpt_ring_buffer *ring_info = dev_info->ring_info_rx;
+	uint32_t write;
+
+	if(!(dev_info->flags & HPT_DEV_F_RX_MPSC))
+	{
+		return hpt_get_write_item_at(ring_info, dev_info->ring_buffer_items, dev_info->ring_data_rx, dev_info->elem_size, pending);
+	}
+
+	/* Same reservation as hpt_write_mp(), userspace producers may race for the slot */
+	do
+	{
+		write = ACQUIRE(&ring_info->write);
+		if(!hpt_free_items(ring_info, dev_info->ring_buffer_items))
+		{
+			return NULL;
+		}
+	} while(cmpxchg(&ring_info->write, write, write + 1) != write);
+
+	return (struct hpt_ring_buffer_element *)(dev_info->ring_data_rx + (dev_info->elem_size * hpt_ring_slot(write, dev_info->ring_buffer_items)));
+}
+
+static void hpt_io_rx_commit(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer_element *item, uint32_t len, uint32_t *pending)
+{
+	item->len = len;
+	item->csum_state = HPT_CSUM_NONE;
+	item->csum_start = 0;
+	item->csum_offset = 0;
+
+	if(dev_info->flags & HPT_DEV_F_RX_MPSC)
+	{
+		/* A reserved slot has to be handed over even if the copy failed, the consumer drops it */
+		STORE(&item->flags, HPT_ELEM_F_READY);
+		return;
+	}
+
+	if(len)
+	{
+		item->flags = 0;
+		(*pending)++;
+	}
+}
+
+static void hpt_io_rx_publish(struct hpt_net_device_info *dev_info, uint32_t pending)
+{
+	struct hpt_ring_buffer *ring_info = dev_info->ring_info_rx;
+
+	if(pending)
+	{
+		STORE(&ring_info->write, ring_info->write + pending);
+	}
+
+	/* Orders the write index store before the flag load, as hpt_rx_kick() in userspace */
+	smp_mb();
+
+	if(READ_ONCE(ring_info->flags) & HPT_RING_F_NEED_WAKEUP)
+	{
+		hpt_rx_pool_kick(dev_info);
+	}
+}
+
+static int hpt_io_wait_tx(struct hpt_net_device_info *dev_info, bool nonblock)
+{
+	if(nonblock)
+	{
+		return -EAGAIN;
+	}
+
+	/* Woken by hpt_net_tx_notify(), so TX coalescing also moderates blocking readers */
+	if(wait_event_interruptible(dev_info->tx_busy, hpt_net_tx_readable(dev_info)))
+	{
+		return -ERESTARTSYS;
+	}
+
+	return 0;
+}
+
+static int hpt_io_wait_rx(struct hpt_net_device_info *dev_info, bool nonblock)
+{
+	if(nonblock)
+	{
+		return -EAGAIN;
+	}
+
+	if(wait_event_interruptible(dev_info->rx_space, hpt_free_items(dev_info->ring_info_rx, dev_info->ring_buffer_items) > 0))
+	{
+		return -ERESTARTSYS;
+	}
+
+	return 0;
+}
+
+ssize_t hpt_io_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct hpt_net_device_info *dev_info = iocb->ki_filp->private_data;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	struct hpt_ring_buffer *ring_info;
+	struct hpt_ring_buffer_element *item;
+	size_t len;
+	ssize_t ret;
+
+	ret = hpt_io_rings(dev_info);
+	if(ret)
+	{
+		return ret;
+	}
+
+	if(!iov_iter_count(to))
+	{
+		return 0;
+	}
+
+	for(;;)
+	{
+		if(mutex_lock_interruptible(&dev_info->io_read_mutex))
+		{
+			return -ERESTARTSYS;
+		}
+
+		item = hpt_io_tx_peek(dev_info, &ring_info);
+		if(item)
+		{
+			/* Like TUN, a short buffer gets the start of the packet and the rest is dropped */
+			len = min_t(size_t, item->len, iov_iter_count(to));
+			if(copy_to_iter(item->data, len, to) == len)
+			{
+				hpt_set_read_item(ring_info);
+				ret = len;
+			}
+			else
+			{
+				ret = -EFAULT;
+			}
+		}
+
+		mutex_unlock(&dev_info->io_read_mutex);
+
+		if(item)
+		{
+			return ret;
+		}
+
+		ret = hpt_io_wait_tx(dev_info, nonblock);
+		if(ret)
+		{
+			return ret;
+		}
+	}
+}
+
+ssize_t hpt_io_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct hpt_net_device_info *dev_info = iocb->ki_filp->private_data;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	struct hpt_ring_buffer_element *item;
+	size_t len = iov_iter_count(from);
+	uint32_t pending = 0;
+	ssize_t ret;
+
+	ret = hpt_io_rings(dev_info);
+	if(ret)
+	{
+		return ret;
+	}
+
+	if(len == 0 || len > dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE)
+	{
+		return -EINVAL;
+	}
+
+	for(;;)
+	{
+		if(mutex_lock_interruptible(&dev_info->io_write_mutex))
+		{
+			return -ERESTARTSYS;
+		}
+
+		item = hpt_io_rx_reserve(dev_info, 0);
+		if(item)
+		{
+			ret = copy_from_iter_full(item->data, len, from) ? len : -EFAULT;
+			hpt_io_rx_commit(dev_info, item, ret > 0 ? len : 0, &pending);
+			hpt_io_rx_publish(dev_info, pending);
+		}
+
+		mutex_unlock(&dev_info->io_write_mutex);
+
+		if(item)
+		{
+			return ret;
+		}
+
+		ret = hpt_io_wait_rx(dev_info, nonblock);
+		if(ret)
+		{
+			return ret;
+		}
+	}
+}
+
+int hpt_io_read_batch(struct hpt_net_device_info *dev_info, const struct hpt_batch *batch, bool nonblock)
+{
+	struct hpt_batch_buf __user *bufs = u64_to_user_ptr(batch->bufs);
+	uint32_t count = min_t(uint32_t, batch->count, HPT_BATCH_MAX);
+	struct hpt_ring_buffer *ring_info;
+	struct hpt_ring_buffer_element *item;
+	struct hpt_batch_buf buf;
+	uint32_t n = 0;
+	uint32_t len;
+	int ret;
+
+	ret = hpt_io_rings(dev_info);
+	if(ret)
+	{
+		return ret;
+	}
+
+	while(count)
+	{
+		if(mutex_lock_interruptible(&dev_info->io_read_mutex))
+		{
+			return -ERESTARTSYS;
+		}
+
+		for(; n < count; n++)
+		{
+			item = hpt_io_tx_peek(dev_info, &ring_info);
+			if(!item)
+			{
+				break;
+			}
+
+			if(copy_from_user(&buf, &bufs[n], sizeof(buf)))
+			{
+				ret = -EFAULT;
+				break;
+			}
+
+			len = min_t(uint32_t, item->len, buf.len);
+			if(copy_to_user(u64_to_user_ptr(buf.addr), item->data, len) || put_user(len, &bufs[n].len))
+			{
+				ret = -EFAULT;
+				break;
+			}
+
+			hpt_set_read_item(ring_info);
+		}
+
+		mutex_unlock(&dev_info->io_read_mutex);
+
+		/* Only the first packet is waited for, the rest is whatever is queued by then */
+		if(n || ret)
+		{
+			break;
+		}
+
+		ret = hpt_io_wait_tx(dev_info, nonblock);
+		if(ret)
+		{
+			break;
+		}
+	}
+
+	return n ? n : ret;
+}
+
+int hpt_io_write_batch(struct hpt_net_device_info *dev_info, const struct hpt_batch *batch, bool nonblock)
+{
+	struct hpt_batch_buf __user *bufs = u64_to_user_ptr(batch->bufs);
+	uint32_t count = min_t(uint32_t, batch->count, HPT_BATCH_MAX);
+	struct hpt_ring_buffer_element *item;
+	struct hpt_batch_buf buf;
+	uint32_t pending = 0;
+	uint32_t n = 0;
+	bool copied;
+	int ret;
+
+	ret = hpt_io_rings(dev_info);
+	if(ret)
+	{
+		return ret;
+	}
+
+	while(count)
+	{
+		if(mutex_lock_interruptible(&dev_info->io_write_mutex))
+		{
+			return -ERESTARTSYS;
+		}
+
+		for(; n < count; n++)
+		{
+			if(copy_from_user(&buf, &bufs[n], sizeof(buf)))
+			{
+				ret = -EFAULT;
+				break;
+			}
+
+			if(buf.len == 0 || buf.len > dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE)
+			{
+				ret = -EINVAL;
+				break;
+			}
+
+			item = hpt_io_rx_reserve(dev_info, pending);
+			if(!item)
+			{
+				break;
+			}
+
+			copied = !copy_from_user(item->data, u64_to_user_ptr(buf.addr), buf.len);
+			hpt_io_rx_commit(dev_info, item, copied ? buf.len : 0, &pending);
+			if(!copied)
+			{
+				ret = -EFAULT;
+				break;
+			}
+		}
+
+		/* One index store and at most one wakeup for the whole batch */
+		hpt_io_rx_publish(dev_info, pending);
+		pending = 0;
+
+		mutex_unlock(&dev_info->io_write_mutex);
+
+		if(n || ret)
+		{
+			break;
+		}
+
+		ret = hpt_io_wait_rx(dev_info, nonblock);
+		if(ret)
+		{
+			break;
+		}
+	}
+
+	return n ? n : ret;
+}
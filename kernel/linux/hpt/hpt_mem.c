@@ -0,0 +1,239 @@
+#include <hpt/hpt_common.h>
+#include "hpt_dev.h"
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_release: Free the blocks of ring memory once the last reference is gone
+* @param ref: Reference counter embedded in the hpt_ring_mem structure
+**************************************************************************************************/
+static void hpt_ring_mem_release(struct kref *ref);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_vm_open: Take a reference for a copied or split userspace mapping
+* @param vma: Pointer to the vm_area_struct of the mapping
+**************************************************************************************************/
+static void hpt_ring_mem_vm_open(struct vm_area_struct *vma);
+
+/**********************************************************************************************//**
+* @brief hpt_ring_mem_vm_close: Drop the reference of an unmapped userspace mapping
+* @param vma: Pointer to the vm_area_struct of the mapping
+**************************************************************************************************/
+static void hpt_ring_mem_vm_close(struct vm_area_struct *vma);
+
+static const struct vm_operations_struct hpt_ring_mem_vm_ops = {
+	.open = hpt_ring_mem_vm_open,
+	.close = hpt_ring_mem_vm_close,
+};
+
+struct hpt_ring_mem *hpt_ring_mem_alloc(size_t size)
+{
+	struct hpt_ring_mem *mem;
+	struct page **pages;
+	size_t block_size;
+	size_t num_pages;
+	size_t num_blocks;
+	unsigned int order;
+
+	/* Blocks of PAGES_PER_BLOCK pages, smaller rings fit in a single block of their own size */
+	order = get_order(min_t(size_t, size, PAGES_PER_BLOCK * PAGE_SIZE));
+	block_size = PAGE_SIZE << order;
+	size = PAGE_ALIGN(size);
+	num_blocks = DIV_ROUND_UP(size, block_size);
+	num_pages = num_blocks << order;
+
+	mem = kzalloc(struct_size(mem, blocks, num_blocks), GFP_KERNEL);
+	if(!mem)
+	{
+		return NULL;
+	}
+
+	kref_init(&mem->ref);
+	mem->size = size;
+	mem->order = order;
+
+	pages = kvmalloc_array(num_pages, sizeof(struct page *), GFP_KERNEL);
+	if(!pages)
+	{
+		goto free_mem;
+	}
+
+	for(size_t b = 0; b < num_blocks; b++)
+	{
+		/* Zeroed, the memory ends up in userspace */
+		mem->blocks[b] = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, order);
+		if(!mem->blocks[b])
+		{
+			pr_err("Cannot allocate memory block %zu\n", b);
+			goto free_pages;
+		}
+		mem->num_blocks++;
+
+		for(size_t i = 0; i < (1UL << order); i++)
+		{
+			pages[(b << order) + i] = mem->blocks[b] + i;
+		}
+	}
+
+	/* The kernel addresses both rings through one contiguous view, like userspace does */
+	mem->vaddr = vmap(pages, num_pages, VM_MAP, PAGE_KERNEL);
+	if(!mem->vaddr)
+	{
+		pr_err("vmap of %zu pages failed\n", num_pages);
+		goto free_pages;
+	}
+
+	kvfree(pages);
+
+	return mem;
+
+free_pages:
+	kvfree(pages);
+	for(size_t b = 0; b < mem->num_blocks; b++)
+	{
+		__free_pages(mem->blocks[b], order);
+	}
+
+free_mem:
+	kfree(mem);
+	return NULL;
+}
+
+static void hpt_ring_mem_release(struct kref *ref)
+{
+	struct hpt_ring_mem *mem = container_of(ref, struct hpt_ring_mem, ref);
+
+	vunmap(mem->vaddr);
+
+	for(size_t b = 0; b < mem->num_blocks; b++)
+	{
+		__free_pages(mem->blocks[b], mem->order);
+	}
+
+	kfree(mem);
+}
+
+void hpt_ring_mem_put(struct hpt_ring_mem *mem)
+{
+	kref_put(&mem->ref, hpt_ring_mem_release);
+}
+
+static void hpt_ring_mem_vm_open(struct vm_area_struct *vma)
+{
+	struct hpt_ring_mem *mem = vma->vm_private_data;
+
+	kref_get(&mem->ref);
+}
+
+static void hpt_ring_mem_vm_close(struct vm_area_struct *vma)
+{
+	hpt_ring_mem_put(vma->vm_private_data);
+}
+
+int hpt_ring_mem_map(struct hpt_ring_mem *mem, struct vm_area_struct *vma)
+{
+	size_t block_size = PAGE_SIZE << mem->order;
+	size_t size = min_t(size_t, vma->vm_end - vma->vm_start, mem->size);
+	size_t off;
+
+	for(size_t b = 0; b < mem->num_blocks && b * block_size < size; b++)
+	{
+		off = b * block_size;
+		if(remap_pfn_range(vma, vma->vm_start + off, page_to_pfn(mem->blocks[b]),
+		                   min_t(size_t, block_size, size - off), vma->vm_page_prot))
+		{
+			pr_err("Failed to remap block %zu\n", b);
+			return -EIO;
+		}
+	}
+
+	/* Pages of a pfn mapping are not refcounted, the mapping keeps the memory alive instead */
+	kref_get(&mem->ref);
+	vma->vm_private_data = mem;
+	vma->vm_ops = &hpt_ring_mem_vm_ops;
+
+	return 0;
+}
+
+void hpt_ring_mem_attach(struct hpt_net_device_info *dev_info, struct hpt_ring_mem *mem, uint32_t ring_buffer_items)
+{
+	dev_info->ring_buffer_items = ring_buffer_items;
+	dev_info->resize_items = 0;
+
+	if(dev_info->flags & HPT_DEV_F_UMEM)
+	{
+		hpt_umem_layout(&dev_info->umem, mem->vaddr, ring_buffer_items, dev_info->umem_frames);
+		memset(dev_info->umem.fill, 0, 4 * sizeof(struct hpt_ring_buffer));
+
+		/* hpt_poll() and the RX thread look at these */
+		dev_info->ring_info_tx = dev_info->umem.tx;
+		dev_info->ring_info_rx = dev_info->umem.rx;
+		dev_info->ring_data_tx = NULL;
+		dev_info->ring_data_rx = NULL;
+		smp_store_release(&dev_info->mem, mem);
+		return;
+	}
+
+	/* Same layout as hpt_alloc() in the library */
+	dev_info->ring_info_tx = (struct hpt_ring_buffer *)mem->vaddr;
+	dev_info->ring_info_rx = dev_info->ring_info_tx + 1;
+	dev_info->ring_data_tx = (uint8_t *)(dev_info->ring_info_rx + 1);
+	dev_info->ring_data_rx = dev_info->ring_data_tx + (ring_buffer_items * dev_info->elem_size);
+
+	memset(dev_info->ring_info_tx, 0, sizeof(struct hpt_ring_buffer));
+	memset(dev_info->ring_info_rx, 0, sizeof(struct hpt_ring_buffer));
+
+	dev_info->ring_info_tx->max_block_ind = DIV_ROUND_UP(ring_buffer_items, PAGES_PER_BLOCK);
+	dev_info->ring_info_rx->max_block_ind = DIV_ROUND_UP(ring_buffer_items, PAGES_PER_BLOCK);
+
+	if(dev_info->flags & HPT_DEV_F_PRIO_LANE)
+	{
+		/* The priority lane follows the bulk rings, see hpt_memory_size() */
+		dev_info->ring_info_tx_prio = (struct hpt_ring_buffer *)((uint8_t *)mem->vaddr + hpt_ring_memory_size(ring_buffer_items, dev_info->elem_size));
+		dev_info->ring_info_rx_prio = dev_info->ring_info_tx_prio + 1;
+		dev_info->ring_data_tx_prio = (uint8_t *)(dev_info->ring_info_rx_prio + 1);
+		dev_info->ring_data_rx_prio = dev_info->ring_data_tx_prio + (HPT_PRIO_ITEMS * dev_info->elem_size);
+
+		memset(dev_info->ring_info_tx_prio, 0, sizeof(struct hpt_ring_buffer));
+		memset(dev_info->ring_info_rx_prio, 0, sizeof(struct hpt_ring_buffer));
+
+		dev_info->ring_info_tx_prio->max_block_ind = 1;
+		dev_info->ring_info_rx_prio->max_block_ind = 1;
+	}
+
+	/* Last: hpt_io_rings() checks mem without the device mutex and then uses the ring pointers */
+	smp_store_release(&dev_info->mem, mem);
+}
+
+size_t hpt_ring_mem_migrate(struct hpt_ring_buffer *old_ring, uint8_t *old_data, size_t old_items,
+                            struct hpt_ring_buffer *new_ring, uint8_t *new_data, size_t ring_buffer_items, size_t elem_size)
+{
+	struct hpt_ring_buffer_element *src;
+	struct hpt_ring_buffer_element *dst;
+	size_t num = min_t(size_t, hpt_count_items(old_ring), old_items);
+	size_t moved = 0;
+
+	for(size_t n = 0; n < num; n++)
+	{
+		src = hpt_get_item_at(old_ring, old_items, old_data, elem_size, n);
+		if(!src)
+		{
+			continue;
+		}
+
+		dst = hpt_get_write_item_at(new_ring, ring_buffer_items, new_data, elem_size, moved);
+		if(!dst)
+		{
+			break;
+		}
+
+		memcpy(dst, src, HPT_RB_ELEMENT_HEADER_SIZE + src->len);
+		moved++;
+	}
+
+	STORE(&new_ring->write, moved);
+
+	return num - moved;
+}
@@ -1,4 +1,40 @@
 #include "hpt_dev.h"
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/bpf_trace.h>
+#include <net/xdp.h>
+#include <linux/pkt_sched.h>
+
+/* DSCP code points that go through the priority lane: EF and CS6 and above */
+#define HPT_DSCP_EF 46
+#define HPT_DSCP_CS6 48
+
+/**********************************************************************************************//**
+* @brief State shared by the ring sweeps of one hpt_net_rx() call
+**************************************************************************************************/
+struct hpt_net_rx_sweep
+{
+	struct bpf_prog *xdp_prog;
+	bool xdp_redirect;
+	struct hpt_pacer_budget pace;
+	size_t budget; /* ring elements left for this call */
+	struct list_head rx_list;
+};
+
+/**********************************************************************************************//**
+* @brief hpt_net_dev_init: Register the XDP RX queue info when the netdev is registered
+* The RX thread and HPT_IOCTL_FLUSH_RX run the XDP program whether or not the interface is up,
+* so the queue info has to live as long as the registration, not from open to stop.
+* @param dev: Pointer to the net_device structure representing the network device
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_net_dev_init(struct net_device *dev);
+
+/**********************************************************************************************//**
+* @brief hpt_net_dev_uninit: Unregister the XDP RX queue info when the netdev is unregistered
+* @param dev: Pointer to the net_device structure representing the network device
+**************************************************************************************************/
+static void hpt_net_dev_uninit(struct net_device *dev);
 
 /**********************************************************************************************//**
 * @brief hpt_net_open: Open the network interface for the HPT device
@@ -74,6 +110,321 @@ static int hpt_net_change_carrier(struct net_device *dev, bool new_carrier);
 **************************************************************************************************/
 static void hpt_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info);
 
+/**********************************************************************************************//**
+* @brief hpt_get_ringparam: Report the number of items of the TX and RX rings
+* A resize that userspace has not applied yet is reported as the current size.
+* @param dev: Pointer to the net_device structure representing the network device
+* @param ring: Pointer to the ethtool_ringparam structure to populate
+**************************************************************************************************/
+#ifdef HAVE_ETHTOOL_RINGPARAM_KERNEL
+static void hpt_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                              struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack);
+#else
+static void hpt_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring);
+#endif
+
+/**********************************************************************************************//**
+* @brief hpt_set_ringparam: Resize the TX and RX rings, both rings always have the same size
+* @param dev: Pointer to the net_device structure representing the network device
+* @param ring: Pointer to the ethtool_ringparam structure with the requested sizes
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+#ifdef HAVE_ETHTOOL_RINGPARAM_KERNEL
+static int hpt_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                             struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack);
+#else
+static int hpt_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring);
+#endif
+
+/**********************************************************************************************//**
+* @brief hpt_get_coalesce: Report the TX notification moderation
+* @param dev: Pointer to the net_device structure representing the network device
+* @param ec: Pointer to the ethtool_coalesce structure to populate
+* @return 0
+**************************************************************************************************/
+#ifdef HAVE_ETHTOOL_COALESCE_KERNEL
+static int hpt_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal, struct netlink_ext_ack *extack);
+#else
+static int hpt_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec);
+#endif
+
+/**********************************************************************************************//**
+* @brief hpt_set_coalesce: Set the TX notification moderation, packets already queued are signalled
+* @param dev: Pointer to the net_device structure representing the network device
+* @param ec: Pointer to the ethtool_coalesce structure with tx-usecs, tx-frames and adaptive-tx
+* @return 0 on success, or -EINVAL for out of range values or tx-frames without tx-usecs
+**************************************************************************************************/
+#ifdef HAVE_ETHTOOL_COALESCE_KERNEL
+static int hpt_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal, struct netlink_ext_ack *extack);
+#else
+static int hpt_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec);
+#endif
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_notify: Tell userspace about n new TX packets, subject to the moderation
+* Resizes stop the TX queue and the RX thread first, so the TX rings stay in place meanwhile.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param n: Number of packets published
+* @param urgent: Signal at once, for priority lane packets
+**************************************************************************************************/
+static void hpt_net_tx_notify(struct hpt_net_device_info *dev_info, uint32_t n, bool urgent);
+
+/**********************************************************************************************//**
+* @brief hpt_net_coalesce_timer: Signal the packets queued when the moderation time ran out
+* @param timer: Timer of the hpt_tx_coalesce structure
+* @return HRTIMER_NORESTART, the next unsignalled packet arms it again
+**************************************************************************************************/
+static enum hrtimer_restart hpt_net_coalesce_timer(struct hrtimer *timer);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_csum: Apply the checksum state userspace attached to an RX ring element
+* @param skb: Pointer to the sk_buff structure containing the packet
+* @param csum_state: One of HPT_CSUM_UNNECESSARY, HPT_CSUM_NONE or HPT_CSUM_PARTIAL
+* @param csum_start: Offset from the start of the packet where checksumming starts
+* @param csum_offset: Offset from csum_start where the checksum is stored
+* @return 0 on success, or a negative error code if the offsets are out of range
+**************************************************************************************************/
+static int hpt_net_rx_csum(struct sk_buff *skb, u8 csum_state, u16 csum_start, u16 csum_offset);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_meta: Fill the metadata block of a TX ring element from the skb
+* @param skb: Pointer to the sk_buff structure containing the packet
+* @param meta: Metadata block of the ring element
+**************************************************************************************************/
+static void hpt_net_tx_meta(struct sk_buff *skb, struct hpt_ring_buffer_element_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_meta: Apply the metadata block userspace attached to an RX ring element
+* @param skb: Pointer to the sk_buff structure containing the packet
+* @param meta: Copy of the metadata block of the ring element
+**************************************************************************************************/
+static void hpt_net_rx_meta(struct sk_buff *skb, const struct hpt_ring_buffer_element_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_release: Hand an RX ring element back to userspace
+* @param ring_info: Ring the element belongs to
+* @param item: Element at the read index
+* @param mpsc: The ring has several producers, see HPT_DEV_F_RX_MPSC
+**************************************************************************************************/
+static inline void hpt_net_rx_release(struct hpt_ring_buffer *ring_info, struct hpt_ring_buffer_element *item, bool mpsc);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_ring: Turn the packets of one RX ring into skbs on the sweep list
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param sweep: XDP program, pacing budget and skb list of the current hpt_net_rx() call
+* @param ring_info: Ring header
+* @param ring_data: Start of the ring data
+* @param ring_buffer_items: Number of items in the ring
+* @param mpsc: The ring has several producers, see HPT_DEV_F_RX_MPSC
+* @return Number of packets added to the sweep list
+**************************************************************************************************/
+static size_t hpt_net_rx_ring(struct hpt_net_device_info *dev_info, struct hpt_net_rx_sweep *sweep,
+                              struct hpt_ring_buffer *ring_info, uint8_t *ring_data, size_t ring_buffer_items, bool mpsc);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_is_prio: Decide whether a packet goes through the priority lane
+* Interactive and control traffic by skb->priority, otherwise EF and CS6+ by the DSCP field.
+* @param skb: Pointer to the sk_buff structure of the packet
+* @return true for latency-sensitive packets
+**************************************************************************************************/
+static bool hpt_net_tx_is_prio(struct sk_buff *skb);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_deliver: Hand a batch of RX packets to the network stack
+* With GRO enabled the batch is queued for the device NAPI context, otherwise it is passed to
+* netif_receive_skb_list() directly.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param rx_list: List of skbs collected during one sweep of the RX ring
+**************************************************************************************************/
+static void hpt_net_rx_deliver(struct hpt_net_device_info *dev_info, struct list_head *rx_list);
+
+/**********************************************************************************************//**
+* @brief hpt_net_poll: NAPI poll function, runs queued RX packets through GRO
+* @param napi: Pointer to the napi_struct of the device
+* @param budget: Maximum number of packets to process
+* @return Number of packets processed
+**************************************************************************************************/
+static int hpt_net_poll(struct napi_struct *napi, int budget);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_prepare: Set protocol, headers, metadata and checksum state of an RX skb
+* @param skb: Pointer to the sk_buff structure holding the copied packet
+* @param csum_state: One of HPT_CSUM_UNNECESSARY, HPT_CSUM_NONE or HPT_CSUM_PARTIAL
+* @param csum_start: Offset from the start of the packet where checksumming starts
+* @param csum_offset: Offset from csum_start where the checksum is stored
+* @param meta: Copy of the metadata block of the ring element, or NULL
+* @return 0 if the skb can be delivered, or a negative error code if it must be dropped
+**************************************************************************************************/
+static int hpt_net_rx_prepare(struct sk_buff *skb, u8 csum_state, u16 csum_start, u16 csum_offset,
+                              const struct hpt_ring_buffer_element_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_umem: Copy a packet into a frame from the fill ring and post it on the TX ring
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param skb: Pointer to the sk_buff structure containing the packet
+* @param more: The stack has more packets queued for us, see hpt_net_tx_done()
+* @return NETDEV_TX_OK, packets without a free frame are dropped
+**************************************************************************************************/
+static int hpt_net_tx_umem(struct hpt_net_device_info *dev_info, struct sk_buff *skb, bool more);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_umem: Handle the RX descriptor ring of an HPT_DEV_F_UMEM device
+* Frames go back to userspace through the completion ring as soon as they are copied.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param budget: Maximum number of descriptors to consume
+* @return Number of packets handed to the network stack
+**************************************************************************************************/
+static size_t hpt_net_rx_umem(struct hpt_net_device_info *dev_info, size_t budget);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_space: Wake writers polling for room after slots of the RX ring were consumed
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+static inline void hpt_net_rx_space(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_net_skb_cache_refill: Refill the skb cache once half of it is used
+* Called before a sweep that has packets to take, may sleep.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+static void hpt_net_skb_cache_refill(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_net_skb_get: Get an skb for an RX packet, from the cache if the packet fits
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param len: Packet length
+* @return Empty skb with room for len bytes, or NULL
+**************************************************************************************************/
+static inline struct sk_buff *hpt_net_skb_get(struct hpt_net_device_info *dev_info, unsigned int len);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_publish: Make the n elements from the write index on visible to userspace
+* @param ring_info: TX ring header
+* @param ring_buffer_items: Number of items in the ring
+* @param n: Number of filled elements
+**************************************************************************************************/
+static inline void hpt_net_tx_publish(struct hpt_ring_buffer *ring_info, size_t ring_buffer_items, uint32_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_reserve: Get the TX ring element after the ones filled earlier in the burst
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param ring_info: TX ring header
+* @param ring_data: Start of the ring data
+* @param ring_buffer_items: Number of items in the ring
+* @param pending: Elements filled but not yet published
+* @param len: Length of the packet
+* @return Pointer to the element, or NULL if the ring is full or len does not fit
+**************************************************************************************************/
+static inline struct hpt_ring_buffer_element *hpt_net_tx_reserve(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer *ring_info,
+                                                                 uint8_t *ring_data, size_t ring_buffer_items, uint32_t pending,
+                                                                 unsigned int len);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_done: Finish one ndo_start_xmit call, flushing at the end of the burst
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param skb: Sent skb to free with the burst, NULL for a dropped packet that was already freed
+* @param more: netdev_xmit_more(), the stack calls us again before the queue lock is released
+**************************************************************************************************/
+static inline void hpt_net_tx_done(struct hpt_net_device_info *dev_info, struct sk_buff *skb, bool more);
+
+/**********************************************************************************************//**
+* @brief hpt_net_tx_flush: Publish the filled TX elements, wake the reader once and free the sent skbs
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+**************************************************************************************************/
+static void hpt_net_tx_flush(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_net_xdp_tx_frame: Copy an XDP frame into the TX ring
+* The caller holds the lock of TX queue 0, hpt_net_tx() is the other producer.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param data: Packet data
+* @param len: Packet length
+* @return 0 on success, or -ENOSPC if the ring is full
+**************************************************************************************************/
+static int hpt_net_xdp_tx_frame(struct hpt_net_device_info *dev_info, const void *data, unsigned int len);
+
+/**********************************************************************************************//**
+* @brief hpt_net_rx_xdp: Run the XDP program on a packet from the RX ring
+* The packet is copied into a page fragment with XDP headroom, so XDP_PASS turns it into an skb
+* without another copy.
+* @param dev_info: Pointer to the hpt_net_device_info structure containing the device information
+* @param prog: Attached XDP program
+* @param data: Packet data in the ring element
+* @param len: Packet length
+* @param redirect: Set when the packet was redirected and xdp_do_flush() is due
+* @return The skb for XDP_PASS, NULL if the program consumed or dropped the packet
+**************************************************************************************************/
+static struct sk_buff *hpt_net_rx_xdp(struct hpt_net_device_info *dev_info, struct bpf_prog *prog,
+                                      const uint8_t *data, unsigned int len, bool *redirect);
+
+/**********************************************************************************************//**
+* @brief hpt_net_bpf: Attach or detach an XDP program
+* @param dev: Pointer to the net_device structure representing the network device
+* @param bpf: Command from the core
+* @return 0 on success, or a negative error code on failure
+**************************************************************************************************/
+static int hpt_net_bpf(struct net_device *dev, struct netdev_bpf *bpf);
+
+/**********************************************************************************************//**
+* @brief hpt_net_xdp_xmit: Send frames redirected to this device by XDP programs to userspace
+* @param dev: Pointer to the net_device structure representing the network device
+* @param n: Number of frames
+* @param frames: Frames to send
+* @param flags: XDP_XMIT_FLUSH to wake userspace
+* @return Number of frames sent, the core frees the rest
+**************************************************************************************************/
+static int hpt_net_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags);
+
+/**********************************************************************************************//**
+* @brief hpt_pacer_begin: Refill the token bucket and hand its tokens to an RX sweep
+* @param pacer: Token bucket of the device
+* @param budget: Tokens of the sweep, disabled when no rate is set
+**************************************************************************************************/
+static void hpt_pacer_begin(struct hpt_pacer *pacer, struct hpt_pacer_budget *budget);
+
+/**********************************************************************************************//**
+* @brief hpt_pacer_admit: Spend tokens on a packet
+* A packet is admitted while tokens are left and may overdraw them, so packets larger than the
+* burst still get through.
+* @param budget: Tokens of the sweep
+* @param len: Packet length
+* @return True if the packet may be taken from the ring, false to leave it there
+**************************************************************************************************/
+static inline bool hpt_pacer_admit(struct hpt_pacer_budget *budget, unsigned int len);
+
+/**********************************************************************************************//**
+* @brief hpt_pacer_end: Return the tokens left by an RX sweep and account pacing delay
+* @param pacer: Token bucket of the device
+* @param budget: Tokens of the sweep
+**************************************************************************************************/
+static void hpt_pacer_end(struct hpt_pacer *pacer, const struct hpt_pacer_budget *budget);
+
+/**********************************************************************************************//**
+* @brief hpt_get_sset_count: Number of device statistics reported by ethtool -S
+* @param dev: Pointer to the net_device structure representing the network device
+* @param sset: String set
+* @return Number of entries, or -EOPNOTSUPP
+**************************************************************************************************/
+static int hpt_get_sset_count(struct net_device *dev, int sset);
+
+/**********************************************************************************************//**
+* @brief hpt_get_strings: Names of the device statistics
+* @param dev: Pointer to the net_device structure representing the network device
+* @param sset: String set
+* @param data: Buffer of ETH_GSTRING_LEN sized names
+**************************************************************************************************/
+static void hpt_get_strings(struct net_device *dev, u32 sset, u8 *data);
+
+/**********************************************************************************************//**
+* @brief hpt_get_ethtool_stats: Values of the device statistics
+* @param dev: Pointer to the net_device structure representing the network device
+* @param stats: Unused
+* @param data: Values in the order of hpt_get_strings()
+**************************************************************************************************/
+static void hpt_get_ethtool_stats(struct net_device *dev, struct ethtool_stats *stats, u64 *data);
+
 #define WD_TIMEOUT 5 /*jiffies */
 #define HPT_WAIT_RESPONSE_TIMEOUT 300 /* 3 seconds */
 
@@ -85,8 +436,39 @@ static void hpt_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info
 
 struct hpt_dev *hpt_device;
 
+static int hpt_net_dev_init(struct net_device *dev)
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	int ret;
+
+	ret = xdp_rxq_info_reg(&dev_info->xdp_rxq, dev, 0, dev_info->napi.napi_id);
+	if(ret)
+	{
+		return ret;
+	}
+
+	ret = xdp_rxq_info_reg_mem_model(&dev_info->xdp_rxq, MEM_TYPE_PAGE_SHARED, NULL);
+	if(ret)
+	{
+		xdp_rxq_info_unreg(&dev_info->xdp_rxq);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void hpt_net_dev_uninit(struct net_device *dev)
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+
+	xdp_rxq_info_unreg(&dev_info->xdp_rxq);
+}
+
 static int hpt_net_open(struct net_device *dev)
 {
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+
+	napi_enable(&dev_info->napi);
 	netif_start_queue(dev);
 	netif_carrier_on(dev);
 
@@ -95,8 +477,13 @@ static int hpt_net_open(struct net_device *dev)
 
 static int hpt_net_release(struct net_device *dev)
 {
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+
 	netif_stop_queue(dev); /* can't transmit any more */
 	netif_carrier_off(dev);
+
+	napi_disable(&dev_info->napi);
+	skb_queue_purge(&dev_info->rx_queue);
 	return 0;
 }
 
@@ -114,6 +501,14 @@ static int hpt_net_config(struct net_device *dev, struct ifmap *map)
 static int hpt_net_tx(struct sk_buff *skb, struct net_device *dev)
 {
 	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct hpt_ring_buffer_element *item = NULL;
+	struct hpt_ring_buffer *ring_info;
+	uint32_t *pending = NULL;
+#ifdef HAVE_NETDEV_XMIT_MORE
+	bool more = netdev_xmit_more();
+#else
+	bool more = skb->xmit_more;
+#endif
 	if(!dev_info)
 	{
 		pr_err("hpt_dev is null\n");
@@ -122,40 +517,73 @@ static int hpt_net_tx(struct sk_buff *skb, struct net_device *dev)
 
 	unsigned int len = skb->len;
 
+	if(dev_info->flags & HPT_DEV_F_UMEM)
+	{
+		return hpt_net_tx_umem(dev_info, skb, more);
+	}
+
 	if(!len) 
 	{
 		goto drop;
 	}
 
+	/* A full priority ring falls back to the bulk ring rather than dropping */
+	if((dev_info->flags & HPT_DEV_F_PRIO_LANE) && hpt_net_tx_is_prio(skb))
+	{
+		ring_info = dev_info->ring_info_tx_prio;
+		pending = &dev_info->tx_pending_prio;
+		item = hpt_net_tx_reserve(dev_info, ring_info, dev_info->ring_data_tx_prio, HPT_PRIO_ITEMS, *pending, len);
+	}
 
+	if(!item)
+	{
+		ring_info = dev_info->ring_info_tx;
+		pending = &dev_info->tx_pending;
+		item = hpt_net_tx_reserve(dev_info, ring_info, dev_info->ring_data_tx, dev_info->ring_buffer_items, *pending, len);
+	}
 
-	if(likely(hpt_set_item(dev_info->ring_info_tx, dev_info->ring_buffer_items, dev_info->ring_data_tx, skb->data, len) != 0))
+	if(unlikely(!item))
 	{
 		goto drop;
 	}
-	else
+
+	/* Walks the linear part, page frags and the frag list, so SG skbs never need linearizing */
+	if(unlikely(skb_copy_bits(skb, 0, item->data, len)))
 	{
-		struct hpt_ring_buffer *ring_info = dev_info->ring_info_tx;
-		uint32_t ind = ACQUIRE(&ring_info->write) + 1;
+		goto drop;
+	}
+	item->len = len;
 
-		if(ind < PAGES_PER_BLOCK) 
-		{
-			STORE(&ring_info->write, ind);
-		}
-		else
-		{
-			if(++ring_info->block_ind >= ring_info->max_block_ind) ring_info->block_ind = 0;
+	if(skb->ip_summed == CHECKSUM_PARTIAL)
+	{
+		item->csum_state = HPT_CSUM_PARTIAL;
+		item->csum_start = skb_checksum_start_offset(skb);
+		item->csum_offset = skb->csum_offset;
+	}
+	else
+	{
+		item->csum_state = HPT_CSUM_UNNECESSARY;
+		item->csum_start = 0;
+		item->csum_offset = 0;
+	}
 
-			STORE(&ring_info->write, 0);
-		}		
+	if(dev_info->flags & HPT_DEV_F_META)
+	{
+		hpt_net_tx_meta(skb, &item->meta);
+		item->flags = HPT_ELEM_F_META;
+	}
+	else
+	{
+		item->flags = 0;
 	}
 
-	dev_kfree_skb(skb);
+	/* Userspace sees the element once the burst ends, see hpt_net_tx_flush() */
+	(*pending)++;
 
 	dev_info->net_dev->stats.tx_bytes += len;
 	dev_info->net_dev->stats.tx_packets++;
 
-	wake_up_interruptible(&dev_info->tx_busy);
+	hpt_net_tx_done(dev_info, skb, more);
 
 	return NETDEV_TX_OK;
 
@@ -163,87 +591,1121 @@ drop:
 	dev_kfree_skb(skb);
 	dev_info->net_dev->stats.tx_dropped++;
 
+	/* The last packet of a burst may be the dropped one, the earlier ones still need publishing */
+	hpt_net_tx_done(dev_info, NULL, more);
+
 	return NETDEV_TX_OK;
 }
 
-size_t hpt_net_rx(struct hpt_net_device_info *dev_info)
+static inline struct hpt_ring_buffer_element *hpt_net_tx_reserve(struct hpt_net_device_info *dev_info, struct hpt_ring_buffer *ring_info,
+                                                                 uint8_t *ring_data, size_t ring_buffer_items, uint32_t pending,
+                                                                 unsigned int len)
 {
-    struct net_device *net_dev = dev_info->net_dev;
-    struct sk_buff *skb;
-    size_t num_processed = 0;
-    int i, num, len;
-    u8 ip_version;
-	struct hpt_ring_buffer_element *item;
+	if(unlikely(len > dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE))
+	{
+		return NULL;
+	}
 
-	if(!dev_info->ring_info_rx) return -1;
+	return hpt_get_write_item_at(ring_info, ring_buffer_items, ring_data, dev_info->elem_size, pending);
+}
 
-	num = hpt_count_items(dev_info->ring_info_rx);
+static inline void hpt_net_tx_done(struct hpt_net_device_info *dev_info, struct sk_buff *skb, bool more)
+{
+	if(skb)
+	{
+		__skb_queue_tail(&dev_info->tx_done, skb);
+	}
 
-	for (i = 0; i < num; i++)
+	/* The stack only sets xmit_more while it holds the queue lock for the next call */
+	if(!more || skb_queue_len(&dev_info->tx_done) >= HPT_TX_BATCH)
 	{
-		item = hpt_get_item(dev_info->ring_info_rx, dev_info->ring_buffer_items, dev_info->ring_data_rx);
-		if(unlikely(!item)) 
-		{
-			break;
-		}
+		hpt_net_tx_flush(dev_info);
+	}
+}
 
-		len = item->len;
+static void hpt_net_tx_flush(struct hpt_net_device_info *dev_info)
+{
+	/* netpoll transmits with interrupts off, a zero budget makes napi_consume_skb() use dev_consume_skb_any() */
+	int budget = irqs_disabled() ? 0 : 1;
+	struct sk_buff *skb;
+	bool urgent = false;
 
-		if(unlikely(len == 0 || len > HPT_RB_ELEMENT_USABLE_SPACE)) 
-		{
-		    net_dev->stats.rx_dropped++;
-			hpt_set_read_item(dev_info->ring_info_rx);
-			pr_err("Drop packets that are len out of range\n");
-        	continue;
-        }
+	if(dev_info->tx_pending)
+	{
+		hpt_net_tx_publish(dev_info->ring_info_tx, dev_info->ring_buffer_items, dev_info->tx_pending);
+		dev_info->tx_pending = 0;
+	}
 
-		skb = netdev_alloc_skb(net_dev, len);
-        if(unlikely(!skb)) {
-            net_dev->stats.rx_dropped++;
-			hpt_set_read_item(dev_info->ring_info_rx);
-			pr_err("Could not allocate memory to transmit a packet\n");
-        	continue;
-        }
+	if(dev_info->tx_pending_prio)
+	{
+		hpt_net_tx_publish(dev_info->ring_info_tx_prio, HPT_PRIO_ITEMS, dev_info->tx_pending_prio);
+		dev_info->tx_pending_prio = 0;
+		urgent = true;
+	}
 
-        memcpy(skb_put(skb, len), item->data, len);
-		hpt_set_read_item(dev_info->ring_info_rx);
+	/* Every packet handed to userspace left its skb on the list, UMEM ones included */
+	if(skb_queue_empty(&dev_info->tx_done))
+	{
+		return;
+	}
 
-        ip_version = skb->len ? (skb->data[HPT_IP_VERSION] >> 4) : 0;
+	hpt_net_tx_notify(dev_info, skb_queue_len(&dev_info->tx_done), urgent);
 
-        if(unlikely(!(ip_version == 4 || ip_version == 6))) {
-            dev_kfree_skb(skb);
-            net_dev->stats.rx_dropped++;
-			pr_err("Drop packets that are not IPv4 or IPv6\n");
-        	continue;
-        }
+	while((skb = __skb_dequeue(&dev_info->tx_done)))
+	{
+		napi_consume_skb(skb, budget);
+	}
+}
 
-        // Set SKB headers
-        skb_reset_mac_header(skb);
-        skb->protocol = ip_version == 4 ? htons(ETH_P_IP) : htons(ETH_P_IPV6);
-        skb->ip_summed = CHECKSUM_UNNECESSARY;
-        skb_reset_network_header(skb);
-        skb_probe_transport_header(skb);
+static void hpt_net_tx_notify(struct hpt_net_device_info *dev_info, uint32_t n, bool urgent)
+{
+	struct hpt_tx_coalesce *coal = &dev_info->coal;
+	unsigned long flags;
+	uint64_t now;
+	bool wake = false;
 
-        // Send the SKB to the network stack
-        netif_rx(skb);
+	if(likely(!READ_ONCE(coal->usecs)))
+	{
+		wake_up_interruptible(&dev_info->tx_busy);
+		return;
+	}
 
-        // Update statistics
-        net_dev->stats.rx_bytes += len;
-        net_dev->stats.rx_packets++;
-        num_processed++;
-    }
+	spin_lock_irqsave(&coal->lock, flags);
 
-	return num_processed;
-}
+	/* Only the new packets are queued, userspace has read everything that was signalled before */
+	if(hpt_count_items(dev_info->ring_info_tx) <= n)
+	{
+		WRITE_ONCE(coal->signalled, false);
+	}
 
-#ifdef HAVE_TX_TIMEOUT_TXQUEUE
-static void hpt_net_tx_timeout(struct net_device *dev, unsigned int txqueue)
-#else
-static void hpt_net_tx_timeout(struct net_device *dev)
-#endif
-{
-	pr_debug("Transmit timeout at %ld, latency %ld\n", jiffies,
-		 jiffies - dev_trans_start(dev));
+	coal->pending += n;
+
+	if(urgent || coal->signalled || (coal->frames && coal->pending >= coal->frames))
+	{
+		wake = true;
+	}
+
+	/* Adaptive: a packet after a gap longer than the window has nothing to be batched with */
+	if(coal->adaptive)
+	{
+		now = ktime_get_ns();
+		if(now - coal->last_ns > (uint64_t)coal->usecs * NSEC_PER_USEC)
+		{
+			wake = true;
+		}
+		coal->last_ns = now;
+	}
+
+	if(wake)
+	{
+		coal->pending = 0;
+		WRITE_ONCE(coal->signalled, true);
+		if(coal->armed)
+		{
+			hrtimer_try_to_cancel(&coal->timer);
+			coal->armed = false;
+		}
+	}
+	else if(!coal->armed)
+	{
+		coal->armed = true;
+		hrtimer_start(&coal->timer, ns_to_ktime((uint64_t)coal->usecs * NSEC_PER_USEC), HRTIMER_MODE_REL_SOFT);
+	}
+
+	spin_unlock_irqrestore(&coal->lock, flags);
+
+	if(wake)
+	{
+		wake_up_interruptible(&dev_info->tx_busy);
+	}
+}
+
+static enum hrtimer_restart hpt_net_coalesce_timer(struct hrtimer *timer)
+{
+	struct hpt_tx_coalesce *coal = container_of(timer, struct hpt_tx_coalesce, timer);
+	struct hpt_net_device_info *dev_info = container_of(coal, struct hpt_net_device_info, coal);
+	unsigned long flags;
+
+	spin_lock_irqsave(&coal->lock, flags);
+	coal->armed = false;
+	coal->pending = 0;
+	WRITE_ONCE(coal->signalled, true);
+	spin_unlock_irqrestore(&coal->lock, flags);
+
+	wake_up_interruptible(&dev_info->tx_busy);
+
+	return HRTIMER_NORESTART;
+}
+
+void hpt_net_coalesce_init(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_tx_coalesce *coal = &dev_info->coal;
+
+	spin_lock_init(&coal->lock);
+#ifdef HAVE_HRTIMER_SETUP
+	hrtimer_setup(&coal->timer, hpt_net_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&coal->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	coal->timer.function = hpt_net_coalesce_timer;
+#endif
+	coal->signalled = true;
+}
+
+void hpt_net_coalesce_stop(struct hpt_net_device_info *dev_info)
+{
+	hrtimer_cancel(&dev_info->coal.timer);
+}
+
+bool hpt_net_tx_readable(struct hpt_net_device_info *dev_info)
+{
+	/* The priority lane is never moderated */
+	if(dev_info->ring_info_tx_prio && hpt_count_items(dev_info->ring_info_tx_prio))
+	{
+		return true;
+	}
+
+	if(!hpt_count_items(dev_info->ring_info_tx))
+	{
+		return false;
+	}
+
+	return !READ_ONCE(dev_info->coal.usecs) || READ_ONCE(dev_info->coal.signalled);
+}
+
+static void hpt_pacer_begin(struct hpt_pacer *pacer, struct hpt_pacer_budget *budget)
+{
+	uint64_t elapsed;
+
+	budget->enabled = false;
+	budget->throttled = false;
+
+	if(!READ_ONCE(pacer->rate_pps) && !READ_ONCE(pacer->rate_bytes))
+	{
+		return;
+	}
+
+	spin_lock(&pacer->lock);
+
+	budget->now_ns = ktime_get_ns();
+	/* Keeps elapsed * rate well inside 64 bits, the buckets are full long before that anyway */
+	elapsed = min_t(uint64_t, budget->now_ns - pacer->last_ns, NSEC_PER_SEC / 4);
+	pacer->last_ns = budget->now_ns;
+
+	budget->enabled = pacer->rate_pps || pacer->rate_bytes;
+	budget->gen = pacer->gen;
+	budget->pkts = S64_MAX;
+	budget->bytes = S64_MAX;
+
+	if(pacer->rate_pps)
+	{
+		pacer->tokens_pkts = min_t(int64_t, pacer->tokens_pkts + (int64_t)(elapsed * pacer->rate_pps), pacer->max_pkts);
+		budget->pkts = pacer->tokens_pkts;
+	}
+
+	if(pacer->rate_bytes)
+	{
+		pacer->tokens_bytes = min_t(int64_t, pacer->tokens_bytes + (int64_t)(elapsed * pacer->rate_bytes), pacer->max_bytes);
+		budget->bytes = pacer->tokens_bytes;
+	}
+
+	spin_unlock(&pacer->lock);
+}
+
+static inline bool hpt_pacer_admit(struct hpt_pacer_budget *budget, unsigned int len)
+{
+	if(budget->pkts <= 0 || budget->bytes <= 0)
+	{
+		budget->throttled = true;
+		return false;
+	}
+
+	budget->pkts -= NSEC_PER_SEC;
+	budget->bytes -= (int64_t)len * NSEC_PER_SEC;
+
+	return true;
+}
+
+static void hpt_pacer_end(struct hpt_pacer *pacer, const struct hpt_pacer_budget *budget)
+{
+	if(!budget->enabled)
+	{
+		return;
+	}
+
+	spin_lock(&pacer->lock);
+
+	/* A reconfiguration during the sweep starts from a full bucket, keep it */
+	if(budget->gen == pacer->gen)
+	{
+		if(pacer->rate_pps) pacer->tokens_pkts = budget->pkts;
+		if(pacer->rate_bytes) pacer->tokens_bytes = budget->bytes;
+	}
+
+	if(budget->throttled)
+	{
+		pacer->throttled++;
+		if(!pacer->throttle_start_ns)
+		{
+			pacer->throttle_start_ns = budget->now_ns;
+		}
+	}
+	else if(pacer->throttle_start_ns)
+	{
+		pacer->delay_ns += budget->now_ns - pacer->throttle_start_ns;
+		pacer->throttle_start_ns = 0;
+	}
+
+	spin_unlock(&pacer->lock);
+}
+
+int hpt_net_set_pacing(struct hpt_net_device_info *dev_info, const struct hpt_pacing_param *param)
+{
+	struct hpt_pacer *pacer = &dev_info->pacer;
+	uint64_t rate_bytes = param->rate_bps / 8;
+	uint64_t burst_pkts = param->burst_pkts;
+	uint64_t burst_bytes = param->burst_bytes;
+
+	if(param->rate_pps > HPT_PACING_MAX_PPS || param->rate_bps > HPT_PACING_MAX_BPS ||
+	   burst_pkts > HPT_PACING_MAX_BURST || burst_bytes > HPT_PACING_MAX_BURST)
+	{
+		return -EINVAL;
+	}
+
+	if(!burst_pkts)
+	{
+		burst_pkts = max_t(uint64_t, param->rate_pps / 100, 1);
+	}
+
+	if(!burst_bytes)
+	{
+		burst_bytes = max_t(uint64_t, rate_bytes / 100, HPT_RB_ELEMENT_MAX_SIZE);
+	}
+
+	spin_lock(&pacer->lock);
+
+	pacer->max_pkts = burst_pkts * NSEC_PER_SEC;
+	pacer->max_bytes = burst_bytes * NSEC_PER_SEC;
+	pacer->tokens_pkts = pacer->max_pkts;
+	pacer->tokens_bytes = pacer->max_bytes;
+	pacer->last_ns = ktime_get_ns();
+	pacer->throttle_start_ns = 0;
+	pacer->gen++;
+	WRITE_ONCE(pacer->rate_pps, param->rate_pps);
+	WRITE_ONCE(pacer->rate_bytes, rate_bytes);
+
+	spin_unlock(&pacer->lock);
+
+	return 0;
+}
+
+static inline void hpt_net_tx_publish(struct hpt_ring_buffer *ring_info, size_t ring_buffer_items, uint32_t n)
+{
+	uint32_t ind = ACQUIRE(&ring_info->write) + n;
+
+	/* Block of PAGES_PER_BLOCK items the write index is in, informational only */
+	ring_info->block_ind = hpt_ring_slot(ind, ring_buffer_items) / PAGES_PER_BLOCK;
+
+	STORE(&ring_info->write, ind);
+}
+
+static int hpt_net_xdp_tx_frame(struct hpt_net_device_info *dev_info, const void *data, unsigned int len)
+{
+	struct hpt_ring_buffer_element *item;
+
+	item = hpt_get_write_item(dev_info->ring_info_tx, dev_info->ring_buffer_items, dev_info->ring_data_tx, dev_info->elem_size, len);
+	if(unlikely(!item))
+	{
+		return -ENOSPC;
+	}
+
+	memcpy(item->data, data, len);
+	item->len = len;
+	item->csum_state = HPT_CSUM_UNNECESSARY;
+	item->csum_start = 0;
+	item->csum_offset = 0;
+	item->flags = 0;
+
+	hpt_net_tx_publish(dev_info->ring_info_tx, dev_info->ring_buffer_items, 1);
+
+	dev_info->net_dev->stats.tx_bytes += len;
+	dev_info->net_dev->stats.tx_packets++;
+
+	return 0;
+}
+
+static struct sk_buff *hpt_net_rx_xdp(struct hpt_net_device_info *dev_info, struct bpf_prog *prog,
+                                      const uint8_t *data, unsigned int len, bool *redirect)
+{
+	struct net_device *net_dev = dev_info->net_dev;
+	unsigned int truesize = SKB_DATA_ALIGN(XDP_PACKET_HEADROOM + len) +
+	                        SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+	struct netdev_queue *txq;
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	uint8_t *buf;
+	u32 act;
+	int ret;
+
+	buf = netdev_alloc_frag(truesize);
+	if(unlikely(!buf))
+	{
+		net_dev->stats.rx_dropped++;
+		return NULL;
+	}
+
+	memcpy(buf + XDP_PACKET_HEADROOM, data, len);
+
+	xdp_init_buff(&xdp, truesize, &dev_info->xdp_rxq);
+	xdp_prepare_buff(&xdp, buf, XDP_PACKET_HEADROOM, len, false);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch(act)
+	{
+	case XDP_PASS:
+		skb = build_skb(buf, truesize);
+		if(unlikely(!skb))
+		{
+			break;
+		}
+		skb_reserve(skb, xdp.data - xdp.data_hard_start);
+		skb_put(skb, xdp.data_end - xdp.data);
+		skb->dev = net_dev;
+		return skb;
+	case XDP_TX:
+		txq = netdev_get_tx_queue(net_dev, 0);
+		__netif_tx_lock(txq, smp_processor_id());
+		ret = hpt_net_xdp_tx_frame(dev_info, xdp.data, xdp.data_end - xdp.data);
+		__netif_tx_unlock(txq);
+		if(unlikely(ret))
+		{
+			trace_xdp_exception(net_dev, prog, act);
+			break;
+		}
+		skb_free_frag(buf);
+		hpt_net_tx_notify(dev_info, 1, false);
+		return NULL;
+	case XDP_REDIRECT:
+		if(unlikely(xdp_do_redirect(net_dev, &xdp, prog)))
+		{
+			break;
+		}
+		*redirect = true;
+		net_dev->stats.rx_bytes += len;
+		net_dev->stats.rx_packets++;
+		return NULL;
+	default:
+#ifdef HAVE_BPF_WARN_INVALID_XDP_ACTION_DEV
+		bpf_warn_invalid_xdp_action(net_dev, prog, act);
+#else
+		bpf_warn_invalid_xdp_action(act);
+#endif
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(net_dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		break;
+	}
+
+	skb_free_frag(buf);
+	net_dev->stats.rx_dropped++;
+
+	return NULL;
+}
+
+static inline void hpt_net_rx_release(struct hpt_ring_buffer *ring_info, struct hpt_ring_buffer_element *item, bool mpsc)
+{
+	/* Clear the ready flag before the slot can be reserved again by advancing read */
+	if(mpsc)
+	{
+		STORE(&item->flags, 0);
+	}
+
+	hpt_set_read_item(ring_info);
+}
+
+static bool hpt_net_tx_is_prio(struct sk_buff *skb)
+{
+	u8 buf[2];
+	const u8 *hdr;
+	u8 dscp;
+
+	if(skb->priority == TC_PRIO_INTERACTIVE || skb->priority == TC_PRIO_CONTROL)
+	{
+		return true;
+	}
+
+	hdr = skb_header_pointer(skb, skb_network_offset(skb), sizeof(buf), buf);
+	if(!hdr)
+	{
+		return false;
+	}
+
+	switch(skb->protocol)
+	{
+	case htons(ETH_P_IP):
+		dscp = hdr[1] >> 2;
+		break;
+	case htons(ETH_P_IPV6):
+		dscp = (((hdr[0] & 0x0f) << 4) | (hdr[1] >> 4)) >> 2;
+		break;
+	default:
+		return false;
+	}
+
+	return dscp == HPT_DSCP_EF || dscp >= HPT_DSCP_CS6;
+}
+
+static void hpt_net_tx_meta(struct sk_buff *skb, struct hpt_ring_buffer_element_meta *meta)
+{
+	meta->hash = skb_get_hash(skb);
+	meta->hash_type = skb->l4_hash ? HPT_HASH_L4 : (meta->hash ? HPT_HASH_L3 : HPT_HASH_NONE);
+	meta->protocol = skb->protocol;
+	meta->mark = skb->mark;
+	meta->priority = skb->priority;
+	meta->tstamp = ktime_get_ns();
+}
+
+static void hpt_net_rx_meta(struct sk_buff *skb, const struct hpt_ring_buffer_element_meta *meta)
+{
+	/* A valid hash lets RPS/RFS steer the packet without hashing it in software */
+	if(meta->hash_type != HPT_HASH_NONE)
+	{
+		skb_set_hash(skb, meta->hash, meta->hash_type == HPT_HASH_L4 ? PKT_HASH_TYPE_L4 : PKT_HASH_TYPE_L3);
+	}
+
+	skb->mark = meta->mark;
+	skb->priority = meta->priority;
+}
+
+static int hpt_net_rx_csum(struct sk_buff *skb, u8 csum_state, u16 csum_start, u16 csum_offset)
+{
+	switch(csum_state)
+	{
+	case HPT_CSUM_NONE:
+		skb->ip_summed = CHECKSUM_NONE;
+		break;
+	case HPT_CSUM_PARTIAL:
+		/* Validates that start and offset fall inside the packet and sets the transport header */
+		if(!skb_partial_csum_set(skb, csum_start, csum_offset))
+		{
+			return -EINVAL;
+		}
+		break;
+	default:
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+		break;
+	}
+
+	return 0;
+}
+
+static int hpt_net_rx_prepare(struct sk_buff *skb, u8 csum_state, u16 csum_start, u16 csum_offset,
+                              const struct hpt_ring_buffer_element_meta *meta)
+{
+    u8 ip_version;
+
+    // Userspace already classified the packet, no need to look at the IP header
+    if(meta && (meta->protocol == htons(ETH_P_IP) || meta->protocol == htons(ETH_P_IPV6))) {
+        skb->protocol = meta->protocol;
+    } else {
+        ip_version = skb->len ? (skb->data[HPT_IP_VERSION] >> 4) : 0;
+
+        if(unlikely(!(ip_version == 4 || ip_version == 6))) {
+            pr_err("Drop packets that are not IPv4 or IPv6\n");
+            return -EINVAL;
+        }
+
+        skb->protocol = ip_version == 4 ? htons(ETH_P_IP) : htons(ETH_P_IPV6);
+    }
+
+    // Set SKB headers
+    skb_reset_mac_header(skb);
+    skb_reset_network_header(skb);
+
+    if(meta) {
+        hpt_net_rx_meta(skb, meta);
+    }
+
+    if(unlikely(hpt_net_rx_csum(skb, csum_state, csum_start, csum_offset))) {
+        pr_err("Drop packets with invalid checksum offsets\n");
+        return -EINVAL;
+    }
+
+    skb_probe_transport_header(skb);
+
+    return 0;
+}
+
+static int hpt_net_tx_umem(struct hpt_net_device_info *dev_info, struct sk_buff *skb, bool more)
+{
+	struct hpt_umem *umem = &dev_info->umem;
+	struct hpt_umem_desc desc;
+	unsigned int len = skb->len;
+	uint8_t *data;
+
+	if(unlikely(!umem->tx || !len || len > HPT_UMEM_FRAME_SIZE))
+	{
+		goto drop;
+	}
+
+	/* Check for room first so a frame is never taken from the fill ring and lost */
+	if(unlikely(hpt_umem_count(umem->tx) >= umem->items))
+	{
+		goto drop;
+	}
+
+	if(unlikely(hpt_umem_pop_frame(umem->fill, umem->fill_ring, umem->items, &desc.frame)))
+	{
+		goto drop;
+	}
+
+	data = hpt_umem_frame(umem, desc.frame);
+	if(unlikely(!data))
+	{
+		pr_err("Drop packets for invalid UMEM frame %u\n", desc.frame);
+		goto drop;
+	}
+
+	if(unlikely(skb_copy_bits(skb, 0, data, len)))
+	{
+		/* Give the frame back, userspace still owns it through the TX ring */
+		desc.len = 0;
+		desc.flags = 0;
+		desc.csum_state = HPT_CSUM_UNNECESSARY;
+		desc.csum_start = 0;
+		desc.csum_offset = 0;
+		hpt_umem_push_desc(umem->tx, umem->tx_ring, umem->items, &desc);
+		goto drop;
+	}
+
+	desc.len = len;
+	desc.flags = 0;
+	if(skb->ip_summed == CHECKSUM_PARTIAL)
+	{
+		desc.csum_state = HPT_CSUM_PARTIAL;
+		desc.csum_start = skb_checksum_start_offset(skb);
+		desc.csum_offset = skb->csum_offset;
+	}
+	else
+	{
+		desc.csum_state = HPT_CSUM_UNNECESSARY;
+		desc.csum_start = 0;
+		desc.csum_offset = 0;
+	}
+
+	hpt_umem_push_desc(umem->tx, umem->tx_ring, umem->items, &desc);
+
+	dev_info->net_dev->stats.tx_bytes += len;
+	dev_info->net_dev->stats.tx_packets++;
+
+	/* Descriptors are published one by one, only the wakeup and the freeing wait for the burst end */
+	hpt_net_tx_done(dev_info, skb, more);
+
+	return NETDEV_TX_OK;
+
+drop:
+	dev_kfree_skb(skb);
+	dev_info->net_dev->stats.tx_dropped++;
+
+	hpt_net_tx_done(dev_info, NULL, more);
+
+	return NETDEV_TX_OK;
+}
+
+static size_t hpt_net_rx_umem(struct hpt_net_device_info *dev_info, size_t budget)
+{
+	struct net_device *net_dev = dev_info->net_dev;
+	struct hpt_umem *umem = &dev_info->umem;
+	struct hpt_umem_desc desc;
+	struct sk_buff *skb;
+	size_t num_processed = 0;
+	uint32_t i, num;
+	uint8_t *data;
+	struct hpt_pacer_budget pace;
+	LIST_HEAD(rx_list);
+
+	if(!umem->rx) return 0;
+
+	num = min_t(size_t, hpt_umem_count(umem->rx), budget);
+
+	hpt_pacer_begin(&dev_info->pacer, &pace);
+
+	for(i = 0; i < num; i++)
+	{
+		/* Every consumed descriptor returns its frame, stop while userspace has not reaped completions */
+		if(unlikely(hpt_umem_count(umem->comp) >= umem->items))
+		{
+			break;
+		}
+
+		/* Only a hint for pacing, the descriptor is copied and validated below */
+		if(unlikely(pace.enabled) &&
+		   !hpt_pacer_admit(&pace, READ_ONCE(umem->rx_ring[ACQUIRE(&umem->rx->read) & (umem->items - 1)].len)))
+		{
+			break;
+		}
+
+		if(unlikely(hpt_umem_pop_desc(umem->rx, umem->rx_ring, umem->items, &desc)))
+		{
+			break;
+		}
+
+		data = hpt_umem_frame(umem, desc.frame);
+		if(unlikely(!data))
+		{
+			/* Not a frame of ours, there is nothing to complete */
+			net_dev->stats.rx_dropped++;
+			pr_err("Drop packets for invalid UMEM frame %u\n", desc.frame);
+			continue;
+		}
+
+		if(unlikely(desc.len == 0 || desc.len > HPT_UMEM_FRAME_SIZE))
+		{
+			net_dev->stats.rx_dropped++;
+			hpt_umem_push_frame(umem->comp, umem->comp_ring, umem->items, desc.frame);
+			pr_err("Drop packets that are len out of range\n");
+			continue;
+		}
+
+		skb = hpt_net_skb_get(dev_info, desc.len);
+		if(unlikely(!skb))
+		{
+			net_dev->stats.rx_dropped++;
+			hpt_umem_push_frame(umem->comp, umem->comp_ring, umem->items, desc.frame);
+			pr_err("Could not allocate memory to transmit a packet\n");
+			continue;
+		}
+
+		memcpy(skb_put(skb, desc.len), data, desc.len);
+		hpt_umem_push_frame(umem->comp, umem->comp_ring, umem->items, desc.frame);
+
+		if(unlikely(hpt_net_rx_prepare(skb, desc.csum_state, desc.csum_start, desc.csum_offset, NULL)))
+		{
+			dev_kfree_skb(skb);
+			net_dev->stats.rx_dropped++;
+			continue;
+		}
+
+		list_add_tail(&skb->list, &rx_list);
+
+		net_dev->stats.rx_bytes += desc.len;
+		net_dev->stats.rx_packets++;
+		num_processed++;
+	}
+
+	hpt_pacer_end(&dev_info->pacer, &pace);
+
+	if(i)
+	{
+		hpt_net_rx_space(dev_info);
+	}
+
+	if(!list_empty(&rx_list))
+	{
+		hpt_net_rx_deliver(dev_info, &rx_list);
+	}
+
+	return num_processed;
+}
+
+static size_t hpt_net_rx_ring(struct hpt_net_device_info *dev_info, struct hpt_net_rx_sweep *sweep,
+                              struct hpt_ring_buffer *ring_info, uint8_t *ring_data, size_t ring_buffer_items, bool mpsc)
+{
+    struct net_device *net_dev = dev_info->net_dev;
+    struct sk_buff *skb;
+    size_t num_processed = 0;
+    int i, num, len;
+    u8 csum_state;
+    u16 csum_start, csum_offset;
+    bool has_meta;
+    struct hpt_ring_buffer_element_meta meta;
+	struct hpt_ring_buffer_element *item;
+
+	num = min_t(size_t, hpt_count_items(ring_info), sweep->budget);
+
+	for (i = 0; i < num; i++)
+	{
+		if(i + HPT_PREFETCH_ITEMS < num)
+		{
+			hpt_prefetch_item(ring_info, ring_buffer_items, ring_data, dev_info->elem_size, HPT_PREFETCH_ITEMS);
+		}
+
+		item = hpt_get_item(ring_info, ring_buffer_items, ring_data, dev_info->elem_size);
+		if(unlikely(!item)) 
+		{
+			break;
+		}
+
+		/* With several producers the slot may be reserved but not yet filled */
+		if(mpsc && !(ACQUIRE(&item->flags) & HPT_ELEM_F_READY))
+		{
+			break;
+		}
+
+		len = item->len;
+
+		if(unlikely(len == 0 || len > dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE)) 
+		{
+		    net_dev->stats.rx_dropped++;
+			hpt_net_rx_release(ring_info, item, mpsc);
+			pr_err("Drop packets that are len out of range\n");
+        	continue;
+        }
+
+		/* Over the rate the packet waits in the ring for the next sweep */
+		if(unlikely(sweep->pace.enabled) && !hpt_pacer_admit(&sweep->pace, len))
+		{
+			break;
+		}
+
+		if(sweep->xdp_prog)
+		{
+			// The program sees the packet before any skb exists
+			skb = hpt_net_rx_xdp(dev_info, sweep->xdp_prog, item->data, len, &sweep->xdp_redirect);
+			if(!skb)
+			{
+				hpt_net_rx_release(ring_info, item, mpsc);
+				continue;
+			}
+		}
+		else
+		{
+			skb = hpt_net_skb_get(dev_info, len);
+			if(unlikely(!skb)) {
+				net_dev->stats.rx_dropped++;
+				hpt_net_rx_release(ring_info, item, mpsc);
+				pr_err("Could not allocate memory to transmit a packet\n");
+				continue;
+			}
+
+			memcpy(skb_put(skb, len), item->data, len);
+		}
+
+		csum_state = item->csum_state;
+		csum_start = item->csum_start;
+		csum_offset = item->csum_offset;
+		has_meta = item->flags & HPT_ELEM_F_META;
+		if(has_meta)
+		{
+			meta = item->meta;
+		}
+		hpt_net_rx_release(ring_info, item, mpsc);
+
+        if(unlikely(hpt_net_rx_prepare(skb, csum_state, csum_start, csum_offset, has_meta ? &meta : NULL))) {
+            dev_kfree_skb(skb);
+            net_dev->stats.rx_dropped++;
+            continue;
+        }
+
+        // Batch the SKB, the whole sweep is handed to the network stack at once
+        list_add_tail(&skb->list, &sweep->rx_list);
+
+        // Update statistics
+        net_dev->stats.rx_bytes += skb->len;
+        net_dev->stats.rx_packets++;
+        num_processed++;
+    }
+
+	sweep->budget -= i;
+
+	return num_processed;
+}
+
+static inline void hpt_net_rx_space(struct hpt_net_device_info *dev_info)
+{
+	/* The barrier in wq_has_sleeper() orders the read index store before the check, pairs with poll_wait() */
+	if(wq_has_sleeper(&dev_info->rx_space))
+	{
+		wake_up_interruptible_poll(&dev_info->rx_space, EPOLLOUT | EPOLLWRNORM);
+	}
+}
+
+static void hpt_net_skb_cache_refill(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_skb_cache *cache = &dev_info->skb_cache;
+	struct sk_buff *skb;
+
+	if(cache->count >= HPT_SKB_COUNT / 2)
+	{
+		return;
+	}
+
+	while(cache->count < HPT_SKB_COUNT)
+	{
+		/* Process context, unlike netdev_alloc_skb() this may reclaim instead of failing */
+		skb = __netdev_alloc_skb(dev_info->net_dev, cache->len, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+		if(!skb)
+		{
+			break;
+		}
+
+		cache->skbs[cache->count++] = skb;
+	}
+}
+
+static inline struct sk_buff *hpt_net_skb_get(struct hpt_net_device_info *dev_info, unsigned int len)
+{
+	struct hpt_skb_cache *cache = &dev_info->skb_cache;
+
+	if(likely(len <= cache->len && cache->count))
+	{
+		return cache->skbs[--cache->count];
+	}
+
+	return netdev_alloc_skb(dev_info->net_dev, len);
+}
+
+void hpt_net_skb_cache_purge(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_skb_cache *cache = &dev_info->skb_cache;
+
+	while(cache->count)
+	{
+		kfree_skb(cache->skbs[--cache->count]);
+	}
+}
+
+size_t hpt_net_rx(struct hpt_net_device_info *dev_info, size_t budget)
+{
+    struct hpt_net_rx_sweep sweep;
+    size_t num_processed = 0;
+    unsigned int queued;
+#ifdef HAVE_BPF_NET_CONTEXT
+	struct bpf_net_context __bpf_net_ctx, *bpf_net_ctx;
+#endif
+
+	if(!dev_info->ring_info_rx) return dev_info->flags & HPT_DEV_F_UMEM ? 0 : -1;
+
+	/* Only what NAPI has room for is taken, the rest waits in the ring instead of in kernel memory */
+	if(dev_info->net_dev->features & NETIF_F_GRO)
+	{
+		queued = skb_queue_len(&dev_info->rx_queue);
+		if(queued >= HPT_RX_QUEUE_MAX) return 0;
+
+		budget = min_t(size_t, budget, HPT_RX_QUEUE_MAX - queued);
+	}
+
+	/* Idle devices, and devices whose rings were never mapped, pin no skbs */
+	if(hpt_count_items(dev_info->ring_info_rx) ||
+	   (dev_info->ring_info_rx_prio && hpt_count_items(dev_info->ring_info_rx_prio)))
+	{
+		hpt_net_skb_cache_refill(dev_info);
+	}
+
+	if(dev_info->flags & HPT_DEV_F_UMEM) return hpt_net_rx_umem(dev_info, budget);
+
+	INIT_LIST_HEAD(&sweep.rx_list);
+	sweep.xdp_redirect = false;
+	sweep.budget = budget;
+
+	hpt_pacer_begin(&dev_info->pacer, &sweep.pace);
+
+	/* XDP expects softirq-like context, we run in the RX thread */
+	rcu_read_lock();
+	sweep.xdp_prog = rcu_dereference(dev_info->xdp_prog);
+	if(sweep.xdp_prog)
+	{
+		local_bh_disable();
+#ifdef HAVE_BPF_NET_CONTEXT
+		bpf_net_ctx = bpf_net_ctx_set(&__bpf_net_ctx);
+#endif
+	}
+
+	/* Latency-sensitive packets go first and take the pacing budget before bulk traffic */
+	if(dev_info->flags & HPT_DEV_F_PRIO_LANE)
+	{
+		num_processed += hpt_net_rx_ring(dev_info, &sweep, dev_info->ring_info_rx_prio, dev_info->ring_data_rx_prio,
+		                                 HPT_PRIO_ITEMS, false);
+	}
+
+	num_processed += hpt_net_rx_ring(dev_info, &sweep, dev_info->ring_info_rx, dev_info->ring_data_rx,
+	                                 dev_info->ring_buffer_items, dev_info->flags & HPT_DEV_F_RX_MPSC);
+
+	if(sweep.xdp_prog)
+	{
+		if(sweep.xdp_redirect)
+		{
+			xdp_do_flush();
+		}
+#ifdef HAVE_BPF_NET_CONTEXT
+		bpf_net_ctx_clear(bpf_net_ctx);
+#endif
+		local_bh_enable();
+	}
+	rcu_read_unlock();
+
+	hpt_pacer_end(&dev_info->pacer, &sweep.pace);
+
+	if(sweep.budget != budget)
+	{
+		hpt_net_rx_space(dev_info);
+	}
+
+	if(!list_empty(&sweep.rx_list))
+	{
+		hpt_net_rx_deliver(dev_info, &sweep.rx_list);
+	}
+
+	return num_processed;
+}
+
+static void hpt_net_rx_deliver(struct hpt_net_device_info *dev_info, struct list_head *rx_list)
+{
+	struct net_device *net_dev = dev_info->net_dev;
+	struct sk_buff *skb, *next;
+
+	/* We run in process context, softirqs raised here are run by local_bh_enable() */
+	local_bh_disable();
+
+	if((net_dev->features & NETIF_F_GRO) && netif_running(net_dev))
+	{
+		spin_lock(&dev_info->rx_queue.lock);
+		list_for_each_entry_safe(skb, next, rx_list, list)
+		{
+			skb_list_del_init(skb);
+			__skb_queue_tail(&dev_info->rx_queue, skb);
+		}
+		spin_unlock(&dev_info->rx_queue.lock);
+
+		napi_schedule(&dev_info->napi);
+	}
+	else
+	{
+		netif_receive_skb_list(rx_list);
+	}
+
+	local_bh_enable();
+}
+
+static int hpt_net_poll(struct napi_struct *napi, int budget)
+{
+	struct hpt_net_device_info *dev_info = container_of(napi, struct hpt_net_device_info, napi);
+	struct sk_buff_head process_queue;
+	struct sk_buff *skb;
+	int received = 0;
+
+	__skb_queue_head_init(&process_queue);
+
+	spin_lock(&dev_info->rx_queue.lock);
+	skb_queue_splice_tail_init(&dev_info->rx_queue, &process_queue);
+	spin_unlock(&dev_info->rx_queue.lock);
+
+	while(received < budget && (skb = __skb_dequeue(&process_queue)))
+	{
+		napi_gro_receive(napi, skb);
+		received++;
+	}
+
+	if(!skb_queue_empty(&process_queue))
+	{
+		/* Out of budget, put the rest back in front of anything queued meanwhile */
+		spin_lock(&dev_info->rx_queue.lock);
+		skb_queue_splice(&process_queue, &dev_info->rx_queue);
+		spin_unlock(&dev_info->rx_queue.lock);
+	}
+
+	/* Flushes GRO, a schedule that raced with us is picked up through NAPI_STATE_MISSED */
+	if(received < budget)
+	{
+		napi_complete_done(napi, received);
+	}
+
+	return received;
+}
+
+static int hpt_net_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct bpf_prog *old_prog;
+
+	switch(bpf->command)
+	{
+	case XDP_SETUP_PROG:
+		if(bpf->prog && (dev_info->flags & HPT_DEV_F_UMEM))
+		{
+			NL_SET_ERR_MSG_MOD(bpf->extack, "XDP is not supported on UMEM devices");
+			return -EOPNOTSUPP;
+		}
+
+		/* Called under RTNL, the RX thread picks the program up on its next sweep */
+		old_prog = rtnl_dereference(dev_info->xdp_prog);
+		rcu_assign_pointer(dev_info->xdp_prog, bpf->prog);
+		if(old_prog)
+		{
+			bpf_prog_put(old_prog);
+		}
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hpt_net_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags)
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct netdev_queue *txq;
+	int sent = 0;
+
+	if(unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+	{
+		return -EINVAL;
+	}
+
+	if(unlikely(!netif_running(dev) || !dev_info->ring_info_tx || (dev_info->flags & HPT_DEV_F_UMEM)))
+	{
+		return -ENETDOWN;
+	}
+
+	txq = netdev_get_tx_queue(dev, 0);
+	__netif_tx_lock(txq, smp_processor_id());
+	/* Redirects are not stopped by netif_tx_disable(), keep them out while the rings move */
+	if(unlikely(dev_info->tx_resizing))
+	{
+		__netif_tx_unlock(txq);
+		return -EBUSY;
+	}
+	for(; sent < n; sent++)
+	{
+		if(hpt_net_xdp_tx_frame(dev_info, frames[sent]->data, frames[sent]->len))
+		{
+			break;
+		}
+		/* Copied into the ring, the frame can go back to its owner */
+		xdp_return_frame(frames[sent]);
+	}
+	__netif_tx_unlock(txq);
+
+	if(sent && (flags & XDP_XMIT_FLUSH))
+	{
+		hpt_net_tx_notify(dev_info, sent, false);
+	}
+
+	return sent;
+}
+
+void hpt_net_rx_init(struct hpt_net_device_info *dev_info)
+{
+	skb_queue_head_init(&dev_info->rx_queue);
+	dev_info->skb_cache.count = 0;
+	dev_info->skb_cache.len = min_t(unsigned int, dev_info->elem_size - HPT_RB_ELEMENT_HEADER_SIZE, HPT_SKB_CACHE_LEN);
+	spin_lock_init(&dev_info->pacer.lock);
+
+#ifdef HAVE_NETIF_NAPI_ADD_NO_WEIGHT
+	netif_napi_add(dev_info->net_dev, &dev_info->napi, hpt_net_poll);
+#else
+	netif_napi_add(dev_info->net_dev, &dev_info->napi, hpt_net_poll, NAPI_POLL_WEIGHT);
+#endif
+}
+
+#ifdef HAVE_TX_TIMEOUT_TXQUEUE
+static void hpt_net_tx_timeout(struct net_device *dev, unsigned int txqueue)
+#else
+static void hpt_net_tx_timeout(struct net_device *dev)
+#endif
+{
+	pr_debug("Transmit timeout at %ld, latency %ld\n", jiffies,
+		 jiffies - dev_trans_start(dev));
 	dev->stats.tx_errors++;
 	netif_wake_queue(dev);
 }
@@ -282,6 +1744,8 @@ static const struct header_ops hpt_net_header_ops = {
 };
 
 static const struct net_device_ops hpt_net_netdev_ops = {
+	.ndo_init = hpt_net_dev_init,
+	.ndo_uninit = hpt_net_dev_uninit,
 	.ndo_open = hpt_net_open,
 	.ndo_stop = hpt_net_release,
 	.ndo_set_config = hpt_net_config,
@@ -290,6 +1754,8 @@ static const struct net_device_ops hpt_net_netdev_ops = {
 	.ndo_change_mtu = hpt_net_change_mtu,
 	.ndo_tx_timeout = hpt_net_tx_timeout,
 	.ndo_change_carrier = hpt_net_change_carrier,
+	.ndo_bpf = hpt_net_bpf,
+	.ndo_xdp_xmit = hpt_net_xdp_xmit,
 };
 
 static void hpt_get_drvinfo(struct net_device *dev,
@@ -299,9 +1765,168 @@ static void hpt_get_drvinfo(struct net_device *dev,
 	strscpy(info->driver, "hpt", sizeof(info->driver));
 }
 
+#ifdef HAVE_ETHTOOL_RINGPARAM_KERNEL
+static void hpt_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                              struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack)
+#else
+static void hpt_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	uint32_t items = READ_ONCE(dev_info->resize_items);
+
+	if(!items)
+	{
+		items = READ_ONCE(dev_info->ring_buffer_items);
+	}
+
+	ring->rx_max_pending = HPT_MAX_ITEMS;
+	ring->tx_max_pending = HPT_MAX_ITEMS;
+	ring->rx_pending = items;
+	ring->tx_pending = items;
+}
+
+#ifdef HAVE_ETHTOOL_RINGPARAM_KERNEL
+static int hpt_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                             struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack)
+#else
+static int hpt_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+
+	if(ring->rx_mini_pending || ring->rx_jumbo_pending)
+	{
+		return -EINVAL;
+	}
+
+	/* Both rings live in one mapping and share ring_buffer_items */
+	if(ring->rx_pending != ring->tx_pending)
+	{
+		pr_err("%s: TX and RX rings must have the same size\n", dev->name);
+		return -EINVAL;
+	}
+
+	/* Ring indices are masked with the size */
+	if(!hpt_ring_items_valid(ring->rx_pending))
+	{
+		pr_err("%s: ring size must be a power of two up to %d\n", dev->name, HPT_MAX_ITEMS);
+		return -EINVAL;
+	}
+
+	return hpt_request_resize(dev_info, ring->rx_pending);
+}
+
+#ifdef HAVE_ETHTOOL_COALESCE_KERNEL
+static int hpt_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal, struct netlink_ext_ack *extack)
+#else
+static int hpt_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct hpt_tx_coalesce *coal = &dev_info->coal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&coal->lock, flags);
+	ec->tx_coalesce_usecs = coal->usecs;
+	ec->tx_max_coalesced_frames = coal->frames;
+	ec->use_adaptive_tx_coalesce = coal->adaptive;
+	spin_unlock_irqrestore(&coal->lock, flags);
+
+	return 0;
+}
+
+#ifdef HAVE_ETHTOOL_COALESCE_KERNEL
+static int hpt_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal, struct netlink_ext_ack *extack)
+#else
+static int hpt_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct hpt_tx_coalesce *coal = &dev_info->coal;
+	unsigned long flags;
+
+	if(ec->tx_coalesce_usecs > HPT_COALESCE_MAX_USECS || ec->tx_max_coalesced_frames > HPT_MAX_ITEMS)
+	{
+		return -EINVAL;
+	}
+
+	/* Without a time limit packets below tx-frames would never be signalled */
+	if(!ec->tx_coalesce_usecs && (ec->tx_max_coalesced_frames || ec->use_adaptive_tx_coalesce))
+	{
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&coal->lock, flags);
+	WRITE_ONCE(coal->usecs, ec->tx_coalesce_usecs);
+	coal->frames = ec->tx_max_coalesced_frames;
+	coal->adaptive = ec->use_adaptive_tx_coalesce;
+	coal->pending = 0;
+	coal->last_ns = 0;
+	WRITE_ONCE(coal->signalled, true);
+	if(coal->armed)
+	{
+		hrtimer_try_to_cancel(&coal->timer);
+		coal->armed = false;
+	}
+	spin_unlock_irqrestore(&coal->lock, flags);
+
+	wake_up_interruptible(&dev_info->tx_busy);
+
+	return 0;
+}
+
+static const char hpt_gstrings_stats[][ETH_GSTRING_LEN] = {
+	"rx_pacing_throttled",
+	"rx_pacing_delay_ns",
+};
+
+static int hpt_get_sset_count(struct net_device *dev, int sset)
+{
+	switch(sset)
+	{
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(hpt_gstrings_stats);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void hpt_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if(sset == ETH_SS_STATS)
+	{
+		memcpy(data, hpt_gstrings_stats, sizeof(hpt_gstrings_stats));
+	}
+}
+
+static void hpt_get_ethtool_stats(struct net_device *dev, struct ethtool_stats *stats, u64 *data)
+{
+	struct hpt_net_device_info *dev_info = netdev_priv(dev);
+	struct hpt_pacer *pacer = &dev_info->pacer;
+
+	spin_lock(&pacer->lock);
+	data[0] = pacer->throttled;
+	data[1] = pacer->delay_ns;
+	spin_unlock(&pacer->lock);
+}
+
 static const struct ethtool_ops hpt_net_ethtool_ops = {
+#ifdef HAVE_ETHTOOL_COALESCE_PARAMS
+	.supported_coalesce_params = ETHTOOL_COALESCE_TX_USECS | ETHTOOL_COALESCE_TX_MAX_FRAMES |
+	                             ETHTOOL_COALESCE_USE_ADAPTIVE_TX,
+#endif
 	.get_drvinfo = hpt_get_drvinfo,
 	.get_link = ethtool_op_get_link,
+	.get_ringparam = hpt_get_ringparam,
+	.set_ringparam = hpt_set_ringparam,
+	.get_coalesce = hpt_get_coalesce,
+	.set_coalesce = hpt_set_coalesce,
+	.get_sset_count = hpt_get_sset_count,
+	.get_strings = hpt_get_strings,
+	.get_ethtool_stats = hpt_get_ethtool_stats,
 };
 
 void hpt_net_init(struct net_device *dev)
@@ -317,8 +1942,27 @@ void hpt_net_init(struct net_device *dev)
 	dev->max_mtu = HPT_MTU;
 	dev->min_mtu = HPT_MTU;
 
+	/* hpt_net_tx() copies frags straight into the ring, no need for the stack to linearize */
+	dev->hw_features |= NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HIGHDMA;
+	dev->features |= NETIF_F_HIGHDMA;
+
+	/*
+	 * Checksum offload is toggled with ethtool -K, enabled at creation by HPT_DEV_F_CSUM_OFFLOAD.
+	 * The stack drops SG without a checksum feature, so SG and FRAGLIST are turned on with it.
+	 */
+	dev->hw_features |= NETIF_F_HW_CSUM;
+
 	dev->netdev_ops = &hpt_net_netdev_ops;
 	dev->header_ops = &hpt_net_header_ops;
 	dev->ethtool_ops = &hpt_net_ethtool_ops;
 	dev->watchdog_timeo = WD_TIMEOUT;
+
+#ifdef HAVE_XDP_FEATURES
+	dev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT | NETDEV_XDP_ACT_NDO_XMIT;
+#endif
 }
+
+#ifdef HPT_KUNIT_TEST
+/* Needs the static data path functions above */
+#include "tests/hpt_kunit.c"
+#endif
@@ -0,0 +1,288 @@
+#include <hpt/hpt_common.h>
+#include "hpt_dev.h"
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+
+static unsigned int rx_workers;
+module_param(rx_workers, uint, 0444);
+MODULE_PARM_DESC(rx_workers, "RX worker threads shared by all devices, 0 for one thread per device (default)");
+
+static unsigned int rx_budget = 64;
+module_param(rx_budget, uint, 0644);
+MODULE_PARM_DESC(rx_budget, "Packets a pool worker takes from one device before moving to the next");
+
+struct hpt_rx_pool *hpt_rx_pool;
+
+/**********************************************************************************************//**
+* @brief hpt_rx_worker_run: Pool worker thread, services the devices on its run list in turn
+* @param param: Pointer to the hpt_rx_worker structure of the thread
+* @return 0
+**************************************************************************************************/
+static int hpt_rx_worker_run(void *param);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_pending: Check if userspace left packets in the RX rings of a device
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @return true if a ring has unread elements
+**************************************************************************************************/
+static bool hpt_rx_pending(struct hpt_net_device_info *dev_info);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_requeue: Put a serviced device back on the run list, or arm its wakeup flag
+* @param worker: Worker that serviced the device
+* @param dev_info: Pointer to the hpt_net_device_info structure
+**************************************************************************************************/
+static void hpt_rx_requeue(struct hpt_rx_worker *worker, struct hpt_net_device_info *dev_info);
+
+static bool hpt_rx_pending(struct hpt_net_device_info *dev_info)
+{
+	if(!dev_info->ring_info_rx)
+	{
+		return false;
+	}
+
+	/* With a full completion ring nothing can be taken, hpt_umem_complete() kicks once it drains */
+	if(dev_info->flags & HPT_DEV_F_UMEM)
+	{
+		return hpt_umem_count(dev_info->ring_info_rx) != 0 &&
+		       hpt_umem_count(dev_info->umem.comp) < dev_info->umem.items;
+	}
+
+	return hpt_count_items(dev_info->ring_info_rx) ||
+	       (dev_info->ring_info_rx_prio && hpt_count_items(dev_info->ring_info_rx_prio));
+}
+
+static void hpt_rx_requeue(struct hpt_rx_worker *worker, struct hpt_net_device_info *dev_info)
+{
+	spin_lock(&worker->lock);
+
+	/* Removed while it was serviced */
+	if(!dev_info->rx_active)
+	{
+		spin_unlock(&worker->lock);
+		return;
+	}
+
+	/* Over budget, the other devices go first */
+	if(hpt_rx_pending(dev_info))
+	{
+		list_add_tail(&dev_info->rx_node, &worker->run_list);
+		spin_unlock(&worker->lock);
+		return;
+	}
+
+	dev_info->rx_scheduled = false;
+	spin_unlock(&worker->lock);
+
+	if(!dev_info->ring_info_rx)
+	{
+		return;
+	}
+
+	/* Userspace may have published before it could see the flag, the cmpxchg orders the recheck */
+	hpt_ring_update_flags(dev_info->ring_info_rx, HPT_RING_F_NEED_WAKEUP, 0);
+	if(hpt_rx_pending(dev_info))
+	{
+		hpt_rx_pool_kick(dev_info);
+	}
+}
+
+static int hpt_rx_worker_run(void *param)
+{
+	struct hpt_rx_worker *worker = param;
+	struct hpt_net_device_info *dev_info;
+
+	pr_info("RX pool worker %u started\n", worker->cpu);
+
+	while(!kthread_should_stop())
+	{
+		wait_event_interruptible(worker->wait, !list_empty_careful(&worker->run_list) || kthread_should_stop());
+
+		mutex_lock(&worker->run_mutex);
+
+		spin_lock(&worker->lock);
+		dev_info = list_first_entry_or_null(&worker->run_list, struct hpt_net_device_info, rx_node);
+		if(dev_info)
+		{
+			list_del_init(&dev_info->rx_node);
+		}
+		spin_unlock(&worker->lock);
+
+		if(dev_info)
+		{
+			hpt_net_rx(dev_info, READ_ONCE(rx_budget) ? READ_ONCE(rx_budget) : 1);
+			hpt_rx_requeue(worker, dev_info);
+		}
+
+		mutex_unlock(&worker->run_mutex);
+
+		cond_resched();
+	}
+
+	pr_info("RX pool worker %u stopped\n", worker->cpu);
+
+	return 0;
+}
+
+void hpt_rx_pool_kick(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_rx_worker *worker = dev_info->rx_worker;
+	bool wake = false;
+
+	if(!worker)
+	{
+		return;
+	}
+
+	spin_lock(&worker->lock);
+	if(dev_info->rx_active && !dev_info->rx_scheduled)
+	{
+		dev_info->rx_scheduled = true;
+		if(dev_info->ring_info_rx)
+		{
+			hpt_ring_update_flags(dev_info->ring_info_rx, 0, HPT_RING_F_NEED_WAKEUP);
+		}
+		list_add_tail(&dev_info->rx_node, &worker->run_list);
+		wake = true;
+	}
+	spin_unlock(&worker->lock);
+
+	if(wake)
+	{
+		wake_up(&worker->wait);
+	}
+}
+
+void hpt_rx_pool_add(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_rx_worker *worker;
+
+	/* A device stays with its worker, so each RX ring keeps a single consumer */
+	if(!dev_info->rx_worker)
+	{
+		INIT_LIST_HEAD(&dev_info->rx_node);
+		dev_info->rx_worker = &hpt_rx_pool->workers[(unsigned int)atomic_inc_return(&hpt_rx_pool->next) %
+		                                            hpt_rx_pool->nr_workers];
+	}
+	worker = dev_info->rx_worker;
+
+	spin_lock(&worker->lock);
+	dev_info->rx_active = true;
+	dev_info->rx_scheduled = false;
+	spin_unlock(&worker->lock);
+
+	hpt_rx_pool_kick(dev_info);
+}
+
+void hpt_rx_pool_remove(struct hpt_net_device_info *dev_info)
+{
+	struct hpt_rx_worker *worker = dev_info->rx_worker;
+
+	if(!worker)
+	{
+		return;
+	}
+
+	spin_lock(&worker->lock);
+	if(dev_info->rx_scheduled)
+	{
+		list_del_init(&dev_info->rx_node);
+	}
+	dev_info->rx_active = false;
+	dev_info->rx_scheduled = false;
+	spin_unlock(&worker->lock);
+
+	/* Wait for a sweep of the device that is already running */
+	mutex_lock(&worker->run_mutex);
+	mutex_unlock(&worker->run_mutex);
+}
+
+int hpt_rx_pool_init(void)
+{
+	struct hpt_rx_pool *pool;
+	unsigned int nr_workers = min(rx_workers, num_online_cpus());
+	unsigned int i = 0;
+	int cpu;
+
+	if(!nr_workers)
+	{
+		return 0;
+	}
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if(!pool)
+	{
+		return -ENOMEM;
+	}
+
+	pool->workers = kcalloc(nr_workers, sizeof(*pool->workers), GFP_KERNEL);
+	if(!pool->workers)
+	{
+		kfree(pool);
+		return -ENOMEM;
+	}
+
+	atomic_set(&pool->next, -1);
+
+	for_each_online_cpu(cpu)
+	{
+		struct hpt_rx_worker *worker = &pool->workers[i];
+
+		if(i == nr_workers)
+		{
+			break;
+		}
+
+		spin_lock_init(&worker->lock);
+		mutex_init(&worker->run_mutex);
+		INIT_LIST_HEAD(&worker->run_list);
+		init_waitqueue_head(&worker->wait);
+		worker->cpu = cpu;
+
+		worker->thread = kthread_create(hpt_rx_worker_run, worker, "hpt_rx/%u", cpu);
+		if(IS_ERR(worker->thread))
+		{
+			pr_err("Couldn't start RX pool worker %u\n", cpu);
+			worker->thread = NULL;
+			break;
+		}
+
+		/* Not bound, the scheduler moves the worker if its CPU goes offline */
+		set_cpus_allowed_ptr(worker->thread, cpumask_of(cpu));
+		wake_up_process(worker->thread);
+		i++;
+	}
+
+	if(i == 0)
+	{
+		kfree(pool->workers);
+		kfree(pool);
+		return -ECANCELED;
+	}
+
+	pool->nr_workers = i;
+	hpt_rx_pool = pool;
+
+	pr_info("RX pool with %u workers\n", i);
+
+	return 0;
+}
+
+void hpt_rx_pool_exit(void)
+{
+	if(!hpt_rx_pool)
+	{
+		return;
+	}
+
+	for(unsigned int i = 0; i < hpt_rx_pool->nr_workers; i++)
+	{
+		kthread_stop(hpt_rx_pool->workers[i].thread);
+	}
+
+	kfree(hpt_rx_pool->workers);
+	kfree(hpt_rx_pool);
+	hpt_rx_pool = NULL;
+}
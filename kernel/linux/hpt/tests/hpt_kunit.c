@@ -0,0 +1,542 @@
+/*
+ * KUnit tests and benchmarks of the ring helpers and the RX/TX data path.
+ *
+ * Built into the module when HPT_KUNIT_TEST is defined, see Kbuild and .kunitconfig. The file is
+ * included at the end of hpt_net.c so the static functions of the data path can be called
+ * directly. The rings live in kernel memory and the netdev is never registered, so no packet
+ * reaches the network stack. Benchmarks report ns per packet with kunit_info() and never fail.
+ */
+
+#include <kunit/test.h>
+#include <linux/in.h>
+#include <linux/ktime.h>
+
+#define HPT_KUNIT_PACKETS 16384 /* packets per benchmark case */
+#define HPT_KUNIT_WRAP_ROUNDS 3 /* times the wraparound tests go around the ring */
+#define HPT_KUNIT_WRAP_BATCHES 5 /* batch depths per ring size, see hpt_kunit_wrap_batches() */
+#define HPT_KUNIT_WRAP_MAX_ITEMS 4096 /* largest ring of the wraparound tests */
+#define HPT_KUNIT_SEQ_OFFSET 20 /* sequence number after the IPv4 header */
+
+/**********************************************************************************************//**
+* @brief Packet size and batch depth of a benchmark case
+**************************************************************************************************/
+struct hpt_kunit_case
+{
+	unsigned int len;
+	unsigned int batch;
+};
+
+static const struct hpt_kunit_case hpt_kunit_cases[] = {
+	{ 64, 1 }, { 64, 32 }, { 64, 256 },
+	{ 512, 1 }, { 512, 32 }, { 512, 256 },
+	{ HPT_MTU, 1 }, { HPT_MTU, 32 }, { HPT_MTU, 256 },
+};
+
+static void hpt_kunit_case_desc(const struct hpt_kunit_case *c, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "len %u batch %u", c->len, c->batch);
+}
+
+KUNIT_ARRAY_PARAM(hpt_kunit_cases, hpt_kunit_cases, hpt_kunit_case_desc);
+
+/* Ring sizes of the wraparound tests: below, at and above one PAGES_PER_BLOCK block */
+static const unsigned int hpt_kunit_wrap_items[] = { 64, PAGES_PER_BLOCK, HPT_KUNIT_WRAP_MAX_ITEMS };
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_wrap_batches: Batch depths of the wraparound tests for a ring size
+* Chosen to end on and straddle the end of the ring, up to a full ring.
+* @param items: Number of items in the ring
+* @param batches: Filled with HPT_KUNIT_WRAP_BATCHES depths
+**************************************************************************************************/
+static void hpt_kunit_wrap_batches(unsigned int items, unsigned int *batches)
+{
+	batches[0] = 1;
+	batches[1] = 7;
+	batches[2] = items / 2;
+	batches[3] = items - 1;
+	batches[4] = items;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_packet: Write a minimal IPv4 packet carrying a sequence number
+* @param data: Packet buffer
+* @param len: Packet length, at least HPT_KUNIT_SEQ_OFFSET + 4
+* @param seq: Sequence number
+**************************************************************************************************/
+static void hpt_kunit_packet(uint8_t *data, unsigned int len, u32 seq)
+{
+	memset(data, 0, HPT_KUNIT_SEQ_OFFSET);
+	data[HPT_IP_VERSION] = 0x45;
+	data[HPT_IP_HEADER_LENGTH_MSB] = len >> 8;
+	data[HPT_IP_HEADER_LENGTH_LSB] = len & 0xff;
+	data[9] = IPPROTO_UDP;
+	memcpy(data + HPT_KUNIT_SEQ_OFFSET, &seq, sizeof(seq));
+}
+
+static u32 hpt_kunit_seq(const uint8_t *data)
+{
+	u32 seq;
+
+	memcpy(&seq, data + HPT_KUNIT_SEQ_OFFSET, sizeof(seq));
+
+	return seq;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_rx_fill: Publish packets on the RX ring the way the library does
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param n: Number of packets
+* @param len: Packet length
+* @param seq: Sequence number of the first packet
+* @return Number of packets published, fewer if the ring filled up
+**************************************************************************************************/
+static unsigned int hpt_kunit_rx_fill(struct hpt_net_device_info *dev_info, unsigned int n, unsigned int len, u32 seq)
+{
+	struct hpt_ring_buffer *ring_info = dev_info->ring_info_rx;
+	struct hpt_ring_buffer_element *item;
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+	{
+		item = hpt_get_write_item_at(ring_info, dev_info->ring_buffer_items, dev_info->ring_data_rx, dev_info->elem_size, i);
+		if(!item)
+		{
+			break;
+		}
+
+		hpt_kunit_packet(item->data, len, seq + i);
+		item->len = len;
+		item->csum_state = HPT_CSUM_UNNECESSARY;
+		item->csum_start = 0;
+		item->csum_offset = 0;
+		item->flags = 0;
+	}
+
+	STORE(&ring_info->write, ring_info->write + i);
+
+	return i;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_rx_drain: Run one RX sweep over the bulk ring without delivering the skbs
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param rx_list: List the built skbs are added to
+* @param budget: Maximum number of ring elements to consume
+* @return Number of skbs built
+**************************************************************************************************/
+static size_t hpt_kunit_rx_drain(struct hpt_net_device_info *dev_info, struct list_head *rx_list, size_t budget)
+{
+	struct hpt_net_rx_sweep sweep = { .budget = budget };
+	size_t num;
+
+	INIT_LIST_HEAD(&sweep.rx_list);
+	num = hpt_net_rx_ring(dev_info, &sweep, dev_info->ring_info_rx, dev_info->ring_data_rx, dev_info->ring_buffer_items, false);
+	list_splice_tail(&sweep.rx_list, rx_list);
+
+	return num;
+}
+
+static void hpt_kunit_free_list(struct list_head *rx_list)
+{
+	struct sk_buff *skb, *next;
+
+	list_for_each_entry_safe(skb, next, rx_list, list)
+	{
+		skb_list_del_init(skb);
+		consume_skb(skb);
+	}
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_tx_skb: Build an skb as the stack would hand it to hpt_net_tx()
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param len: Packet length
+* @param seq: Sequence number
+* @return The skb, or NULL if the allocation failed
+**************************************************************************************************/
+static struct sk_buff *hpt_kunit_tx_skb(struct hpt_net_device_info *dev_info, unsigned int len, u32 seq)
+{
+	struct sk_buff *skb = alloc_skb(len, GFP_KERNEL);
+
+	if(!skb)
+	{
+		return NULL;
+	}
+
+	hpt_kunit_packet(skb_put(skb, len), len, seq);
+	skb->dev = dev_info->net_dev;
+	skb->protocol = htons(ETH_P_IP);
+	skb_reset_network_header(skb);
+
+	return skb;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_tx_xmit: Hand skbs to hpt_net_tx() as one xmit burst
+* Runs with bottom halves disabled like dev_hard_start_xmit(), the flush at the end publishes the
+* burst whatever netdev_xmit_more() was left at on this CPU.
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param skbs: Packets, all consumed
+* @param n: Number of packets
+**************************************************************************************************/
+static void hpt_kunit_tx_xmit(struct hpt_net_device_info *dev_info, struct sk_buff **skbs, unsigned int n)
+{
+	unsigned int i;
+
+	local_bh_disable();
+	for(i = 0; i < n; i++)
+	{
+		hpt_net_tx(skbs[i], dev_info->net_dev);
+	}
+	hpt_net_tx_flush(dev_info);
+	local_bh_enable();
+}
+
+/**********************************************************************************************//**
+* @brief hpt_kunit_resize: Replace the ring memory with empty rings of another size
+* @param dev_info: Pointer to the hpt_net_device_info structure
+* @param ring_buffer_items: Number of items per ring
+* @return 0 on success, -ENOMEM if the memory could not be allocated
+**************************************************************************************************/
+static int hpt_kunit_resize(struct hpt_net_device_info *dev_info, uint32_t ring_buffer_items)
+{
+	struct hpt_ring_mem *old = dev_info->mem;
+	struct hpt_ring_mem *mem;
+
+	mem = hpt_ring_mem_alloc(hpt_memory_size(dev_info->flags, ring_buffer_items, 0, dev_info->elem_size));
+	if(!mem)
+	{
+		return -ENOMEM;
+	}
+
+	hpt_ring_mem_attach(dev_info, mem, ring_buffer_items);
+	hpt_ring_mem_put(old);
+
+	return 0;
+}
+
+static int hpt_kunit_init(struct kunit *test)
+{
+	struct net_device *net_dev;
+	struct hpt_net_device_info *dev_info;
+	struct hpt_ring_mem *mem;
+
+	test->priv = NULL;
+
+	net_dev = alloc_netdev(sizeof(struct hpt_net_device_info), "hptk%d", NET_NAME_UNKNOWN, hpt_net_init);
+	if(!net_dev)
+	{
+		return -ENOMEM;
+	}
+
+	/* Same setup as hpt_ioctl_create() without registering the netdev */
+	dev_info = netdev_priv(net_dev);
+	dev_info->net_dev = net_dev;
+	dev_info->elem_size = HPT_RB_ELEMENT_SIZE;
+	init_waitqueue_head(&dev_info->tx_busy);
+	init_waitqueue_head(&dev_info->rx_space);
+	mutex_init(&dev_info->rx_mutex);
+	__skb_queue_head_init(&dev_info->tx_done);
+	hpt_net_rx_init(dev_info);
+	hpt_net_coalesce_init(dev_info);
+
+	mem = hpt_ring_mem_alloc(hpt_memory_size(dev_info->flags, PAGES_PER_BLOCK, 0, dev_info->elem_size));
+	if(!mem)
+	{
+		free_netdev(net_dev);
+		return -ENOMEM;
+	}
+	hpt_ring_mem_attach(dev_info, mem, PAGES_PER_BLOCK);
+
+	test->priv = dev_info;
+
+	return 0;
+}
+
+static void hpt_kunit_exit(struct kunit *test)
+{
+	struct hpt_net_device_info *dev_info = test->priv;
+
+	if(!dev_info)
+	{
+		return;
+	}
+
+	hpt_net_coalesce_stop(dev_info);
+	hpt_net_skb_cache_purge(dev_info);
+	hpt_ring_mem_put(dev_info->mem);
+	free_netdev(dev_info->net_dev);
+}
+
+/* Indices a few steps before they overflow, count and free space across the wrap */
+static void hpt_kunit_ring_wrap(struct kunit *test)
+{
+	struct hpt_net_device_info *dev_info = test->priv;
+	struct hpt_ring_buffer_element *item;
+	struct hpt_ring_buffer *ring_info;
+	unsigned int s, items;
+	u32 i;
+
+	for(s = 0; s < ARRAY_SIZE(hpt_kunit_wrap_items); s++)
+	{
+		items = hpt_kunit_wrap_items[s];
+		KUNIT_ASSERT_EQ(test, hpt_kunit_resize(dev_info, items), 0);
+		ring_info = dev_info->ring_info_rx;
+
+		ring_info->read = U32_MAX - 2;
+		ring_info->write = U32_MAX - 2;
+
+		KUNIT_ASSERT_EQ(test, hpt_kunit_rx_fill(dev_info, 8, 64, 0), 8U);
+		KUNIT_EXPECT_EQ(test, ring_info->write, 5U);
+		KUNIT_EXPECT_EQ(test, hpt_count_items(ring_info), 8ULL);
+		KUNIT_EXPECT_EQ(test, hpt_free_items(ring_info, items), (u64)(items - 8));
+
+		for(i = 0; i < 8; i++)
+		{
+			item = hpt_get_item(ring_info, items, dev_info->ring_data_rx, dev_info->elem_size);
+			KUNIT_ASSERT_NOT_NULL(test, item);
+			KUNIT_EXPECT_EQ(test, hpt_kunit_seq(item->data), i);
+			hpt_set_read_item(ring_info);
+		}
+
+		KUNIT_EXPECT_EQ(test, ring_info->read, 5U);
+		KUNIT_EXPECT_EQ(test, hpt_count_items(ring_info), 0ULL);
+		KUNIT_EXPECT_NULL(test, hpt_get_item(ring_info, items, dev_info->ring_data_rx, dev_info->elem_size));
+	}
+}
+
+/* Every slot can be filled, a full ring reports no free space instead of looking empty */
+static void hpt_kunit_ring_full(struct kunit *test)
+{
+	struct hpt_net_device_info *dev_info = test->priv;
+	struct hpt_ring_buffer *ring_info;
+	unsigned int s, items, start;
+
+	for(s = 0; s < ARRAY_SIZE(hpt_kunit_wrap_items); s++)
+	{
+		items = hpt_kunit_wrap_items[s];
+		KUNIT_ASSERT_EQ(test, hpt_kunit_resize(dev_info, items), 0);
+		ring_info = dev_info->ring_info_rx;
+
+		for(start = 0; start < items; start += items / 4 - 1)
+		{
+			ring_info->read = start;
+			ring_info->write = start;
+
+			KUNIT_EXPECT_EQ(test, hpt_kunit_rx_fill(dev_info, items + 1, 64, 0), items);
+			KUNIT_EXPECT_EQ(test, hpt_count_items(ring_info), (u64)items);
+			KUNIT_EXPECT_EQ(test, hpt_free_items(ring_info, items), 0ULL);
+			KUNIT_EXPECT_NULL(test, hpt_get_write_item(ring_info, items, dev_info->ring_data_rx, dev_info->elem_size, 64));
+		}
+	}
+}
+
+/* Packets go through hpt_net_rx_ring() in order and complete while the ring wraps several times */
+static void hpt_kunit_rx_wrap(struct kunit *test)
+{
+	struct hpt_net_device_info *dev_info = test->priv;
+	struct net_device *net_dev = dev_info->net_dev;
+	unsigned int batches[HPT_KUNIT_WRAP_BATCHES];
+	unsigned int s, b, items, total, sent, n;
+	struct sk_buff *skb, *next;
+	LIST_HEAD(rx_list);
+	u32 expect;
+
+	for(s = 0; s < ARRAY_SIZE(hpt_kunit_wrap_items); s++)
+	{
+		items = hpt_kunit_wrap_items[s];
+		KUNIT_ASSERT_EQ(test, hpt_kunit_resize(dev_info, items), 0);
+		hpt_kunit_wrap_batches(items, batches);
+		total = HPT_KUNIT_WRAP_ROUNDS * items;
+
+		for(b = 0; b < HPT_KUNIT_WRAP_BATCHES; b++)
+		{
+			net_dev->stats.rx_packets = 0;
+			net_dev->stats.rx_dropped = 0;
+			expect = 0;
+
+			for(sent = 0; sent < total; sent += n)
+			{
+				n = hpt_kunit_rx_fill(dev_info, min(batches[b], total - sent), 64 + (sent % 64), sent);
+				KUNIT_ASSERT_GT(test, n, 0U);
+
+				hpt_net_skb_cache_refill(dev_info);
+				KUNIT_EXPECT_EQ(test, hpt_kunit_rx_drain(dev_info, &rx_list, HPT_RX_BUDGET_ALL), (size_t)n);
+				list_for_each_entry_safe(skb, next, &rx_list, list)
+				{
+					KUNIT_EXPECT_EQ(test, hpt_kunit_seq(skb->data), expect);
+					KUNIT_EXPECT_EQ(test, skb->protocol, htons(ETH_P_IP));
+					expect++;
+				}
+				hpt_kunit_free_list(&rx_list);
+			}
+
+			KUNIT_EXPECT_EQ(test, hpt_count_items(dev_info->ring_info_rx), 0ULL);
+			KUNIT_EXPECT_EQ(test, net_dev->stats.rx_packets, (unsigned long)total);
+			KUNIT_EXPECT_EQ(test, net_dev->stats.rx_dropped, 0UL);
+		}
+	}
+}
+
+/* hpt_net_tx() publishes bursts that straddle the wrap, userspace reads them back in order */
+static void hpt_kunit_tx_wrap(struct kunit *test)
+{
+	struct hpt_net_device_info *dev_info = test->priv;
+	unsigned int batches[HPT_KUNIT_WRAP_BATCHES];
+	unsigned int s, b, i, items, total, sent, n;
+	struct hpt_ring_buffer_element *item;
+	struct hpt_ring_buffer *ring_info;
+	struct sk_buff **skbs;
+	u32 expect;
+
+	skbs = kunit_kcalloc(test, HPT_KUNIT_WRAP_MAX_ITEMS, sizeof(*skbs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skbs);
+
+	for(s = 0; s < ARRAY_SIZE(hpt_kunit_wrap_items); s++)
+	{
+		items = hpt_kunit_wrap_items[s];
+		KUNIT_ASSERT_EQ(test, hpt_kunit_resize(dev_info, items), 0);
+		ring_info = dev_info->ring_info_tx;
+		hpt_kunit_wrap_batches(items, batches);
+		total = HPT_KUNIT_WRAP_ROUNDS * items;
+		expect = 0;
+
+		for(b = 0; b < HPT_KUNIT_WRAP_BATCHES; b++)
+		{
+			for(sent = 0; sent < total; sent += n)
+			{
+				n = min(batches[b], total - sent);
+				for(i = 0; i < n; i++)
+				{
+					skbs[i] = hpt_kunit_tx_skb(dev_info, 64, expect + i);
+					KUNIT_ASSERT_NOT_NULL(test, skbs[i]);
+				}
+
+				hpt_kunit_tx_xmit(dev_info, skbs, n);
+				KUNIT_ASSERT_EQ(test, hpt_count_items(ring_info), (u64)n);
+				KUNIT_EXPECT_LT(test, ring_info->block_ind, ring_info->max_block_ind);
+
+				for(i = 0; i < n; i++)
+				{
+					item = hpt_get_item(ring_info, items, dev_info->ring_data_tx, dev_info->elem_size);
+					KUNIT_ASSERT_NOT_NULL(test, item);
+					KUNIT_EXPECT_EQ(test, (unsigned int)item->len, 64U);
+					KUNIT_EXPECT_EQ(test, hpt_kunit_seq(item->data), expect);
+					hpt_set_read_item(ring_info);
+					expect++;
+				}
+			}
+		}
+	}
+
+	KUNIT_EXPECT_EQ(test, dev_info->net_dev->stats.tx_dropped, 0UL);
+}
+
+/* Ring helpers only: what every consumer pays before any skb work */
+static void hpt_kunit_bench_ring(struct kunit *test)
+{
+	const struct hpt_kunit_case *c = test->param_value;
+	struct hpt_net_device_info *dev_info = test->priv;
+	struct hpt_ring_buffer *ring_info = dev_info->ring_info_rx;
+	struct hpt_ring_buffer_element *item;
+	unsigned int done, n, i;
+	u64 start, ns = 0;
+	u32 sum = 0;
+
+	for(done = 0; done < HPT_KUNIT_PACKETS; done += n)
+	{
+		n = hpt_kunit_rx_fill(dev_info, c->batch, c->len, done);
+
+		start = ktime_get_ns();
+		for(i = 0; i < n; i++)
+		{
+			item = hpt_get_item(ring_info, dev_info->ring_buffer_items, dev_info->ring_data_rx, dev_info->elem_size);
+			sum += item->len;
+			hpt_set_read_item(ring_info);
+		}
+		ns += ktime_get_ns() - start;
+	}
+
+	KUNIT_EXPECT_EQ(test, sum, (u32)(done * c->len));
+	kunit_info(test, "ring get/release len %u batch %u: %llu ns/pkt\n", c->len, c->batch, div_u64(ns, done));
+}
+
+/* hpt_net_rx_ring(): length checks, skb from the cache, copy and header setup */
+static void hpt_kunit_bench_rx(struct kunit *test)
+{
+	const struct hpt_kunit_case *c = test->param_value;
+	struct hpt_net_device_info *dev_info = test->priv;
+	unsigned int done, n;
+	LIST_HEAD(rx_list);
+	u64 start, ns = 0;
+	size_t built = 0;
+
+	for(done = 0; done < HPT_KUNIT_PACKETS; done += n)
+	{
+		n = hpt_kunit_rx_fill(dev_info, c->batch, c->len, done);
+		/* Kept out of the measurement, hpt_net_rx() refills between sweeps */
+		hpt_net_skb_cache_refill(dev_info);
+
+		start = ktime_get_ns();
+		built += hpt_kunit_rx_drain(dev_info, &rx_list, HPT_RX_BUDGET_ALL);
+		ns += ktime_get_ns() - start;
+
+		hpt_kunit_free_list(&rx_list);
+	}
+
+	KUNIT_EXPECT_EQ(test, built, (size_t)done);
+	kunit_info(test, "rx drain+skb len %u batch %u: %llu ns/pkt\n", c->len, c->batch, div_u64(ns, done));
+}
+
+/* hpt_net_tx(): copy into the ring, burst publish, notification and skb freeing */
+static void hpt_kunit_bench_tx(struct kunit *test)
+{
+	const struct hpt_kunit_case *c = test->param_value;
+	struct hpt_net_device_info *dev_info = test->priv;
+	struct hpt_ring_buffer *ring_info = dev_info->ring_info_tx;
+	unsigned int done, i;
+	struct sk_buff **skbs;
+	u64 start, ns = 0;
+
+	skbs = kunit_kcalloc(test, c->batch, sizeof(*skbs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skbs);
+
+	for(done = 0; done < HPT_KUNIT_PACKETS; done += c->batch)
+	{
+		for(i = 0; i < c->batch; i++)
+		{
+			skbs[i] = hpt_kunit_tx_skb(dev_info, c->len, done + i);
+			KUNIT_ASSERT_NOT_NULL(test, skbs[i]);
+		}
+
+		start = ktime_get_ns();
+		hpt_kunit_tx_xmit(dev_info, skbs, c->batch);
+		ns += ktime_get_ns() - start;
+
+		KUNIT_ASSERT_EQ(test, hpt_count_items(ring_info), (u64)c->batch);
+		STORE(&ring_info->read, ACQUIRE(&ring_info->write));
+	}
+
+	KUNIT_EXPECT_EQ(test, dev_info->net_dev->stats.tx_dropped, 0UL);
+	kunit_info(test, "tx enqueue len %u batch %u: %llu ns/pkt\n", c->len, c->batch, div_u64(ns, done));
+}
+
+static struct kunit_case hpt_kunit_test_cases[] = {
+	KUNIT_CASE(hpt_kunit_ring_wrap),
+	KUNIT_CASE(hpt_kunit_ring_full),
+	KUNIT_CASE(hpt_kunit_rx_wrap),
+	KUNIT_CASE(hpt_kunit_tx_wrap),
+	KUNIT_CASE_PARAM(hpt_kunit_bench_ring, hpt_kunit_cases_gen_params),
+	KUNIT_CASE_PARAM(hpt_kunit_bench_rx, hpt_kunit_cases_gen_params),
+	KUNIT_CASE_PARAM(hpt_kunit_bench_tx, hpt_kunit_cases_gen_params),
+	{}
+};
+
+static struct kunit_suite hpt_kunit_suite = {
+	.name = "hpt",
+	.init = hpt_kunit_init,
+	.exit = hpt_kunit_exit,
+	.test_cases = hpt_kunit_test_cases,
+};
+
+kunit_test_suite(hpt_kunit_suite);
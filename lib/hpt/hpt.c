@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -7,21 +8,231 @@
 #include <sys/epoll.h>
 #include <sys/poll.h>
 #include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "hpt.h"
 
+_Static_assert(offsetof(struct hpt_ring_buffer_element, data) == HPT_RB_ELEMENT_HEADER_SIZE,
+               "ring element header size mismatch");
+
 #define PAGE_ALIGN(x) (((x) + sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) - 1))
 
+/* Streaming stores only pay off for payloads spanning several lines on rings that do not fit in cache */
+#define HPT_STREAM_COPY_MIN_LEN 256
+#define HPT_STREAM_COPY_MIN_RING (8 << 20)
+
+typedef void *(*hpt_copy_fn)(void *dst, const void *src, size_t len);
+
+/**********************************************************************************************//**
+* @brief Burst of hpt_drain_sendmmsg(), kept across calls while the socket has not taken all of it
+* The messages are transformed already, the priority ring slots come before the bulk ring slots.
+**************************************************************************************************/
+struct hpt_send_burst
+{
+    struct mmsghdr msgs[HPT_SENDMMSG_BATCH];
+    struct iovec iovs[HPT_SENDMMSG_BATCH];
+    uint32_t ends[HPT_SENDMMSG_BATCH]; /* slots of the burst up to and including each message */
+    uint32_t count;    /* messages in msgs */
+    uint32_t sent;     /* messages sent or dropped */
+    uint32_t prio;     /* priority ring slots of the burst */
+    uint32_t bulk;     /* bulk ring slots of the burst */
+    uint32_t released; /* slots of the burst already given back to the kernel */
+};
+
+static hpt_copy_fn hpt_stream_copy = memcpy;
+
+/**********************************************************************************************//**
+* @brief hpt_select_copy: Pick the ring copy routine from the CPU features
+**************************************************************************************************/
+static void hpt_select_copy(void);
+
+/**********************************************************************************************//**
+* @brief hpt_copy_to_ring: Copy a payload into a ring element
+* Large payloads on large rings bypass the cache, the kernel consumes them on another core.
+* @param dev: Pointer to the HPT device structure
+* @param dst: Payload area of the element
+* @param src: Packet data
+* @param len: Packet length
+**************************************************************************************************/
+static inline void hpt_copy_to_ring(struct hpt *dev, uint8_t *dst, const uint8_t *src, size_t len);
+
+/**********************************************************************************************//**
+* @brief hpt_map_rings: Map both rings for ring_buffer_items and point the device at them
+* @param dev: Pointer to the HPT device structure
+* @param ring_buffer_items: Number of items per ring
+* @return 0 on success, -1 on failure
+**************************************************************************************************/
+static int hpt_map_rings(struct hpt *dev, size_t ring_buffer_items);
+
+/**********************************************************************************************//**
+* @brief hpt_from_fd: Wrap an fd already bound to a device and map its rings
+* @param fd: Device fd, owned by the returned structure and closed on failure
+* @param info: Parameters reported by HPT_IOCTL_INFO or HPT_IOCTL_ATTACH
+* @return Pointer to the HPT device on success, NULL on failure
+**************************************************************************************************/
+static struct hpt *hpt_from_fd(int fd, const struct hpt_net_device_param *info);
+
+/**********************************************************************************************//**
+* @brief hpt_drain_ring: Call one of the callbacks for every packet in a kernel -> userspace ring
+* @param ring: Ring header
+* @param ring_data: Start of the ring data
+* @param ring_buffer_items: Number of items in the ring
+* @param elem_size: Bytes per element
+* @param read_cb: Callback without metadata, partial checksums are completed first, or NULL
+* @param meta_cb: Callback with metadata, used when read_cb is NULL
+* @param handle: Opaque pointer passed to the callback
+**************************************************************************************************/
+static void hpt_drain_ring(struct hpt_ring_buffer *ring, uint8_t *ring_data, size_t ring_buffer_items, size_t elem_size,
+                           hpt_do_pkt read_cb, hpt_do_pkt_meta meta_cb, void *handle);
+
+/**********************************************************************************************//**
+* @brief hpt_sendmmsg_take: Turn the oldest packets of a TX ring into messages of a burst
+* The slots are not released, dropped and corrupt packets take a slot without a message.
+* @param ring: Ring header
+* @param ring_data: Start of the ring data
+* @param ring_buffer_items: Number of items in the ring
+* @param elem_size: Bytes per element
+* @param max: Maximum number of slots to take
+* @param msg: Message template holding the destination, copied into each message
+* @param transform_cb: Optional in-place transform
+* @param handle: Opaque pointer passed to transform_cb
+* @param burst: Burst to append to, its prio and bulk slots are counted before this ring
+* @param dropped: Incremented for every corrupt element
+* @return Number of slots taken
+**************************************************************************************************/
+static size_t hpt_sendmmsg_take(struct hpt_ring_buffer *ring, uint8_t *ring_data, size_t ring_buffer_items, size_t elem_size, size_t max,
+                                const struct msghdr *msg, hpt_do_pkt_transform transform_cb, void *handle,
+                                struct hpt_send_burst *burst, size_t *dropped);
+
+/**********************************************************************************************//**
+* @brief hpt_send_burst_release: Give the first slots of a burst back to the kernel
+* @param dev: Pointer to the HPT device structure
+* @param burst: Burst of hpt_drain_sendmmsg()
+* @param slots: Number of slots from the start of the burst that are done with
+**************************************************************************************************/
+static void hpt_send_burst_release(struct hpt *dev, struct hpt_send_burst *burst, uint32_t slots);
+
+/**********************************************************************************************//**
+* @brief hpt_fill_item: Copy a packet and its metadata into an RX ring element
+* @param dev: Pointer to the HPT device structure
+* @param item: Element to fill
+* @param data: Packet data
+* @param len: Packet length
+* @param meta: Packet metadata, NULL for a verified packet without flow metadata
+* @return Element flags to publish
+**************************************************************************************************/
+static uint8_t hpt_fill_item(struct hpt *dev, struct hpt_ring_buffer_element *item, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_write_mp: Thread-safe write to the RX ring of an HPT_DEV_F_RX_MPSC device
+* The slot is reserved by advancing write with a CAS and marked HPT_ELEM_F_READY once filled,
+* the kernel stops at the first reserved slot that is not ready yet.
+* @param dev: Pointer to the HPT device structure
+* @param data: Packet data
+* @param len: Packet length
+* @param meta: Packet metadata, may be NULL
+**************************************************************************************************/
+static void hpt_write_mp(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_kick: Wake the kernel RX pool worker if it went to sleep on the device
+* @param dev: Pointer to the HPT device structure
+**************************************************************************************************/
+static inline void hpt_rx_kick(struct hpt *dev);
+
 int hpt_efd(struct hpt *dev)
 {
     return dev->fd;
 }
 
+static inline void hpt_rx_kick(struct hpt *dev)
+{
+    /* Orders the write index store before the flag load, pairs with the cmpxchg of the worker */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(unlikely(ACQUIRE(&dev->ring_info_rx->flags) & HPT_RING_F_NEED_WAKEUP))
+    {
+        ioctl(dev->fd, HPT_IOCTL_KICK);
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void *hpt_memcpy_stream_avx2(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+    if(head)
+    {
+        head = head < len ? head : len;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        len -= head;
+    }
+
+    for(; len >= 128; d += 128, s += 128, len -= 128)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+
+    for(; len >= 32; d += 32, s += 32, len -= 32)
+    {
+        _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    }
+
+    if(len)
+    {
+        memcpy(d, s, len);
+    }
+
+    /* Streaming stores are weakly ordered, they must be visible before the release store of write */
+    _mm_sfence();
+
+    return dst;
+}
+#endif
+
+static void hpt_select_copy(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        hpt_stream_copy = hpt_memcpy_stream_avx2;
+    }
+#endif
+}
+
+static inline void hpt_copy_to_ring(struct hpt *dev, uint8_t *dst, const uint8_t *src, size_t len)
+{
+    if(dev->stream_copy && len >= HPT_STREAM_COPY_MIN_LEN)
+    {
+        hpt_stream_copy(dst, src, len);
+        return;
+    }
+
+    memcpy(dst, src, len);
+}
+
 int hpt_init()
 {
+    hpt_select_copy();
     return 0;
 }
 
@@ -35,6 +246,7 @@ void hpt_close(struct hpt *dev)
 
 	if(dev->fd) close(dev->fd);
 
+    free(dev->send_burst);
 	free(dev);
 	
 	printf("Closed %s\n", HPT_DEVICE_NAME);
@@ -42,17 +254,40 @@ void hpt_close(struct hpt *dev)
 
 struct hpt *hpt_alloc(const char name[HPT_NAMESIZE], size_t ring_buffer_items)
 {
-    if(ring_buffer_items == 0 || ring_buffer_items > HPT_MAX_ITEMS)
+    struct hpt_net_device_param net_dev_info;
+
+    memset(&net_dev_info, 0, sizeof(net_dev_info));
+
+	strncpy(net_dev_info.name, name, HPT_NAMESIZE - 1);
+	net_dev_info.name[HPT_NAMESIZE - 1] = 0;
+
+    net_dev_info.ring_buffer_items = ring_buffer_items;
+
+    return hpt_alloc_ex(&net_dev_info);
+}
+
+struct hpt *hpt_alloc_ex(const struct hpt_net_device_param *param)
+{
+    size_t ring_buffer_items = param->ring_buffer_items;
+    const char *name = param->name;
+
+    hpt_select_copy();
+
+    if(!hpt_ring_items_valid(ring_buffer_items))
+    {
+        printf("Cannot allocate that count buffers, a power of two up to %d is needed\n", HPT_MAX_ITEMS);
+        return NULL;
+    }
+
+    if(param->elem_size && !hpt_elem_size_valid(param->elem_size))
     {
-        printf("Cannot allocate that count buffers\n");
+        printf("Invalid element size %u\n", param->elem_size);
         return NULL;
     }
 
     int ret;
     struct hpt *dev;
     struct hpt_net_device_param net_dev_info;
-    void* ring_memory;
-    size_t num_ring_memory;
 
     dev = malloc(sizeof(struct hpt));
     if(!dev)
@@ -72,73 +307,788 @@ struct hpt *hpt_alloc(const char name[HPT_NAMESIZE], size_t ring_buffer_items)
     }
     printf("Opened %s\n", HPT_DEVICE_NAME);
 
-    memset(&net_dev_info, 0, sizeof(net_dev_info));
-
-	strncpy(net_dev_info.name, name, HPT_NAMESIZE - 1);
+    memcpy(&net_dev_info, param, sizeof(net_dev_info));
 	net_dev_info.name[HPT_NAMESIZE - 1] = 0;
 
-    net_dev_info.ring_buffer_items = ring_buffer_items;
-
 	ret = ioctl(dev->fd, HPT_IOCTL_CREATE, &net_dev_info);
 	if (ret < 0) {
         printf("Error create ioctl\n");
         goto end;
 	}
 
-	num_ring_memory = 2 * ring_buffer_items * HPT_RB_ELEMENT_SIZE;
-    size_t aligned_size = PAGE_ALIGN(num_ring_memory);
+	dev->flags = param->flags;
+	dev->umem_frames = param->umem_frames ? param->umem_frames : HPT_UMEM_DEFAULT_FRAMES(ring_buffer_items);
+	dev->elem_size = param->elem_size ? param->elem_size : HPT_RB_ELEMENT_SIZE;
+
+    if(hpt_map_rings(dev, ring_buffer_items) != 0)
+    {
+        goto end;
+    }
+
+	strncpy(dev->name, name, HPT_NAMESIZE - 1);
+	dev->name[HPT_NAMESIZE - 1] = 0;
+
+    return dev;
+
+end:
+    hpt_close(dev);
+    return NULL;
+}
+
+static int hpt_map_rings(struct hpt *dev, size_t ring_buffer_items)
+{
+    size_t aligned_size = PAGE_ALIGN(hpt_memory_size(dev->flags, ring_buffer_items, dev->umem_frames, dev->elem_size));
+    void *ring_memory;
 
     ring_memory = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
     if(ring_memory == MAP_FAILED) 
     {
         printf("Error allocate memory %zu\n", aligned_size);
-        goto end;
+        return -1;
     }
 
     dev->ring_memory = ring_memory;
     dev->size_memory = aligned_size;
+    dev->stream_copy = aligned_size >= HPT_STREAM_COPY_MIN_RING;
 	dev->ring_buffer_items = ring_buffer_items;
-	strncpy(dev->name, name, HPT_NAMESIZE - 1);
-	dev->name[HPT_NAMESIZE - 1] = 0;
+
+    if(dev->flags & HPT_DEV_F_UMEM)
+    {
+        hpt_umem_layout(&dev->umem, ring_memory, ring_buffer_items, dev->umem_frames);
+        dev->ring_info_tx = dev->umem.tx;
+        dev->ring_info_rx = dev->umem.rx;
+        dev->ring_data_tx = NULL;
+        dev->ring_data_rx = NULL;
+        return 0;
+    }
 
     dev->ring_info_tx = (struct hpt_ring_buffer *)ring_memory;
 	dev->ring_info_rx = dev->ring_info_tx + 1;
     dev->ring_data_tx = (uint8_t *)(dev->ring_info_rx + 1);
-    dev->ring_data_rx = dev->ring_data_tx + (dev->ring_buffer_items * HPT_RB_ELEMENT_SIZE);
+    dev->ring_data_rx = dev->ring_data_tx + (dev->ring_buffer_items * dev->elem_size);
+
+    if(dev->flags & HPT_DEV_F_PRIO_LANE)
+    {
+        dev->ring_info_tx_prio = (struct hpt_ring_buffer *)((uint8_t *)dev->ring_info_tx + hpt_ring_memory_size(ring_buffer_items, dev->elem_size));
+        dev->ring_info_rx_prio = dev->ring_info_tx_prio + 1;
+        dev->ring_data_tx_prio = (uint8_t *)(dev->ring_info_rx_prio + 1);
+        dev->ring_data_rx_prio = dev->ring_data_tx_prio + (HPT_PRIO_ITEMS * dev->elem_size);
+    }
 
     printf("Memory mapped to user space at %p\n", ring_memory);
     printf("Memory mapped size %ld\n", aligned_size);
 
+    return 0;
+}
+
+int hpt_resize_pending(struct hpt *dev)
+{
+    return (ACQUIRE(&dev->ring_info_tx->flags) & HPT_RING_F_RESIZE) != 0;
+}
+
+int hpt_remap(struct hpt *dev)
+{
+    struct hpt_net_device_param info;
+    void *old_memory = dev->ring_memory;
+    size_t old_size = dev->size_memory;
+
+    /* A kept burst points into the old rings and is transformed already, it must not be migrated */
+    if(dev->send_burst && (dev->send_burst->prio || dev->send_burst->bulk))
+    {
+        hpt_send_burst_release(dev, dev->send_burst, dev->send_burst->prio + dev->send_burst->bulk);
+        memset(dev->send_burst, 0, sizeof(*dev->send_burst));
+    }
+
+    /* The kernel moves the unread packets into the new rings, the next mmap maps them */
+    if(ioctl(dev->fd, HPT_IOCTL_RESIZE) < 0)
+    {
+        printf("Error resize ioctl\n");
+        return -1;
+    }
+
+    if(ioctl(dev->fd, HPT_IOCTL_INFO, &info) < 0)
+    {
+        printf("Error info ioctl\n");
+        return -1;
+    }
+
+    if(hpt_map_rings(dev, info.ring_buffer_items) != 0)
+    {
+        return -1;
+    }
+
+    munmap(old_memory, old_size);
+
+    return 0;
+}
+
+int hpt_set_persist(struct hpt *dev, int persist)
+{
+    uint32_t value = persist != 0;
+
+    if(ioctl(dev->fd, HPT_IOCTL_SET_PERSIST, &value) < 0)
+    {
+        printf("Error persist ioctl\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct hpt *hpt_from_fd(int fd, const struct hpt_net_device_param *info)
+{
+    struct hpt *dev;
+
+    hpt_select_copy();
+
+    dev = malloc(sizeof(struct hpt));
+    if(!dev)
+    {
+        printf("Cannot allocate 'struct hpt'\n");
+        close(fd);
+        return NULL;
+    }
+
+	memset(dev, 0, sizeof(struct hpt));
+
+    dev->fd = fd;
+	dev->flags = info->flags;
+	dev->umem_frames = info->umem_frames;
+	dev->elem_size = info->elem_size;
+
+    /* Maps the ring memory the kernel kept, unread packets are still in it */
+    if(hpt_map_rings(dev, info->ring_buffer_items) != 0)
+    {
+        hpt_close(dev);
+        return NULL;
+    }
+
+	strncpy(dev->name, info->name, HPT_NAMESIZE - 1);
+	dev->name[HPT_NAMESIZE - 1] = 0;
+
     return dev;
+}
 
-end:
-    hpt_close(dev);
-    return NULL;
+struct hpt *hpt_attach(const char name[HPT_NAMESIZE])
+{
+    struct hpt_net_device_param info;
+    int fd;
+
+    fd = open(HPT_DEVICE_PATH, O_RDWR);
+    if(fd < 0)
+    {
+        printf("Error open %s\n", HPT_DEVICE_NAME);
+        return NULL;
+    }
+
+    memset(&info, 0, sizeof(info));
+	strncpy(info.name, name, HPT_NAMESIZE - 1);
+
+    if(ioctl(fd, HPT_IOCTL_ATTACH, &info) < 0)
+    {
+        printf("Error attach ioctl %s\n", info.name);
+        close(fd);
+        return NULL;
+    }
+
+    return hpt_from_fd(fd, &info);
 }
 
-void hpt_drain(struct hpt *dev, hpt_do_pkt read_cb, void *handle)
+int hpt_send_fd(int sock, struct hpt *dev)
+{
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+
+    /* Some payload is needed for the control message to be delivered on stream sockets */
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &dev->fd, sizeof(int));
+
+    if(sendmsg(sock, &msg, 0) < 0)
+    {
+        printf("Error send device fd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+struct hpt *hpt_recv_fd(int sock)
 {
-	size_t num = hpt_count_items(dev->ring_info_tx);
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct hpt_net_device_param info;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+    {
+        printf("Error receive device fd\n");
+        return NULL;
+    }
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+           cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if(fd < 0)
+    {
+        printf("No device fd in message\n");
+        return NULL;
+    }
+
+    /* The fd refers to the sender's open file, so it is already bound to the device */
+    if(ioctl(fd, HPT_IOCTL_INFO, &info) < 0)
+    {
+        printf("Error info ioctl\n");
+        close(fd);
+        return NULL;
+    }
+
+    return hpt_from_fd(fd, &info);
+}
+
+int hpt_set_pacing(struct hpt *dev, const struct hpt_pacing_param *param)
+{
+    struct hpt_pacing_param pacing = *param;
+
+    if(ioctl(dev->fd, HPT_IOCTL_SET_PACING, &pacing) < 0)
+    {
+        printf("Error pacing ioctl\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int hpt_flush_rx(struct hpt *dev, size_t budget)
+{
+    uint32_t max = budget > UINT32_MAX ? 0 : budget;
+    int ret;
+
+    ret = ioctl(dev->fd, HPT_IOCTL_FLUSH_RX, &max);
+    if(ret < 0)
+    {
+        printf("Error flush rx ioctl\n");
+        return -1;
+    }
+
+    return ret;
+}
+
+size_t hpt_umem_fill(struct hpt *dev, const uint32_t *frames, size_t n)
+{
+    size_t j;
+
+    for(j = 0; j < n; j++)
+    {
+        if(hpt_umem_push_frame(dev->umem.fill, dev->umem.fill_ring, dev->umem.items, frames[j]))
+        {
+            break;
+        }
+    }
+
+    return j;
+}
+
+size_t hpt_umem_complete(struct hpt *dev, uint32_t *frames, size_t max)
+{
+    size_t j;
+
+    for(j = 0; j < max; j++)
+    {
+        if(hpt_umem_pop_frame(dev->umem.comp, dev->umem.comp_ring, dev->umem.items, &frames[j]))
+        {
+            break;
+        }
+    }
+
+    /* The kernel stops taking RX descriptors while the completion ring is full */
+    if(j)
+    {
+        hpt_rx_kick(dev);
+    }
+
+    return j;
+}
+
+size_t hpt_umem_read(struct hpt *dev, struct hpt_umem_desc *descs, size_t max)
+{
+    size_t j;
+
+    for(j = 0; j < max; j++)
+    {
+        if(hpt_umem_pop_desc(dev->umem.tx, dev->umem.tx_ring, dev->umem.items, &descs[j]))
+        {
+            break;
+        }
+    }
+
+    return j;
+}
+
+size_t hpt_umem_write(struct hpt *dev, const struct hpt_umem_desc *descs, size_t n)
+{
+    size_t j;
+
+    for(j = 0; j < n; j++)
+    {
+        if(hpt_umem_push_desc(dev->umem.rx, dev->umem.rx_ring, dev->umem.items, &descs[j]))
+        {
+            break;
+        }
+    }
+
+    if(j)
+    {
+        hpt_rx_kick(dev);
+    }
+
+    return j;
+}
+
+static void hpt_drain_ring(struct hpt_ring_buffer *ring, uint8_t *ring_data, size_t ring_buffer_items, size_t elem_size,
+                           hpt_do_pkt read_cb, hpt_do_pkt_meta meta_cb, void *handle)
+{
+	size_t num = hpt_count_items(ring);
     struct hpt_ring_buffer_element *item;
+    struct hpt_pkt_meta meta;
 
     for(size_t j = 0; j < num; j++)
     {
-        item = hpt_get_item(dev->ring_info_tx, dev->ring_buffer_items, dev->ring_data_tx);
+        if(j + HPT_PREFETCH_ITEMS < num)
+        {
+            hpt_prefetch_item(ring, ring_buffer_items, ring_data, elem_size, HPT_PREFETCH_ITEMS);
+        }
+        item = hpt_get_item(ring, ring_buffer_items, ring_data, elem_size);
         if(!item) continue;
-        read_cb(handle, item->data, item->len);
-        hpt_set_read_item(dev->ring_info_tx);
+        if(read_cb)
+        {
+            if(unlikely(item->csum_state == HPT_CSUM_PARTIAL))
+            {
+                hpt_csum_complete(item->data, item->len, item->csum_start, item->csum_offset);
+            }
+            read_cb(handle, item->data, item->len);
+            hpt_set_read_item(ring);
+            continue;
+        }
+        meta.csum_state = item->csum_state;
+        meta.csum_start = item->csum_start;
+        meta.csum_offset = item->csum_offset;
+        meta.flags = item->flags;
+        if(item->flags & HPT_ELEM_F_META)
+        {
+            meta.hash_type = item->meta.hash_type;
+            meta.protocol = item->meta.protocol;
+            meta.hash = item->meta.hash;
+            meta.mark = item->meta.mark;
+            meta.priority = item->meta.priority;
+            meta.tstamp = item->meta.tstamp;
+        }
+        meta_cb(handle, item->data, item->len, &meta);
+        hpt_set_read_item(ring);
+    }
+}
+
+void hpt_drain(struct hpt *dev, hpt_do_pkt read_cb, void *handle)
+{
+    if(dev->flags & HPT_DEV_F_PRIO_LANE)
+    {
+        hpt_drain_ring(dev->ring_info_tx_prio, dev->ring_data_tx_prio, HPT_PRIO_ITEMS, dev->elem_size, read_cb, NULL, handle);
+    }
+
+    hpt_drain_ring(dev->ring_info_tx, dev->ring_data_tx, dev->ring_buffer_items, dev->elem_size, read_cb, NULL, handle);
+}
+
+void hpt_drain_meta(struct hpt *dev, hpt_do_pkt_meta read_cb, void *handle)
+{
+    if(dev->flags & HPT_DEV_F_PRIO_LANE)
+    {
+        hpt_drain_ring(dev->ring_info_tx_prio, dev->ring_data_tx_prio, HPT_PRIO_ITEMS, dev->elem_size, NULL, read_cb, handle);
+    }
+
+    hpt_drain_ring(dev->ring_info_tx, dev->ring_data_tx, dev->ring_buffer_items, dev->elem_size, NULL, read_cb, handle);
+}
+
+static size_t hpt_sendmmsg_take(struct hpt_ring_buffer *ring, uint8_t *ring_data, size_t ring_buffer_items, size_t elem_size, size_t max,
+                                const struct msghdr *msg, hpt_do_pkt_transform transform_cb, void *handle,
+                                struct hpt_send_burst *burst, size_t *dropped)
+{
+    size_t num = hpt_count_items(ring);
+    uint32_t base = burst->prio + burst->bulk;
+    uint32_t read = ACQUIRE(&ring->read);
+    struct hpt_ring_buffer_element *item;
+    struct hpt_send_buf buf;
+    uint8_t *end;
+    size_t j;
+
+    num = num < max ? num : max;
+    for(j = 0; j < num; j++)
+    {
+        if(j + HPT_PREFETCH_ITEMS < num)
+        {
+            hpt_prefetch_item(ring, ring_buffer_items, ring_data, elem_size, j + HPT_PREFETCH_ITEMS);
+        }
+        item = (struct hpt_ring_buffer_element *)(ring_data + (elem_size * hpt_ring_slot(read + j, ring_buffer_items)));
+        if(unlikely(item->len > elem_size - HPT_RB_ELEMENT_HEADER_SIZE))
+        {
+            (*dropped)++;
+            continue;
+        }
+        if(unlikely(item->csum_state == HPT_CSUM_PARTIAL))
+        {
+            hpt_csum_complete(item->data, item->len, item->csum_start, item->csum_offset);
+        }
+
+        buf.data = item->data;
+        buf.len = item->len;
+        buf.headroom = HPT_RB_ELEMENT_HEADER_SIZE;
+        buf.tailroom = elem_size - HPT_RB_ELEMENT_HEADER_SIZE - item->len;
+        end = (uint8_t *)item + elem_size;
+        if(transform_cb)
+        {
+            if(transform_cb(handle, &buf))
+            {
+                continue;
+            }
+            /* The transform must stay inside the slot */
+            if(unlikely(buf.data < (uint8_t *)item || buf.data > end || buf.len > (size_t)(end - buf.data)))
+            {
+                (*dropped)++;
+                continue;
+            }
+        }
+
+        burst->iovs[burst->count].iov_base = buf.data;
+        burst->iovs[burst->count].iov_len = buf.len;
+        burst->msgs[burst->count].msg_hdr = *msg;
+        burst->msgs[burst->count].msg_hdr.msg_iov = &burst->iovs[burst->count];
+        burst->msgs[burst->count].msg_hdr.msg_iovlen = 1;
+        burst->msgs[burst->count].msg_len = 0;
+        burst->ends[burst->count] = base + j + 1;
+        burst->count++;
+    }
+
+    return num;
+}
+
+static void hpt_send_burst_release(struct hpt *dev, struct hpt_send_burst *burst, uint32_t slots)
+{
+    uint32_t prio_done = burst->released < burst->prio ? burst->released : burst->prio;
+    uint32_t prio_to = slots < burst->prio ? slots : burst->prio;
+
+    if(prio_to > prio_done)
+    {
+        STORE(&dev->ring_info_tx_prio->read, ACQUIRE(&dev->ring_info_tx_prio->read) + (prio_to - prio_done));
+    }
+    if(slots - prio_to > burst->released - prio_done)
+    {
+        STORE(&dev->ring_info_tx->read, ACQUIRE(&dev->ring_info_tx->read) + (slots - prio_to) - (burst->released - prio_done));
+    }
+    burst->released = slots;
+}
+
+int hpt_drain_sendmmsg(struct hpt *dev, int sockfd, size_t max, const struct sockaddr *dst, socklen_t dstlen,
+                       hpt_do_pkt_transform transform_cb, void *handle, size_t *dropped)
+{
+    struct hpt_send_burst *burst = dev->send_burst;
+    struct msghdr msg = { 0 };
+    size_t taken = 0, budget, lost = 0;
+    uint32_t i;
+    int sent = 0, err = 0, ret;
+
+    if(!burst)
+    {
+        burst = calloc(1, sizeof(*burst));
+        if(!burst)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        dev->send_burst = burst;
+    }
+
+    msg.msg_name = (void *)dst;
+    msg.msg_namelen = dst ? dstlen : 0;
+
+    /* A burst kept from the last call is already transformed and goes out first, as it is */
+    for(i = burst->sent; i < burst->count; i++)
+    {
+        burst->msgs[i].msg_hdr.msg_name = msg.msg_name;
+        burst->msgs[i].msg_hdr.msg_namelen = msg.msg_namelen;
     }
+
+    while(!max || taken < max || burst->prio || burst->bulk)
+    {
+        if(!burst->prio && !burst->bulk)
+        {
+            budget = HPT_SENDMMSG_BATCH;
+            if(max && max - taken < budget)
+            {
+                budget = max - taken;
+            }
+
+            if(dev->flags & HPT_DEV_F_PRIO_LANE)
+            {
+                burst->prio = hpt_sendmmsg_take(dev->ring_info_tx_prio, dev->ring_data_tx_prio, HPT_PRIO_ITEMS, dev->elem_size, budget,
+                                                &msg, transform_cb, handle, burst, &lost);
+            }
+            burst->bulk = hpt_sendmmsg_take(dev->ring_info_tx, dev->ring_data_tx, dev->ring_buffer_items, dev->elem_size, budget - burst->prio,
+                                            &msg, transform_cb, handle, burst, &lost);
+            if(!burst->prio && !burst->bulk)
+            {
+                break;
+            }
+            taken += burst->prio + burst->bulk;
+        }
+
+        while(burst->sent < burst->count)
+        {
+            ret = sendmmsg(sockfd, burst->msgs + burst->sent, burst->count - burst->sent, 0);
+            if(ret >= 0)
+            {
+                burst->sent += ret;
+                sent += ret;
+                continue;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            err = errno;
+            if(err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS || err == EBADF || err == ENOTSOCK)
+            {
+                /* Slots up to the first unsent datagram are done with, the rest waits for the next call */
+                hpt_send_burst_release(dev, burst, burst->ends[burst->sent] - 1);
+                goto out;
+            }
+            /* sendmmsg() stops at the datagram that failed, only that one is lost */
+            burst->sent++;
+            lost++;
+        }
+
+        /* The datagrams are copied into socket buffers, the slots can go back to the kernel */
+        hpt_send_burst_release(dev, burst, burst->prio + burst->bulk);
+        burst->count = burst->sent = burst->prio = burst->bulk = burst->released = 0;
+    }
+
+out:
+    if(dropped)
+    {
+        *dropped = lost;
+    }
+    if(err && !sent)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return sent;
 }
 
 void hpt_write(struct hpt *dev, uint8_t *data, size_t len)
 {
-	if(likely(hpt_set_item(dev_info->ring_info_rx, dev_info->ring_buffer_items, dev_info->ring_data_rx, data, len) != 0))
+    hpt_write_meta(dev, data, len, NULL);
+}
+
+void hpt_write_meta(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta)
+{
+    struct hpt_ring_buffer *ring_info = dev->ring_info_rx;
+    struct hpt_ring_buffer_element *item;
+
+    if(dev->flags & HPT_DEV_F_RX_MPSC)
     {
+        hpt_write_mp(dev, data, len, meta);
         return;
-    } 
-    else
+    }
+
+    item = hpt_get_write_item(ring_info, dev->ring_buffer_items, dev->ring_data_rx, dev->elem_size, len);
+    if(unlikely(!item))
     {
-        struct hpt_ring_buffer *ring_info = dev_info->ring_info_rx;
-		STORE(&ring_info->write, ACQUIRE(&ring_info->write) + 1);	
+        return;
     }
+
+    item->flags = hpt_fill_item(dev, item, data, len, meta);
+
+	STORE(&ring_info->write, ACQUIRE(&ring_info->write) + 1);
+
+    hpt_rx_kick(dev);
+}
+
+void hpt_write_prio(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta)
+{
+    struct hpt_ring_buffer *ring_info = dev->ring_info_rx_prio;
+    struct hpt_ring_buffer_element *item;
+
+    if(!(dev->flags & HPT_DEV_F_PRIO_LANE))
+    {
+        hpt_write_meta(dev, data, len, meta);
+        return;
+    }
+
+    item = hpt_get_write_item(ring_info, HPT_PRIO_ITEMS, dev->ring_data_rx_prio, dev->elem_size, len);
+    if(unlikely(!item))
+    {
+        return;
+    }
+
+    item->flags = hpt_fill_item(dev, item, data, len, meta);
+
+	STORE(&ring_info->write, ACQUIRE(&ring_info->write) + 1);
+
+    hpt_rx_kick(dev);
+}
+
+static uint8_t hpt_fill_item(struct hpt *dev, struct hpt_ring_buffer_element *item, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta)
+{
+    item->len = len;
+    hpt_copy_to_ring(dev, item->data, data, len);
+
+    if(!meta)
+    {
+        item->csum_state = HPT_CSUM_UNNECESSARY;
+        item->csum_start = 0;
+        item->csum_offset = 0;
+        return 0;
+    }
+
+    item->csum_state = meta->csum_state;
+    item->csum_start = meta->csum_start;
+    item->csum_offset = meta->csum_offset;
+    if(meta->flags & HPT_ELEM_F_META)
+    {
+        item->meta.hash_type = meta->hash_type;
+        item->meta.protocol = meta->protocol;
+        item->meta.hash = meta->hash;
+        item->meta.mark = meta->mark;
+        item->meta.priority = meta->priority;
+        item->meta.tstamp = 0;
+    }
+
+    return meta->flags & HPT_ELEM_F_META;
+}
+
+static void hpt_write_mp(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta)
+{
+    struct hpt_ring_buffer *ring_info = dev->ring_info_rx;
+    struct hpt_ring_buffer_element *item;
+    uint32_t write;
+    uint8_t flags;
+
+    if(unlikely(len > dev->elem_size - HPT_RB_ELEMENT_HEADER_SIZE))
+    {
+        return;
+    }
+
+    write = ACQUIRE(&ring_info->write);
+    do
+    {
+        if(unlikely(!hpt_free_items(ring_info, dev->ring_buffer_items)))
+        {
+            return;
+        }
+    }
+    while(!__atomic_compare_exchange_n(&ring_info->write, &write, write + 1, 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    item = (struct hpt_ring_buffer_element *)(dev->ring_data_rx + (dev->elem_size * hpt_ring_slot(write, dev->ring_buffer_items)));
+
+    flags = hpt_fill_item(dev, item, data, len, meta);
+    STORE(&item->flags, flags | HPT_ELEM_F_READY);
+
+    hpt_rx_kick(dev);
+}
+
+struct hpt_ring_buffer_element *hpt_tx_peek(struct hpt *dev, size_t n)
+{
+    return hpt_get_item_at(dev->ring_info_tx, dev->ring_buffer_items, dev->ring_data_tx, dev->elem_size, n);
+}
+
+void hpt_tx_release(struct hpt *dev, size_t n)
+{
+    for(size_t j = 0; j < n; j++)
+    {
+        hpt_set_read_item(dev->ring_info_tx);
+    }
+}
+
+struct hpt_ring_buffer_element *hpt_rx_reserve(struct hpt *dev, size_t n)
+{
+    return hpt_get_write_item_at(dev->ring_info_rx, dev->ring_buffer_items, dev->ring_data_rx, dev->elem_size, n);
+}
+
+void hpt_rx_publish(struct hpt *dev, size_t n)
+{
+    struct hpt_ring_buffer *ring_info = dev->ring_info_rx;
+
+	STORE(&ring_info->write, ACQUIRE(&ring_info->write) + n);
+
+    hpt_rx_kick(dev);
+}
+
+void hpt_csum_complete(uint8_t *pkt_data, size_t pkt_size, uint16_t csum_start, uint16_t csum_offset)
+{
+    uint32_t sum = 0;
+    size_t i;
+    uint16_t csum;
+
+    if(unlikely((size_t)csum_start + csum_offset + sizeof(uint16_t) > pkt_size))
+    {
+        return;
+    }
+
+    /* The kernel seeded the checksum field with the pseudo header sum, so it is part of the fold */
+    for(i = csum_start; i + 1 < pkt_size; i += 2)
+    {
+        sum += (pkt_data[i] << 8) | pkt_data[i + 1];
+    }
+    if(i < pkt_size)
+    {
+        sum += pkt_data[i] << 8;
+    }
+
+    while(sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    /* A zero UDP checksum means no checksum, the kernel sends it as 0xFFFF (CSUM_MANGLED_0) */
+    csum = ~sum;
+    if(!csum)
+    {
+        csum = 0xFFFF;
+    }
+
+    pkt_data[csum_start + csum_offset] = csum >> 8;
+    pkt_data[csum_start + csum_offset + 1] = csum & 0xFF;
 }
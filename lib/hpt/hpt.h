@@ -4,11 +4,74 @@
 #include "hpt_common.h"
 #include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 //#include <uv.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef void (*hpt_do_pkt)(void *handle, uint8_t *pkt_data, size_t pkt_size);
 
+/**********************************************************************************************//**
+* @brief Per-packet metadata carried in the ring element alongside the payload
+**************************************************************************************************/
+struct hpt_pkt_meta
+{
+    uint8_t csum_state;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint8_t flags; /* HPT_ELEM_F_META when the fields below are valid */
+    uint8_t hash_type;
+    uint16_t protocol;
+    uint32_t hash;
+    uint32_t mark;
+    uint32_t priority;
+    uint64_t tstamp;
+};
+
+typedef void (*hpt_do_pkt_meta)(void *handle, uint8_t *pkt_data, size_t pkt_size, const struct hpt_pkt_meta *meta);
+
+typedef void (*hpt_do_pkt_worker)(void *handle, size_t worker, uint8_t *pkt_data, size_t pkt_size, const struct hpt_pkt_meta *meta);
+
+typedef int (*hpt_pkt_unordered)(void *handle, const uint8_t *pkt_data, size_t pkt_size);
+
+/**********************************************************************************************//**
+* @brief Parameters of a flow-sharded dispatcher
+**************************************************************************************************/
+struct hpt_dispatch_param
+{
+    size_t workers;                  /* number of worker threads */
+    size_t queue_items;              /* per-worker queue depth, rounded up to a power of two, 0 for default */
+    size_t burst;                    /* packets taken from the TX ring per hpt_dispatch_drain(), 0 for the ring size */
+    hpt_do_pkt_worker worker_cb;     /* called on the worker threads */
+    hpt_pkt_unordered unordered_cb;  /* optional, non-zero for packets any idle worker may handle */
+    void *handle;                    /* passed to the callbacks */
+};
+
+struct hpt_dispatch;
+
+/* Packets per sendmmsg() call of hpt_drain_sendmmsg() */
+#define HPT_SENDMMSG_BATCH 64
+
+/**********************************************************************************************//**
+* @brief Datagram handed to the transform of hpt_drain_sendmmsg(), still inside its TX ring slot
+* The transform may move data back by up to headroom bytes to prepend a header and grow len by
+* the headroom used plus up to tailroom bytes, e.g. for an authentication tag.
+**************************************************************************************************/
+struct hpt_send_buf
+{
+    uint8_t *data;   /* start of the datagram */
+    size_t len;      /* length of the datagram */
+    size_t headroom; /* bytes free in front of data, they overlap the element header */
+    size_t tailroom; /* bytes free behind data + len */
+};
+
+typedef int (*hpt_do_pkt_transform)(void *handle, struct hpt_send_buf *buf);
+
+struct hpt_send_burst;
+
 /**********************************************************************************************//**
 * @brief Main structure representing the HPT device
 **************************************************************************************************/
@@ -16,6 +79,7 @@ struct hpt
 {
 	char name[HPT_NAMESIZE];
     size_t ring_buffer_items;
+    uint32_t flags;
     int isTread;
     pthread_t thread_write;
     pthread_mutex_t mutex;
@@ -27,8 +91,17 @@ struct hpt
     struct hpt_ring_buffer *ring_info_tx;
     void *ring_memory;
     size_t size_memory;
+    int stream_copy;
     uint8_t *ring_data_rx;
     uint8_t *ring_data_tx;
+    struct hpt_ring_buffer *ring_info_rx_prio; /* HPT_DEV_F_PRIO_LANE only */
+    struct hpt_ring_buffer *ring_info_tx_prio;
+    uint8_t *ring_data_rx_prio;
+    uint8_t *ring_data_tx_prio;
+    uint32_t umem_frames;
+    uint32_t elem_size; /* bytes per ring element */
+    struct hpt_umem umem; /* HPT_DEV_F_UMEM only */
+    struct hpt_send_burst *send_burst; /* hpt_drain_sendmmsg() burst, allocated on first use */
 };
 
 /**********************************************************************************************//**
@@ -47,7 +120,7 @@ int hpt_efd(struct hpt *dev);
 
 /**********************************************************************************************//**
 * @brief hpt_init: Initialize the HPT system
-* @param dev: Pointer to the HPT device structure
+* Selects the ring copy routine for the CPU (AVX2 streaming stores where available).
 * @return 0 on success
 * @return Negative value on failure
 **************************************************************************************************/
@@ -68,11 +141,287 @@ void hpt_close(struct hpt *dev);
 **************************************************************************************************/
 struct hpt *hpt_alloc(const char name[HPT_NAMESIZE], size_t alloc_buffers_count);
 
+/**********************************************************************************************//**
+* @brief hpt_alloc_ex: Allocate an HPT device with the full set of creation parameters
+* @param param: Name, ring size and HPT_DEV_F_* flags of the device
+* @return Pointer to the allocated HPT device on success
+* @return NULL on failure
+**************************************************************************************************/
+struct hpt *hpt_alloc_ex(const struct hpt_net_device_param *param);
+
+/**********************************************************************************************//**
+* @brief hpt_resize_pending: Check if the rings were resized (ethtool -G) and need a remap
+* The device fd also reports POLLPRI while a resize is pending.
+* @param dev: Pointer to the HPT device structure
+* @return Non-zero if hpt_remap() must be called
+**************************************************************************************************/
+int hpt_resize_pending(struct hpt *dev);
+
+/**********************************************************************************************//**
+* @brief hpt_remap: Have the kernel migrate unread packets to rings of the new size and map them
+* No other thread may read or write the rings during the call. Pointers into the old rings,
+* such as io_uring fixed buffers, are invalid afterwards. A burst hpt_drain_sendmmsg() kept for
+* a retry is dropped.
+* @param dev: Pointer to the HPT device structure
+* @return 0 on success
+* @return Negative value on failure, the old rings stay mapped. If the kernel already migrated
+*         the packets, calling hpt_remap() again maps the new rings
+**************************************************************************************************/
+int hpt_remap(struct hpt *dev);
+
+/**********************************************************************************************//**
+* @brief hpt_set_persist: Keep the interface, RX thread and rings alive after the device is closed
+* A new process picks the device up with hpt_attach(), packets left in the rings are kept.
+* @param dev: Pointer to the HPT device structure
+* @param persist: Non-zero to persist, zero to tear the device down on close again
+* @return 0 on success
+* @return Negative value on failure
+**************************************************************************************************/
+int hpt_set_persist(struct hpt *dev, int persist);
+
+/**********************************************************************************************//**
+* @brief hpt_attach: Take over a persistent device left by a previous process
+* @param name: Name of the device
+* @return Pointer to the HPT device on success
+* @return NULL on failure, or if the device is not persistent or still open elsewhere
+**************************************************************************************************/
+struct hpt *hpt_attach(const char name[HPT_NAMESIZE]);
+
+/**********************************************************************************************//**
+* @brief hpt_send_fd: Pass the device fd to another process over a unix socket (SCM_RIGHTS)
+* Both processes then share the rings, only one of them may drive each ring.
+* @param sock: Connected AF_UNIX socket
+* @param dev: Pointer to the HPT device structure
+* @return 0 on success
+* @return Negative value on failure
+**************************************************************************************************/
+int hpt_send_fd(int sock, struct hpt *dev);
+
+/**********************************************************************************************//**
+* @brief hpt_recv_fd: Receive a device fd sent with hpt_send_fd() and map its rings
+* @param sock: Connected AF_UNIX socket
+* @return Pointer to the HPT device on success
+* @return NULL on failure
+**************************************************************************************************/
+struct hpt *hpt_recv_fd(int sock);
+
+/**********************************************************************************************//**
+* @brief hpt_drain: Call read_cb for every packet in the TX ring
+* Packets the kernel left with a partial checksum are completed before read_cb sees them.
+* With HPT_DEV_F_PRIO_LANE the priority ring is drained first.
+* @param dev: Pointer to the HPT device structure
+* @param read_cb: Callback invoked for each packet
+* @param handle: Opaque pointer passed to read_cb
+**************************************************************************************************/
 void hpt_drain(struct hpt *dev, hpt_do_pkt read_cb, void *handle);
 
+/**********************************************************************************************//**
+* @brief hpt_drain_meta: Call read_cb for every packet in the TX ring, passing its metadata
+* Partial checksums are left to read_cb, e.g. to fold them into the encryption pass.
+* @param dev: Pointer to the HPT device structure
+* @param read_cb: Callback invoked for each packet
+* @param handle: Opaque pointer passed to read_cb
+**************************************************************************************************/
+void hpt_drain_meta(struct hpt *dev, hpt_do_pkt_meta read_cb, void *handle);
+
+/**********************************************************************************************//**
+* @brief hpt_drain_sendmmsg: Send TX ring packets on a socket, one sendmmsg() per burst
+* The iovecs point into the ring slots, which go back to the kernel only once sendmmsg() returned.
+* Partial checksums are completed before transform_cb runs, the priority ring is drained first.
+* A datagram the socket refuses is dropped and the rest of the burst is still sent. On EAGAIN,
+* EWOULDBLOCK or ENOBUFS the unsent part of the burst keeps its slots and is sent first, without
+* running transform_cb again, by the next call.
+* @param dev: Pointer to the HPT device structure
+* @param sockfd: Socket to send on
+* @param max: Maximum number of ring slots to take, 0 for all queued packets
+* @param dst: Destination address, NULL for a connected socket
+* @param dstlen: Length of dst
+* @param transform_cb: Optional in-place transform, non-zero drops the packet. The element header
+*                      is overwritten once the headroom is used
+* @param handle: Opaque pointer passed to transform_cb
+* @param dropped: Optional, set to the number of packets dropped because sendmmsg() failed on
+*                 them or their element was corrupt
+* @return Number of packets sent
+* @return -1 with errno set if sendmmsg() failed before sending anything
+**************************************************************************************************/
+int hpt_drain_sendmmsg(struct hpt *dev, int sockfd, size_t max, const struct sockaddr *dst, socklen_t dstlen,
+                       hpt_do_pkt_transform transform_cb, void *handle, size_t *dropped);
+
+/**********************************************************************************************//**
+* @brief hpt_write: Write a packet to the RX ring
+* Single producer unless the device was created with HPT_DEV_F_RX_MPSC, in which case any number
+* of threads may call hpt_write() and hpt_write_meta() concurrently without a lock.
+* @param dev: Pointer to the HPT device structure
+* @param data: Packet data
+* @param len: Packet length
+**************************************************************************************************/
 void hpt_write(struct hpt *dev, uint8_t *data, size_t len);
 
+/**********************************************************************************************//**
+* @brief hpt_write_meta: Write a packet to the RX ring together with its metadata
+* @param dev: Pointer to the HPT device structure
+* @param data: Packet data
+* @param len: Packet length
+* @param meta: Checksum state and, with HPT_ELEM_F_META, flow metadata of the packet.
+*              NULL is the same as hpt_write()
+**************************************************************************************************/
+void hpt_write_meta(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_write_prio: Write a packet to the priority RX ring, the kernel services it first
+* Single producer, falls back to the bulk ring when the device has no priority lane.
+* @param dev: Pointer to the HPT device structure
+* @param data: Packet data
+* @param len: Packet length
+* @param meta: Checksum state and flow metadata of the packet, or NULL
+**************************************************************************************************/
+void hpt_write_prio(struct hpt *dev, uint8_t *data, size_t len, const struct hpt_pkt_meta *meta);
+
+/**********************************************************************************************//**
+* @brief hpt_tx_peek: Get the n-th pending TX ring packet without consuming it
+* Together with hpt_tx_release() this lets the caller keep slots alive while they are in flight,
+* e.g. during an asynchronous send straight out of the ring.
+* @param dev: Pointer to the HPT device structure
+* @param n: Position relative to the oldest unconsumed packet
+* @return Pointer to the ring element, or NULL if there is no such packet
+**************************************************************************************************/
+struct hpt_ring_buffer_element *hpt_tx_peek(struct hpt *dev, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_tx_release: Hand the n oldest TX ring slots back to the kernel
+* @param dev: Pointer to the HPT device structure
+* @param n: Number of slots to release
+**************************************************************************************************/
+void hpt_tx_release(struct hpt *dev, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_reserve: Get the n-th free RX ring slot to fill in place
+* The slot is handed to the kernel by hpt_rx_publish() once it and all slots before it are filled.
+* Single producer only, not for HPT_DEV_F_RX_MPSC devices.
+* @param dev: Pointer to the HPT device structure
+* @param n: Position relative to the first free slot
+* @return Pointer to the ring element, or NULL if the ring has fewer than n + 1 free slots
+**************************************************************************************************/
+struct hpt_ring_buffer_element *hpt_rx_reserve(struct hpt *dev, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_rx_publish: Make the n first reserved RX ring slots visible to the kernel
+* @param dev: Pointer to the HPT device structure
+* @param n: Number of slots to publish
+**************************************************************************************************/
+void hpt_rx_publish(struct hpt *dev, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_set_pacing: Limit the rate at which the kernel takes packets from the RX ring
+* Packets over the limit wait in the ring, ethtool -S shows how often and for how long.
+* @param dev: Pointer to the HPT device structure
+* @param param: Packet and bit rates with their bursts, all zero to disable pacing
+* @return 0 on success
+* @return Negative value on failure
+**************************************************************************************************/
+int hpt_set_pacing(struct hpt *dev, const struct hpt_pacing_param *param);
+
+/**********************************************************************************************//**
+* @brief hpt_flush_rx: Hand the packets in the RX ring to the network stack from the calling thread
+* Run-to-completion alternative to the RX kernel thread: one system call per batch, no wakeup of
+* another core. Only for devices created with HPT_DEV_F_NO_KTHREAD, which have no other consumer.
+* @param dev: Pointer to the HPT device structure
+* @param budget: Maximum number of packets to take, 0 for all of them
+* @return Number of packets handed to the network stack
+* @return Negative value on failure
+**************************************************************************************************/
+int hpt_flush_rx(struct hpt *dev, size_t budget);
+
+/**********************************************************************************************//**
+* @brief hpt_umem_fill: Give free frames to the kernel for packets coming from the network stack
+* Frame data is reached with hpt_umem_frame(&dev->umem, frame).
+* @param dev: Pointer to the HPT device structure, created with HPT_DEV_F_UMEM
+* @param frames: Frame indices
+* @param n: Number of frames
+* @return Number of frames handed over, less than n if the fill ring is full
+**************************************************************************************************/
+size_t hpt_umem_fill(struct hpt *dev, const uint32_t *frames, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_umem_complete: Take back the frames of packets the kernel has consumed
+* @param dev: Pointer to the HPT device structure, created with HPT_DEV_F_UMEM
+* @param frames: Array receiving the frame indices
+* @param max: Size of frames
+* @return Number of frames returned
+**************************************************************************************************/
+size_t hpt_umem_complete(struct hpt *dev, uint32_t *frames, size_t max);
+
+/**********************************************************************************************//**
+* @brief hpt_umem_read: Take packets from the TX descriptor ring
+* The frames belong to the caller afterwards: they can be kept, refilled or passed to
+* hpt_umem_write() as they are. Partial checksums are left to the caller, see hpt_csum_complete().
+* @param dev: Pointer to the HPT device structure, created with HPT_DEV_F_UMEM
+* @param descs: Array receiving the descriptors
+* @param max: Size of descs
+* @return Number of descriptors returned
+**************************************************************************************************/
+size_t hpt_umem_read(struct hpt *dev, struct hpt_umem_desc *descs, size_t max);
+
+/**********************************************************************************************//**
+* @brief hpt_umem_write: Hand packets in frames to the network stack through the RX descriptor ring
+* The frames come back through hpt_umem_complete().
+* @param dev: Pointer to the HPT device structure, created with HPT_DEV_F_UMEM
+* @param descs: Descriptors of the packets
+* @param n: Number of descriptors
+* @return Number of descriptors posted, less than n if the RX ring is full
+**************************************************************************************************/
+size_t hpt_umem_write(struct hpt *dev, const struct hpt_umem_desc *descs, size_t n);
+
+/**********************************************************************************************//**
+* @brief hpt_csum_complete: Fill in a partial (CHECKSUM_PARTIAL style) checksum
+* A checksum that folds to 0 is stored as 0xFFFF, like the kernel does.
+* @param pkt_data: Packet data
+* @param pkt_size: Packet length
+* @param csum_start: Offset where checksumming starts
+* @param csum_offset: Offset from csum_start where the checksum is stored
+**************************************************************************************************/
+void hpt_csum_complete(uint8_t *pkt_data, size_t pkt_size, uint16_t csum_start, uint16_t csum_offset);
+
+/**********************************************************************************************//**
+* @brief hpt_flow_hash: Hash the 5-tuple of an IPv4 or IPv6 packet
+* @param pkt_data: Packet data
+* @param pkt_size: Packet length
+* @return Flow hash, 0 for packets that are not IP
+**************************************************************************************************/
+uint32_t hpt_flow_hash(const uint8_t *pkt_data, size_t pkt_size);
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_create: Start worker threads that share the TX ring of a device
+* Packets are sharded to workers by flow hash (the kernel hash when HPT_DEV_F_META is set, the
+* 5-tuple otherwise), so packets of one flow are always handled in order by the same worker.
+* Packets for which unordered_cb returns non-zero go to a shared queue any idle worker takes from.
+* @param dev: Pointer to the HPT device structure
+* @param param: Dispatcher parameters
+* @return Pointer to the dispatcher on success
+* @return NULL on failure
+**************************************************************************************************/
+struct hpt_dispatch *hpt_dispatch_create(struct hpt *dev, const struct hpt_dispatch_param *param);
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_drain: Move a burst of packets from the TX ring to the worker queues
+* Call it where hpt_drain() would be called. Packets stay in the ring while their worker's queue
+* is full, so a slow worker applies back pressure instead of losing or reordering packets.
+* @param disp: Pointer to the dispatcher
+* @return Number of packets taken from the ring
+**************************************************************************************************/
+size_t hpt_dispatch_drain(struct hpt_dispatch *disp);
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_destroy: Let the workers finish their queues, stop them and free the dispatcher
+* @param disp: Pointer to the dispatcher
+**************************************************************************************************/
+void hpt_dispatch_destroy(struct hpt_dispatch *disp);
+
 
 #define PAYLOAD_SIZE 1024
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,378 @@
+#ifndef _HPT_HPP_
+#define _HPT_HPP_
+
+#if __cplusplus < 202002L
+#error "hpt.hpp requires C++20"
+#endif
+
+#include "hpt.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/* Not hpt:: since that names struct hpt of the C API */
+namespace hptxx
+{
+
+/* View of one packet in a ring element, valid until the element is released */
+using Packet = std::span<const std::byte>;
+
+/* Element size template argument for rings whose element size is only known at run time */
+inline constexpr std::size_t dynamic_elem_size = 0;
+
+/**********************************************************************************************//**
+* @brief Ring geometry, usable in constant expressions
+**************************************************************************************************/
+constexpr bool elem_size_valid(std::size_t elem_size)
+{
+    return elem_size >= HPT_RB_ELEMENT_MIN_SIZE && elem_size <= HPT_RB_ELEMENT_MAX_SIZE &&
+           (elem_size & (elem_size - 1)) == 0;
+}
+
+constexpr std::size_t usable_space(std::size_t elem_size)
+{
+    return elem_size - HPT_RB_ELEMENT_HEADER_SIZE;
+}
+
+constexpr std::size_t ring_memory_size(std::size_t ring_buffer_items, std::size_t elem_size)
+{
+    return (2 * sizeof(struct hpt_ring_buffer)) + (2 * ring_buffer_items * elem_size);
+}
+
+constexpr std::size_t memory_size(std::uint32_t flags, std::size_t ring_buffer_items, std::size_t elem_size)
+{
+    return ring_memory_size(ring_buffer_items, elem_size) +
+           ((flags & HPT_DEV_F_PRIO_LANE) ? ring_memory_size(HPT_PRIO_ITEMS, elem_size) : 0);
+}
+
+constexpr bool ring_items_valid(std::size_t ring_buffer_items)
+{
+    return ring_buffer_items && ring_buffer_items <= HPT_MAX_ITEMS && (ring_buffer_items & (ring_buffer_items - 1)) == 0;
+}
+
+static_assert(ring_memory_size(PAGES_PER_BLOCK, HPT_RB_ELEMENT_SIZE) ==
+              2 * sizeof(struct hpt_ring_buffer) + 2 * PAGES_PER_BLOCK * HPT_RB_ELEMENT_SIZE);
+static_assert(elem_size_valid(HPT_RB_ELEMENT_SIZE));
+static_assert(ring_items_valid(HPT_PRIO_ITEMS));
+
+/**********************************************************************************************//**
+* @brief Kernel -> userspace ring, the TX ring or the priority TX ring of a device
+* With a fixed ElemSize the element offset is a shift instead of a multiplication and the length
+* check compares against a constant. The ring has a single consumer.
+**************************************************************************************************/
+template<std::size_t ElemSize = dynamic_elem_size>
+class Ring
+{
+    static_assert(ElemSize == dynamic_elem_size || elem_size_valid(ElemSize), "invalid element size");
+
+public:
+    Ring(struct hpt_ring_buffer *info, std::uint8_t *data, std::size_t items, std::size_t elem_size = ElemSize)
+        : info_(info), data_(data), items_(items), elem_size_(elem_size)
+    {
+    }
+
+    std::size_t elem_size() const
+    {
+        if constexpr(ElemSize != dynamic_elem_size)
+        {
+            return ElemSize;
+        }
+        else
+        {
+            return elem_size_;
+        }
+    }
+
+    std::size_t items() const
+    {
+        return items_;
+    }
+
+    struct hpt_ring_buffer *info() const
+    {
+        return info_;
+    }
+
+    std::size_t count() const
+    {
+        return hpt_count_items(info_);
+    }
+
+    /* Element at free-running ring index ind, masked to the ring size, no length check */
+    struct hpt_ring_buffer_element *element(std::uint32_t ind) const
+    {
+        return reinterpret_cast<struct hpt_ring_buffer_element *>(data_ + (elem_size() * (ind & (items_ - 1))));
+    }
+
+    /* n-th unread element without consuming it, nullptr if there is none or its length is corrupt */
+    struct hpt_ring_buffer_element *peek(std::size_t n) const
+    {
+        struct hpt_ring_buffer_element *elem;
+
+        if(unlikely(n >= count()))
+        {
+            return nullptr;
+        }
+
+        elem = element(ACQUIRE(&info_->read) + n);
+        if(unlikely(elem->len > usable_space(elem_size())))
+        {
+            return nullptr;
+        }
+
+        return elem;
+    }
+
+    /* Hand the n oldest elements back to the kernel */
+    void release(std::size_t n)
+    {
+        STORE(&info_->read, static_cast<std::uint32_t>(info_->read + n));
+    }
+
+    /**********************************************************************************************//**
+    * @brief drain: Call f for every packet queued when the call starts
+    * f takes a Packet, or a Packet and its const hpt_pkt_meta &. Without the metadata partial
+    * checksums are completed before f sees the packet, as in hpt_drain(). Each element is handed
+    * back to the kernel right after f returns.
+    * @param f: Per-packet handler, inlined into the loop
+    * @return Number of packets handled
+    **************************************************************************************************/
+    template<class F>
+    std::size_t drain(F &&f)
+    {
+        constexpr bool with_meta = std::is_invocable_v<F &, Packet, const struct hpt_pkt_meta &>;
+        static_assert(with_meta || std::is_invocable_v<F &, Packet>,
+                      "handler must take hptxx::Packet or (hptxx::Packet, const hpt_pkt_meta &)");
+
+        std::size_t num = count();
+        std::uint32_t read = info_->read; /* only the consumer moves read */
+        struct hpt_ring_buffer_element *item;
+        std::size_t j;
+
+        for(j = 0; j < num; j++)
+        {
+            if(j + HPT_PREFETCH_ITEMS < num)
+            {
+                std::uint8_t *next = reinterpret_cast<std::uint8_t *>(element(read + HPT_PREFETCH_ITEMS));
+
+                HPT_PREFETCH(next);
+                HPT_PREFETCH(next + 64);
+            }
+
+            item = element(read);
+            /* Left in the ring like hpt_drain() does, the kernel never writes such an element */
+            if(unlikely(item->len > usable_space(elem_size())))
+            {
+                break;
+            }
+
+            if constexpr(with_meta)
+            {
+                struct hpt_pkt_meta meta = {};
+
+                meta.csum_state = item->csum_state;
+                meta.csum_start = item->csum_start;
+                meta.csum_offset = item->csum_offset;
+                meta.flags = item->flags;
+                if(item->flags & HPT_ELEM_F_META)
+                {
+                    meta.hash_type = item->meta.hash_type;
+                    meta.protocol = item->meta.protocol;
+                    meta.hash = item->meta.hash;
+                    meta.mark = item->meta.mark;
+                    meta.priority = item->meta.priority;
+                    meta.tstamp = item->meta.tstamp;
+                }
+                f(Packet(reinterpret_cast<const std::byte *>(item->data), item->len), static_cast<const struct hpt_pkt_meta &>(meta));
+            }
+            else
+            {
+                if(unlikely(item->csum_state == HPT_CSUM_PARTIAL))
+                {
+                    hpt_csum_complete(item->data, item->len, item->csum_start, item->csum_offset);
+                }
+                f(Packet(reinterpret_cast<const std::byte *>(item->data), item->len));
+            }
+
+            STORE(&info_->read, ++read);
+        }
+
+        return j;
+    }
+
+private:
+    struct hpt_ring_buffer *info_;
+    std::uint8_t *data_;
+    std::size_t items_;
+    std::size_t elem_size_;
+};
+
+/**********************************************************************************************//**
+* @brief Owning, move-only handle of an HPT device, closes it on destruction
+* Failures are reported like the C API: the factories return an empty handle, test it with
+* operator bool.
+**************************************************************************************************/
+class Device
+{
+public:
+    Device() = default;
+
+    /* Takes ownership of a device from hpt_alloc(), hpt_attach() or hpt_recv_fd() */
+    explicit Device(struct hpt *dev) : dev_(dev)
+    {
+    }
+
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    Device(Device &&other) noexcept : dev_(std::exchange(other.dev_, nullptr))
+    {
+    }
+
+    Device &operator=(Device &&other) noexcept
+    {
+        if(this != &other)
+        {
+            reset(std::exchange(other.dev_, nullptr));
+        }
+
+        return *this;
+    }
+
+    ~Device()
+    {
+        reset();
+    }
+
+    static Device alloc(std::string_view name, std::size_t ring_buffer_items)
+    {
+        struct hpt_net_device_param param = {};
+
+        if(name.size() >= HPT_NAMESIZE)
+        {
+            return Device();
+        }
+
+        name.copy(param.name, name.size());
+        param.ring_buffer_items = ring_buffer_items;
+
+        return create(param);
+    }
+
+    static Device create(const struct hpt_net_device_param &param)
+    {
+        return Device(hpt_alloc_ex(&param));
+    }
+
+    static Device attach(std::string_view name)
+    {
+        char buf[HPT_NAMESIZE] = {};
+
+        if(name.size() >= HPT_NAMESIZE)
+        {
+            return Device();
+        }
+
+        name.copy(buf, name.size());
+
+        return Device(hpt_attach(buf));
+    }
+
+    explicit operator bool() const
+    {
+        return dev_ != nullptr;
+    }
+
+    struct hpt *get() const
+    {
+        return dev_;
+    }
+
+    /* Gives up ownership without closing the device */
+    struct hpt *release()
+    {
+        return std::exchange(dev_, nullptr);
+    }
+
+    void reset(struct hpt *dev = nullptr)
+    {
+        if(dev_)
+        {
+            hpt_close(dev_);
+        }
+        dev_ = dev;
+    }
+
+    int fd() const
+    {
+        return hpt_efd(dev_);
+    }
+
+    std::size_t elem_size() const
+    {
+        return dev_->elem_size;
+    }
+
+    template<std::size_t ElemSize = dynamic_elem_size>
+    Ring<ElemSize> tx_ring() const
+    {
+        return Ring<ElemSize>(dev_->ring_info_tx, dev_->ring_data_tx, dev_->ring_buffer_items, dev_->elem_size);
+    }
+
+    /* Only for devices created with HPT_DEV_F_PRIO_LANE */
+    template<std::size_t ElemSize = dynamic_elem_size>
+    Ring<ElemSize> tx_prio_ring() const
+    {
+        return Ring<ElemSize>(dev_->ring_info_tx_prio, dev_->ring_data_tx_prio, HPT_PRIO_ITEMS, dev_->elem_size);
+    }
+
+    /**********************************************************************************************//**
+    * @brief drain: Call f for every packet in the TX ring, the priority ring first
+    * Drop-in for hpt_drain()/hpt_drain_meta() with the handler inlined instead of called through a
+    * function pointer. With a non-zero ElemSize the ring walk is specialised for that element size,
+    * a device created with another size falls back to the generic walk.
+    * @param f: Per-packet handler, see Ring::drain()
+    * @return Number of packets handled
+    **************************************************************************************************/
+    template<std::size_t ElemSize = dynamic_elem_size, class F>
+    std::size_t drain(F &&f)
+    {
+        std::size_t num = 0;
+
+        if constexpr(ElemSize != dynamic_elem_size)
+        {
+            if(unlikely(dev_->elem_size != ElemSize))
+            {
+                return drain<dynamic_elem_size>(f);
+            }
+        }
+
+        if(dev_->flags & HPT_DEV_F_PRIO_LANE)
+        {
+            num += tx_prio_ring<ElemSize>().drain(f);
+        }
+
+        return num + tx_ring<ElemSize>().drain(f);
+    }
+
+    void write(Packet pkt, const struct hpt_pkt_meta *meta = nullptr)
+    {
+        hpt_write_meta(dev_, const_cast<std::uint8_t *>(reinterpret_cast<const std::uint8_t *>(pkt.data())), pkt.size(), meta);
+    }
+
+    void write_prio(Packet pkt, const struct hpt_pkt_meta *meta = nullptr)
+    {
+        hpt_write_prio(dev_, const_cast<std::uint8_t *>(reinterpret_cast<const std::uint8_t *>(pkt.data())), pkt.size(), meta);
+    }
+
+private:
+    struct hpt *dev_ = nullptr;
+};
+
+} // namespace hptxx
+
+#endif
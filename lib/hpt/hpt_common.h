@@ -6,6 +6,7 @@
 #include <asm/barrier.h>
 #include <linux/string.h>
 #include <linux/jiffies.h>
+#include <linux/prefetch.h>
 #else
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -16,24 +17,134 @@
 #endif
 
 #define HPT_NAMESIZE 32
-#define HPT_RB_ELEMENT_SIZE 2048
-#define HPT_RB_ELEMENT_USABLE_SPACE (HPT_RB_ELEMENT_SIZE - sizeof(uint16_t))
+#define HPT_RB_ELEMENT_SIZE 2048 /* default, see hpt_net_device_param.elem_size */
+#define HPT_RB_ELEMENT_MIN_SIZE 256
+#define HPT_RB_ELEMENT_MAX_SIZE 4096
+#define HPT_RB_ELEMENT_HEADER_SIZE 32
+#define HPT_RB_ELEMENT_USABLE_SPACE (HPT_RB_ELEMENT_SIZE - HPT_RB_ELEMENT_HEADER_SIZE)
+#define HPT_RB_ELEMENT_MAX_USABLE_SPACE (HPT_RB_ELEMENT_MAX_SIZE - HPT_RB_ELEMENT_HEADER_SIZE)
 #define HPT_RB_ELEMENT_PADDING (HPT_RB_ELEMENT_SIZE - (2 * sizeof(uint64_t)))
 #define HPT_MTU 1350
 #define HPT_MAX_ITEMS 65536
 #define PAGES_PER_BLOCK 1024
+#define HPT_PREFETCH_ITEMS 4 /* how far ahead ring walks prefetch */
 
+/* Ring indices run freely and are masked with ring_buffer_items - 1, see hpt_ring_items_valid() */
 struct hpt_ring_buffer {
 	uint32_t write;
 	uint32_t read;
 	uint32_t block_ind;
 	uint32_t max_block_ind;
 	uint32_t min_block_ind;
+	uint32_t flags;
+};
+
+/* hpt_ring_buffer.flags, set by the kernel on both rings */
+#define HPT_RING_F_RESIZE (1 << 0) /* rings were resized, userspace must call hpt_remap() */
+#define HPT_RING_F_NEED_WAKEUP (1 << 1) /* RX ring only, the pool worker sleeps until HPT_IOCTL_KICK */
+
+/*
+ * Checksum state of a ring element.
+ * TX (kernel -> userspace): HPT_CSUM_UNNECESSARY means the checksum is complete, HPT_CSUM_PARTIAL
+ * means userspace must fold the sum from csum_start to the end of the packet into csum_start + csum_offset.
+ * RX (userspace -> kernel): HPT_CSUM_UNNECESSARY marks the packet as verified, HPT_CSUM_NONE lets the
+ * stack verify it and HPT_CSUM_PARTIAL hands the stack a packet whose checksum is still to be filled.
+ * HPT_CSUM_UNNECESSARY is zero so writers that do not know about checksums keep the old behaviour.
+ */
+#define HPT_CSUM_UNNECESSARY 0
+#define HPT_CSUM_NONE 1
+#define HPT_CSUM_PARTIAL 2
+
+/* Kind of flow hash in hpt_ring_buffer_element_meta, maps to the kernel PKT_HASH_TYPE_* */
+#define HPT_HASH_NONE 0
+#define HPT_HASH_L3 1
+#define HPT_HASH_L4 2
+
+/* hpt_ring_buffer_element.flags */
+#define HPT_ELEM_F_META (1 << 0)  /* meta block is valid */
+#define HPT_ELEM_F_READY (1 << 1) /* HPT_DEV_F_RX_MPSC: producer finished writing the element */
+
+/**********************************************************************************************//**
+* @brief Optional metadata block of a ring element
+* TX: filled by the kernel when the device is created with HPT_DEV_F_META, tstamp is the
+* CLOCK_MONOTONIC time in ns the packet was queued, protocol is the ETH_P_* value in network order.
+* RX: hash, hash_type, protocol, mark and priority are applied to the skb, tstamp is ignored.
+**************************************************************************************************/
+struct hpt_ring_buffer_element_meta {
+	uint64_t tstamp;
+	uint32_t hash;
+	uint32_t mark;
+	uint32_t priority;
+	uint16_t protocol;
+	uint8_t hash_type;
+	uint8_t reserved;
 };
 
 struct hpt_ring_buffer_element {
 	uint16_t len;
-	uint8_t data[HPT_RB_ELEMENT_USABLE_SPACE];
+	uint8_t csum_state;
+	uint8_t flags;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+	struct hpt_ring_buffer_element_meta meta;
+	uint8_t data[]; /* elem_size - HPT_RB_ELEMENT_HEADER_SIZE bytes */
+};
+
+/* Advertise NETIF_F_HW_CSUM and with it NETIF_F_SG, TX packets may carry HPT_CSUM_PARTIAL */
+#define HPT_DEV_F_CSUM_OFFLOAD (1 << 0)
+/* Fill the metadata block of TX elements */
+#define HPT_DEV_F_META (1 << 1)
+/* RX ring has multiple producers: write is a reservation cursor, the kernel waits for HPT_ELEM_F_READY */
+#define HPT_DEV_F_RX_MPSC (1 << 2)
+/* Frame pool with fill, completion, TX and RX descriptor rings instead of element rings, see struct hpt_umem */
+#define HPT_DEV_F_UMEM (1 << 3)
+/* Second ring pair for latency-sensitive packets, always serviced before the bulk rings */
+#define HPT_DEV_F_PRIO_LANE (1 << 4)
+/* No RX kernel thread or pool worker, userspace drains the RX ring itself with HPT_IOCTL_FLUSH_RX */
+#define HPT_DEV_F_NO_KTHREAD (1 << 5)
+
+/* Elements per priority ring, enough for the control packets of a bulk transfer */
+#define HPT_PRIO_ITEMS 64
+
+#define HPT_UMEM_FRAME_SIZE HPT_RB_ELEMENT_SIZE
+#define HPT_UMEM_MAX_FRAMES (4 * HPT_MAX_ITEMS)
+#define HPT_UMEM_DEFAULT_FRAMES(items) (2 * (items))
+
+/**********************************************************************************************//**
+* @brief Descriptor of a packet in a UMEM frame, carried by the TX and RX descriptor rings
+* The packet starts at the beginning of the frame. Checksum fields are the same as in
+* hpt_ring_buffer_element. A TX descriptor with len 0 only returns an unused frame.
+**************************************************************************************************/
+struct hpt_umem_desc {
+	uint32_t frame;
+	uint16_t len;
+	uint8_t csum_state;
+	uint8_t flags;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+/**********************************************************************************************//**
+* @brief View of the memory of an HPT_DEV_F_UMEM device
+* Frames are owned by whoever last received their index:
+* fill: userspace -> kernel, free frames the kernel may write TX packets into
+* tx: kernel -> userspace, packets for userspace, the frames now belong to userspace
+* rx: userspace -> kernel, packets for the network stack, the frames belong to the kernel
+* comp: kernel -> userspace, frames of RX packets the kernel is done with
+* Ring indices run freely and are masked with items - 1, items is a power of two.
+**************************************************************************************************/
+struct hpt_umem {
+	struct hpt_ring_buffer *fill;
+	struct hpt_ring_buffer *comp;
+	struct hpt_ring_buffer *tx;
+	struct hpt_ring_buffer *rx;
+	uint32_t *fill_ring;
+	uint32_t *comp_ring;
+	struct hpt_umem_desc *tx_ring;
+	struct hpt_umem_desc *rx_ring;
+	uint8_t *frames;
+	uint32_t items;
+	uint32_t frame_count;
 };
 
 /**********************************************************************************************//**
@@ -43,8 +154,50 @@ struct hpt_net_device_param
 {
 	char name[HPT_NAMESIZE];
     size_t ring_buffer_items;
+    uint32_t flags;
+    uint32_t umem_frames; /* HPT_DEV_F_UMEM: frames in the pool, 0 for HPT_UMEM_DEFAULT_FRAMES */
+    uint32_t elem_size; /* bytes per ring element, a power of two, 0 for HPT_RB_ELEMENT_SIZE */
+};
+
+/**********************************************************************************************//**
+* @brief Token-bucket limits on the packets the kernel takes from the RX ring
+* A zero rate disables that limit, a zero burst picks 10 ms worth of the rate. Packets over the
+* limit stay in the ring.
+**************************************************************************************************/
+struct hpt_pacing_param
+{
+    uint64_t rate_pps;
+    uint64_t burst_pkts;
+    uint64_t rate_bps; /* bits per second */
+    uint64_t burst_bytes;
+};
+
+/**********************************************************************************************//**
+* @brief One packet buffer of HPT_IOCTL_READ_BATCH and HPT_IOCTL_WRITE_BATCH
+**************************************************************************************************/
+struct hpt_batch_buf
+{
+    uint64_t addr;
+    uint32_t len; /* read: buffer size, set to the packet length copied. write: packet length */
+    uint32_t reserved;
+};
+
+/**********************************************************************************************//**
+* @brief Packet buffers moved by one batch ioctl, at most HPT_BATCH_MAX of them
+**************************************************************************************************/
+struct hpt_batch
+{
+    uint64_t bufs; /* array of count struct hpt_batch_buf */
+    uint32_t count;
+    uint32_t reserved;
 };
 
+#define HPT_BATCH_MAX PAGES_PER_BLOCK
+
+#define HPT_PACING_MAX_PPS 1000000000ULL
+#define HPT_PACING_MAX_BPS 100000000000ULL
+#define HPT_PACING_MAX_BURST 0xffffffffULL
+
 #ifdef __KERNEL__
 #define ACQUIRE(src) smp_load_acquire((src))
 #else
@@ -57,23 +210,204 @@ struct hpt_net_device_param
 #define STORE(dst, val) __atomic_store_n((dst), (val), __ATOMIC_RELEASE)
 #endif
 
+#ifdef __KERNEL__
+#define HPT_PREFETCH(addr) prefetch((addr))
+#else
+#define HPT_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+#endif
+
 
 #define HPT_DEVICE_NAME "hpt"
 #define HPT_DEVICE_PATH "/dev/hpt"
 
 #define HPT_IOCTL_CREATE _IOWR(0x92, 1, struct hpt_net_device_param)
+#define HPT_IOCTL_INFO _IOR(0x92, 2, struct hpt_net_device_param)
+#define HPT_IOCTL_SET_PACING _IOW(0x92, 3, struct hpt_pacing_param)
+/* Non-zero keeps the netdev, RX thread and rings alive after the last fd is closed */
+#define HPT_IOCTL_SET_PERSIST _IOW(0x92, 4, uint32_t)
+/* Take over a detached persistent device by name, the rest of the parameters are filled in */
+#define HPT_IOCTL_ATTACH _IOWR(0x92, 5, struct hpt_net_device_param)
+/* Wake the RX pool worker of the device after publishing while HPT_RING_F_NEED_WAKEUP is set */
+#define HPT_IOCTL_KICK _IO(0x92, 6)
+/* Hand up to the given number of RX ring packets to the network stack in the caller's context, 0 for all */
+#define HPT_IOCTL_FLUSH_RX _IOW(0x92, 7, uint32_t)
+/* read()/write() for many packets: returns the number moved, only the first one is waited for */
+#define HPT_IOCTL_READ_BATCH _IOW(0x92, 8, struct hpt_batch)
+#define HPT_IOCTL_WRITE_BATCH _IOW(0x92, 9, struct hpt_batch)
+/* Move both rings to memory of the size set with ethtool -G, then map the device again */
+#define HPT_IOCTL_RESIZE _IO(0x92, 10)
 
-static inline uint64_t hpt_count_items(struct hpt_ring_buffer *ring)
+/* Ring sizes accepted by HPT_IOCTL_CREATE and ethtool -G, a power of two so indices can be masked */
+static inline int hpt_ring_items_valid(size_t ring_buffer_items)
+{
+	return ring_buffer_items && ring_buffer_items <= HPT_MAX_ITEMS &&
+	       (ring_buffer_items & (ring_buffer_items - 1)) == 0;
+}
+
+/* Element sizes accepted by HPT_IOCTL_CREATE, elements stay naturally aligned in the ring */
+static inline int hpt_elem_size_valid(size_t elem_size)
+{
+	return elem_size >= HPT_RB_ELEMENT_MIN_SIZE && elem_size <= HPT_RB_ELEMENT_MAX_SIZE &&
+	       (elem_size & (elem_size - 1)) == 0;
+}
+
+/* Bytes to map for two rings of ring_buffer_items: both headers, then the TX and the RX elements */
+static inline size_t hpt_ring_memory_size(size_t ring_buffer_items, size_t elem_size)
+{
+	return (2 * sizeof(struct hpt_ring_buffer)) + (2 * ring_buffer_items * elem_size);
+}
+
+/* Offset of the frame pool: the four ring headers, the fill, completion, TX and RX rings, then the frames */
+static inline size_t hpt_umem_frames_offset(size_t ring_buffer_items)
+{
+	size_t rings = (4 * sizeof(struct hpt_ring_buffer)) + (2 * ring_buffer_items * sizeof(uint32_t)) +
+	               (2 * ring_buffer_items * sizeof(struct hpt_umem_desc));
+
+	return (rings + HPT_UMEM_FRAME_SIZE - 1) & ~((size_t)HPT_UMEM_FRAME_SIZE - 1);
+}
+
+static inline size_t hpt_umem_memory_size(size_t ring_buffer_items, size_t frame_count)
+{
+	return hpt_umem_frames_offset(ring_buffer_items) + (frame_count * HPT_UMEM_FRAME_SIZE);
+}
+
+/* Bytes to map for a device, frame_count only matters with HPT_DEV_F_UMEM, elem_size only without */
+static inline size_t hpt_memory_size(uint32_t flags, size_t ring_buffer_items, size_t frame_count, size_t elem_size)
+{
+	if(flags & HPT_DEV_F_UMEM)
+	{
+		return hpt_umem_memory_size(ring_buffer_items, frame_count);
+	}
+
+	/* The priority lane follows the bulk rings with the same layout */
+	if(flags & HPT_DEV_F_PRIO_LANE)
+	{
+		return hpt_ring_memory_size(ring_buffer_items, elem_size) + hpt_ring_memory_size(HPT_PRIO_ITEMS, elem_size);
+	}
+
+	return hpt_ring_memory_size(ring_buffer_items, elem_size);
+}
+
+/**********************************************************************************************//**
+* @brief hpt_umem_layout: Point a UMEM view at the mapped memory of a device
+* @param umem: View to fill
+* @param base: Start of the mapping
+* @param ring_buffer_items: Number of descriptors per ring
+* @param frame_count: Number of frames in the pool
+**************************************************************************************************/
+static inline void hpt_umem_layout(struct hpt_umem *umem, uint8_t *base, uint32_t ring_buffer_items, uint32_t frame_count)
+{
+	umem->fill = (struct hpt_ring_buffer *)base;
+	umem->comp = umem->fill + 1;
+	umem->tx = umem->fill + 2;
+	umem->rx = umem->fill + 3;
+	umem->fill_ring = (uint32_t *)(umem->fill + 4);
+	umem->comp_ring = umem->fill_ring + ring_buffer_items;
+	umem->tx_ring = (struct hpt_umem_desc *)(umem->comp_ring + ring_buffer_items);
+	umem->rx_ring = umem->tx_ring + ring_buffer_items;
+	umem->frames = base + hpt_umem_frames_offset(ring_buffer_items);
+	umem->items = ring_buffer_items;
+	umem->frame_count = frame_count;
+}
+
+/* Frame data, NULL for an index outside the pool. Indices come from the other side and must be checked */
+static inline uint8_t *hpt_umem_frame(const struct hpt_umem *umem, uint32_t frame)
+{
+	if(unlikely(frame >= umem->frame_count))
+	{
+		return NULL;
+	}
+
+	return umem->frames + ((size_t)frame * HPT_UMEM_FRAME_SIZE);
+}
+
+static inline uint32_t hpt_umem_count(struct hpt_ring_buffer *ring)
 {
 	return ACQUIRE(&ring->write) - ACQUIRE(&ring->read);
 }
 
+static inline int hpt_umem_push_frame(struct hpt_ring_buffer *ring, uint32_t *frames, uint32_t items, uint32_t frame)
+{
+	uint32_t write = ACQUIRE(&ring->write);
+
+	if(unlikely(write - ACQUIRE(&ring->read) >= items))
+	{
+		return 1;
+	}
+
+	frames[write & (items - 1)] = frame;
+	STORE(&ring->write, write + 1);
+
+	return 0;
+}
+
+static inline int hpt_umem_pop_frame(struct hpt_ring_buffer *ring, uint32_t *frames, uint32_t items, uint32_t *frame)
+{
+	uint32_t read = ACQUIRE(&ring->read);
+
+	if(unlikely(read == ACQUIRE(&ring->write)))
+	{
+		return 1;
+	}
+
+	*frame = frames[read & (items - 1)];
+	STORE(&ring->read, read + 1);
+
+	return 0;
+}
+
+static inline int hpt_umem_push_desc(struct hpt_ring_buffer *ring, struct hpt_umem_desc *descs, uint32_t items, const struct hpt_umem_desc *desc)
+{
+	uint32_t write = ACQUIRE(&ring->write);
+
+	if(unlikely(write - ACQUIRE(&ring->read) >= items))
+	{
+		return 1;
+	}
+
+	descs[write & (items - 1)] = *desc;
+	STORE(&ring->write, write + 1);
+
+	return 0;
+}
+
+static inline int hpt_umem_pop_desc(struct hpt_ring_buffer *ring, struct hpt_umem_desc *descs, uint32_t items, struct hpt_umem_desc *desc)
+{
+	uint32_t read = ACQUIRE(&ring->read);
+
+	if(unlikely(read == ACQUIRE(&ring->write)))
+	{
+		return 1;
+	}
+
+	*desc = descs[read & (items - 1)];
+	STORE(&ring->read, read + 1);
+
+	return 0;
+}
+
+/* Free-running indices, the difference stays right when write has overflowed and read not yet */
+static inline uint64_t hpt_count_items(struct hpt_ring_buffer *ring)
+{
+	return (uint32_t)(ACQUIRE(&ring->write) - ACQUIRE(&ring->read));
+}
+
+/* Indices come from the other side, a count above the ring size must not turn into free space */
 static inline uint64_t hpt_free_items(struct hpt_ring_buffer *ring, size_t ring_buffer_items)
 {
-	return ring_buffer_items - hpt_count_items(ring);
+	uint64_t count = hpt_count_items(ring);
+
+	return count < ring_buffer_items ? ring_buffer_items - count : 0;
+}
+
+/* Slot of a ring index, ring_buffer_items is a power of two */
+static inline uint32_t hpt_ring_slot(uint32_t ind, size_t ring_buffer_items)
+{
+	return ind & (uint32_t)(ring_buffer_items - 1);
 }
 
-static inline struct hpt_ring_buffer_element *hpt_get_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_read)
+static inline struct hpt_ring_buffer_element *hpt_get_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_read,
+                                                           size_t elem_size)
 {
 	struct hpt_ring_buffer_element *elem;
 
@@ -82,10 +416,10 @@ static inline struct hpt_ring_buffer_element *hpt_get_item(struct hpt_ring_buffe
 		return NULL;
 	}
 
-	elem = start_read + (HPT_RB_ELEMENT_SIZE * ACQUIRE(&ring->read));
+	elem = (struct hpt_ring_buffer_element *)(start_read + (elem_size * hpt_ring_slot(ACQUIRE(&ring->read), ring_buffer_items)));
 	if(!elem) return NULL;
 
-	if(unlikely(elem->len > HPT_RB_ELEMENT_USABLE_SPACE)) 
+	if(unlikely(elem->len > elem_size - HPT_RB_ELEMENT_HEADER_SIZE)) 
     {
 		return NULL;
 	}
@@ -93,19 +427,108 @@ static inline struct hpt_ring_buffer_element *hpt_get_item(struct hpt_ring_buffe
 	return elem;
 }
 
-static inline int hpt_set_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_write, uint8_t *data, size_t len)
+/**********************************************************************************************//**
+* @brief hpt_get_item_at: Get the n-th unread element of the ring without consuming it
+* @param ring: Ring buffer header
+* @param ring_buffer_items: Number of items in the ring
+* @param start_read: Start of the ring data
+* @param elem_size: Bytes per element
+* @param n: Position relative to the read index
+* @return Pointer to the element, or NULL if fewer than n + 1 elements are queued
+**************************************************************************************************/
+static inline struct hpt_ring_buffer_element *hpt_get_item_at(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_read,
+                                                              size_t elem_size, size_t n)
 {
 	struct hpt_ring_buffer_element *elem;
 
-	if(unlikely(!hpt_free_items(ring, ring_buffer_items)) || unlikely(len > HPT_RB_ELEMENT_USABLE_SPACE))
+	if(unlikely(n >= hpt_count_items(ring)))
     {
-		return 1;
+		return NULL;
+	}
+
+	elem = (struct hpt_ring_buffer_element *)(start_read + (elem_size * hpt_ring_slot(ACQUIRE(&ring->read) + n, ring_buffer_items)));
+
+	if(unlikely(elem->len > elem_size - HPT_RB_ELEMENT_HEADER_SIZE))
+    {
+		return NULL;
 	}
 
-	elem = start_write + (HPT_RB_ELEMENT_SIZE * ACQUIRE(&ring->write));
-	if(!elem) return 0;
+	return elem;
+}
+
+/**********************************************************************************************//**
+* @brief hpt_prefetch_item: Prefetch the header and first payload line of the n-th unread element
+* Does not touch the element, the caller makes sure n is below hpt_count_items().
+* @param ring: Ring buffer header
+* @param ring_buffer_items: Number of items in the ring
+* @param start_read: Start of the ring data
+* @param elem_size: Bytes per element
+* @param n: Position relative to the read index
+**************************************************************************************************/
+static inline void hpt_prefetch_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_read, size_t elem_size, size_t n)
+{
+	uint8_t *elem = start_read + (elem_size * hpt_ring_slot(ACQUIRE(&ring->read) + n, ring_buffer_items));
+
+	HPT_PREFETCH(elem);
+	HPT_PREFETCH(elem + 64);
+}
+
+/**********************************************************************************************//**
+* @brief hpt_get_write_item_at: Get the n-th free element of the ring without publishing it
+* @param ring: Ring buffer header
+* @param ring_buffer_items: Number of items in the ring
+* @param start_write: Start of the ring data
+* @param elem_size: Bytes per element
+* @param n: Position relative to the write index
+* @return Pointer to the element, or NULL if fewer than n + 1 elements are free
+**************************************************************************************************/
+static inline struct hpt_ring_buffer_element *hpt_get_write_item_at(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_write,
+                                                                    size_t elem_size, size_t n)
+{
+	if(unlikely(n >= hpt_free_items(ring, ring_buffer_items)))
+    {
+		return NULL;
+	}
+
+	return (struct hpt_ring_buffer_element *)(start_write + (elem_size * hpt_ring_slot(ACQUIRE(&ring->write) + n, ring_buffer_items)));
+}
+
+/**********************************************************************************************//**
+* @brief hpt_get_write_item: Get the next free element of the ring without publishing it
+* @param ring: Ring buffer header
+* @param ring_buffer_items: Number of items in the ring
+* @param start_write: Start of the ring data
+* @param elem_size: Bytes per element
+* @param len: Length of the packet that will be written to the element
+* @return Pointer to the element, or NULL if the ring is full or len does not fit
+**************************************************************************************************/
+static inline struct hpt_ring_buffer_element *hpt_get_write_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_write,
+                                                                 size_t elem_size, size_t len)
+{
+	if(unlikely(!hpt_free_items(ring, ring_buffer_items)) || unlikely(len > elem_size - HPT_RB_ELEMENT_HEADER_SIZE))
+    {
+		return NULL;
+	}
+
+	return (struct hpt_ring_buffer_element *)(start_write + (elem_size * hpt_ring_slot(ACQUIRE(&ring->write), ring_buffer_items)));
+}
+
+static inline int hpt_set_item(struct hpt_ring_buffer *ring, size_t ring_buffer_items, uint8_t *start_write, size_t elem_size,
+                               uint8_t *data, size_t len)
+{
+	struct hpt_ring_buffer_element *elem;
+
+	elem = hpt_get_write_item(ring, ring_buffer_items, start_write, elem_size, len);
+	if(unlikely(!elem))
+    {
+		return 1;
+	}
 
 	elem->len = len;
+	elem->csum_state = HPT_CSUM_UNNECESSARY;
+	elem->flags = 0;
+	elem->csum_start = 0;
+	elem->csum_offset = 0;
 	memcpy(elem->data, data, len);
 
 	return 0;
@@ -118,14 +541,7 @@ static inline void hpt_set_read_item(struct hpt_ring_buffer *ring)
 		return;
 	}
 
-	uint32_t ind = ACQUIRE(&ring->read) + 1;
-	if(ind >= PAGES_PER_BLOCK) 
-	{
-		STORE(&ring->read, 0);
-		return;
-	}
-
-	STORE(&ring->read, ind);
+	STORE(&ring->read, ACQUIRE(&ring->read) + 1);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,422 @@
+#ifndef _HPT_CORO_HPP_
+#define _HPT_CORO_HPP_
+
+#include "hpt.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace hptxx
+{
+
+class Reactor;
+
+/**********************************************************************************************//**
+* @brief Packets taken from a TX ring by AsyncDevice::next_batch()
+* The packets stay in the ring, the slots go back to the kernel when the batch is destroyed or
+* release() is called. Partial checksums are completed when the batch is taken, element() still
+* gives access to the checksum fields and metadata.
+**************************************************************************************************/
+class Batch
+{
+public:
+    Batch() : ring_(nullptr, nullptr, 0, 0)
+    {
+    }
+
+    Batch(const Ring<> &ring, std::size_t max) : ring_(ring), read_(0), count_(0)
+    {
+        std::size_t num = ring_.count();
+        struct hpt_ring_buffer_element *item;
+
+        read_ = ring_.info()->read;
+        num = num < max ? num : max;
+        for(; count_ < num; count_++)
+        {
+            item = ring_.element(read_ + count_);
+            if(unlikely(item->len > usable_space(ring_.elem_size())))
+            {
+                break;
+            }
+            if(unlikely(item->csum_state == HPT_CSUM_PARTIAL))
+            {
+                hpt_csum_complete(item->data, item->len, item->csum_start, item->csum_offset);
+            }
+        }
+    }
+
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+
+    Batch(Batch &&other) noexcept : ring_(other.ring_), read_(other.read_), count_(std::exchange(other.count_, 0))
+    {
+    }
+
+    Batch &operator=(Batch &&other) noexcept
+    {
+        if(this != &other)
+        {
+            release();
+            ring_ = other.ring_;
+            read_ = other.read_;
+            count_ = std::exchange(other.count_, 0);
+        }
+
+        return *this;
+    }
+
+    ~Batch()
+    {
+        release();
+    }
+
+    std::size_t size() const
+    {
+        return count_;
+    }
+
+    bool empty() const
+    {
+        return count_ == 0;
+    }
+
+    struct hpt_ring_buffer_element *element(std::size_t n) const
+    {
+        return ring_.element(read_ + n);
+    }
+
+    Packet operator[](std::size_t n) const
+    {
+        struct hpt_ring_buffer_element *item = element(n);
+
+        return Packet(reinterpret_cast<const std::byte *>(item->data), item->len);
+    }
+
+    /* Hand the slots back to the kernel, the packet views are invalid afterwards */
+    void release()
+    {
+        if(count_)
+        {
+            ring_.release(std::exchange(count_, 0));
+        }
+    }
+
+private:
+    Ring<> ring_;
+    std::uint32_t read_;
+    std::size_t count_;
+};
+
+/**********************************************************************************************//**
+* @brief Device driven by a Reactor, one reading and one writing coroutine may wait on it
+* The device must not be UMEM and must stay registered while a coroutine waits on it. A coroutine
+* that destroys it while the other one waits has to destroy that one too, it is never resumed.
+**************************************************************************************************/
+class AsyncDevice
+{
+public:
+    AsyncDevice(Reactor &reactor, Device &dev);
+    ~AsyncDevice();
+
+    AsyncDevice(const AsyncDevice &) = delete;
+    AsyncDevice &operator=(const AsyncDevice &) = delete;
+
+    /* False if the device could not be added to the reactor */
+    explicit operator bool() const
+    {
+        return registered_;
+    }
+
+    Device &device()
+    {
+        return dev_;
+    }
+
+    /**********************************************************************************************//**
+    * @brief next_batch: Wait until the TX ring has packets and take up to max of them
+    * The priority ring is served first. The batch is empty only if the device reported an error.
+    **************************************************************************************************/
+    auto next_batch(std::size_t max = 64)
+    {
+        struct Awaiter
+        {
+            AsyncDevice &adev;
+            std::size_t max;
+
+            bool await_ready() const
+            {
+                return adev.readable();
+            }
+
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                adev.reader_ = h;
+                if(!adev.arm())
+                {
+                    adev.reader_ = nullptr;
+                    return false;
+                }
+
+                return true;
+            }
+
+            Batch await_resume()
+            {
+                return adev.take(max);
+            }
+        };
+
+        return Awaiter{*this, max};
+    }
+
+    /**********************************************************************************************//**
+    * @brief writable: Wait until the RX ring has a free slot
+    * Resumes with the number of free slots, 0 only if the device reported an error.
+    **************************************************************************************************/
+    auto writable()
+    {
+        struct Awaiter
+        {
+            AsyncDevice &adev;
+
+            bool await_ready() const
+            {
+                return adev.free_slots() > 0;
+            }
+
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                adev.writer_ = h;
+                if(!adev.arm())
+                {
+                    adev.writer_ = nullptr;
+                    return false;
+                }
+
+                return true;
+            }
+
+            std::size_t await_resume()
+            {
+                return adev.free_slots();
+            }
+        };
+
+        return Awaiter{*this};
+    }
+
+private:
+    friend class Reactor;
+
+    bool readable() const
+    {
+        struct hpt *dev = dev_.get();
+
+        return hpt_count_items(dev->ring_info_tx) ||
+               ((dev->flags & HPT_DEV_F_PRIO_LANE) && hpt_count_items(dev->ring_info_tx_prio));
+    }
+
+    std::size_t free_slots() const
+    {
+        return hpt_free_items(dev_.get()->ring_info_rx, dev_.get()->ring_buffer_items);
+    }
+
+    Batch take(std::size_t max)
+    {
+        struct hpt *dev = dev_.get();
+
+        if((dev->flags & HPT_DEV_F_PRIO_LANE) && hpt_count_items(dev->ring_info_tx_prio))
+        {
+            return Batch(dev_.tx_prio_ring(), max);
+        }
+
+        return Batch(dev_.tx_ring(), max);
+    }
+
+    bool arm();
+    void dispatch(std::uint32_t events);
+
+    Reactor &reactor_;
+    Device &dev_;
+    bool registered_ = false;
+    std::coroutine_handle<> reader_;
+    std::coroutine_handle<> writer_;
+    std::shared_ptr<bool> alive_ = std::make_shared<bool>(true); /* cleared on destruction, see dispatch() */
+};
+
+/**********************************************************************************************//**
+* @brief Single-threaded epoll loop resuming the coroutines waiting on AsyncDevices
+* Each device is registered once with EPOLLONESHOT and re-armed only while a coroutine waits on
+* it, so idle and busy devices cost nothing and one thread can serve thousands of them.
+**************************************************************************************************/
+class Reactor
+{
+public:
+    Reactor() : epfd_(epoll_create1(EPOLL_CLOEXEC))
+    {
+    }
+
+    ~Reactor()
+    {
+        if(epfd_ >= 0)
+        {
+            close(epfd_);
+        }
+    }
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    explicit operator bool() const
+    {
+        return epfd_ >= 0;
+    }
+
+    /**********************************************************************************************//**
+    * @brief run_once: Wait for device events and resume the coroutines waiting on them
+    * @param timeout_ms: epoll_wait() timeout, -1 to block
+    * @return Number of events handled, negative on failure
+    **************************************************************************************************/
+    int run_once(int timeout_ms = -1)
+    {
+        struct epoll_event events[64];
+        int n;
+
+        n = epoll_wait(epfd_, events, 64, timeout_ms);
+        for(int j = 0; j < n; j++)
+        {
+            static_cast<AsyncDevice *>(events[j].data.ptr)->dispatch(events[j].events);
+        }
+
+        return n;
+    }
+
+    /* Runs until stop() is called from a coroutine */
+    void run()
+    {
+        stop_ = false;
+        while(!stop_)
+        {
+            run_once();
+        }
+    }
+
+    void stop()
+    {
+        stop_ = true;
+    }
+
+private:
+    friend class AsyncDevice;
+
+    int ctl(int op, AsyncDevice *adev, std::uint32_t events)
+    {
+        struct epoll_event ev = {};
+
+        ev.events = events | EPOLLONESHOT;
+        ev.data.ptr = adev;
+
+        return epoll_ctl(epfd_, op, adev->dev_.fd(), &ev);
+    }
+
+    int epfd_;
+    bool stop_ = false;
+};
+
+inline AsyncDevice::AsyncDevice(Reactor &reactor, Device &dev) : reactor_(reactor), dev_(dev)
+{
+    /* Disarmed until a coroutine waits */
+    registered_ = reactor_.ctl(EPOLL_CTL_ADD, this, 0) == 0;
+}
+
+inline AsyncDevice::~AsyncDevice()
+{
+    *alive_ = false;
+    if(registered_)
+    {
+        epoll_ctl(reactor_.epfd_, EPOLL_CTL_DEL, dev_.fd(), nullptr);
+    }
+}
+
+inline bool AsyncDevice::arm()
+{
+    std::uint32_t events = (reader_ ? std::uint32_t(EPOLLIN) : 0) | (writer_ ? std::uint32_t(EPOLLOUT) : 0);
+
+    /* Level triggered: a ring that became ready before the call is reported right away */
+    return registered_ && reactor_.ctl(EPOLL_CTL_MOD, this, events) == 0;
+}
+
+inline void AsyncDevice::dispatch(std::uint32_t events)
+{
+    std::coroutine_handle<> reader, writer;
+
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+        reader = std::exchange(reader_, nullptr);
+    }
+    if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    {
+        writer = std::exchange(writer_, nullptr);
+    }
+
+    /* The event disarmed the device, a coroutine still waiting needs it armed again */
+    if(reader_ || writer_)
+    {
+        arm();
+    }
+
+    /*
+     * A resumed coroutine may destroy the device. The writer would then call free_slots() on it,
+     * so it is left suspended and whoever destroys the device owns it.
+     */
+    std::shared_ptr<bool> alive = alive_;
+
+    if(reader)
+    {
+        reader.resume();
+    }
+    if(writer && *alive)
+    {
+        writer.resume();
+    }
+}
+
+/**********************************************************************************************//**
+* @brief Minimal eagerly started, detached coroutine for running per-device loops on a Reactor
+**************************************************************************************************/
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+} // namespace hptxx
+
+#endif
@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "hpt.h"
+
+#define HPT_DISPATCH_CACHE_LINE 64
+#define HPT_DISPATCH_SPIN 1024
+#define HPT_DISPATCH_DEFAULT_QUEUE_ITEMS 1024
+
+#define HPT_IPPROTO_TCP 6
+#define HPT_IPPROTO_UDP 17
+#define HPT_IPPROTO_SCTP 132
+
+/**********************************************************************************************//**
+* @brief Packet copied out of the TX ring, owned by a worker queue
+**************************************************************************************************/
+struct hpt_dispatch_slot
+{
+    struct hpt_pkt_meta meta;
+    uint16_t len;
+    uint8_t data[HPT_RB_ELEMENT_MAX_USABLE_SPACE];
+};
+
+/**********************************************************************************************//**
+* @brief Lock-free single-producer single-consumer queue feeding one worker
+* The dispatcher is the only producer, the worker the only consumer.
+**************************************************************************************************/
+struct hpt_spsc
+{
+    uint32_t head __attribute__((aligned(HPT_DISPATCH_CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(HPT_DISPATCH_CACHE_LINE)));
+    uint32_t mask;
+    struct hpt_dispatch_slot *slots;
+};
+
+/**********************************************************************************************//**
+* @brief Bounded multi-consumer queue for packets of flows without ordering constraints
+* Each cell carries a sequence number (D. Vyukov bounded MPMC queue), so any idle worker may take
+* from it while the dispatcher keeps producing.
+**************************************************************************************************/
+struct hpt_steal_cell
+{
+    uint32_t seq;
+    struct hpt_dispatch_slot slot;
+};
+
+struct hpt_steal_queue
+{
+    uint32_t head __attribute__((aligned(HPT_DISPATCH_CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(HPT_DISPATCH_CACHE_LINE)));
+    uint32_t mask;
+    struct hpt_steal_cell *cells;
+};
+
+struct hpt_dispatch_worker
+{
+    struct hpt_spsc queue;
+    struct hpt_dispatch *disp;
+    size_t index;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int sleeping;
+};
+
+struct hpt_dispatch
+{
+    struct hpt *dev;
+    struct hpt_dispatch_param param;
+    struct hpt_steal_queue steal;
+    int running;
+    struct hpt_dispatch_worker *workers;
+};
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_worker_run: Worker thread, handles its own flows and steals unordered packets
+* @param arg: Pointer to the hpt_dispatch_worker structure of the thread
+* @return NULL
+**************************************************************************************************/
+static void *hpt_dispatch_worker_run(void *arg);
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_wake: Wake a worker if it went to sleep on an empty queue
+* @param worker: Pointer to the worker
+**************************************************************************************************/
+static void hpt_dispatch_wake(struct hpt_dispatch_worker *worker);
+
+/**********************************************************************************************//**
+* @brief hpt_dispatch_ring: Hand up to burst packets of one TX ring to the workers
+* @param disp: Dispatcher
+* @param ring: Ring header
+* @param ring_data: Start of the ring data
+* @param ring_buffer_items: Number of items in the ring
+* @param burst: Maximum number of packets to take
+* @param woken: Bitmask of workers that received packets, updated
+* @return Number of packets taken from the ring
+**************************************************************************************************/
+static size_t hpt_dispatch_ring(struct hpt_dispatch *disp, struct hpt_ring_buffer *ring, uint8_t *ring_data,
+                                size_t ring_buffer_items, size_t burst, uint64_t *woken);
+
+static inline uint32_t hpt_round_pow2(uint32_t v)
+{
+    uint32_t p = 1;
+    while(p < v) p <<= 1;
+    return p;
+}
+
+static inline uint32_t hpt_mix32(uint32_t h, uint32_t v)
+{
+    v *= 0xcc9e2d51;
+    v = (v << 15) | (v >> 17);
+    v *= 0x1b873593;
+    h ^= v;
+    h = (h << 13) | (h >> 19);
+    return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t hpt_load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hpt_flow_hash(const uint8_t *pkt_data, size_t pkt_size)
+{
+    uint32_t h = 0x9747b28c;
+    size_t l4 = 0;
+    uint8_t proto = 0;
+
+    if(unlikely(pkt_size < 1))
+    {
+        return 0;
+    }
+
+    switch(pkt_data[0] >> 4)
+    {
+    case 4:
+        if(unlikely(pkt_size < 20))
+        {
+            return 0;
+        }
+        proto = pkt_data[9];
+        h = hpt_mix32(h, hpt_load32(pkt_data + 12));
+        h = hpt_mix32(h, hpt_load32(pkt_data + 16));
+        /* Only the first fragment carries ports, hash fragments on addresses to keep them together */
+        if(!(pkt_data[6] & 0x3f) && !pkt_data[7])
+        {
+            l4 = (pkt_data[0] & 0x0f) * 4;
+        }
+        break;
+    case 6:
+        if(unlikely(pkt_size < 40))
+        {
+            return 0;
+        }
+        proto = pkt_data[6];
+        for(size_t i = 8; i < 40; i += 4)
+        {
+            h = hpt_mix32(h, hpt_load32(pkt_data + i));
+        }
+        l4 = 40;
+        break;
+    default:
+        return 0;
+    }
+
+    h = hpt_mix32(h, proto);
+
+    if(l4 && (proto == HPT_IPPROTO_TCP || proto == HPT_IPPROTO_UDP || proto == HPT_IPPROTO_SCTP)
+       && l4 + 4 <= pkt_size)
+    {
+        h = hpt_mix32(h, hpt_load32(pkt_data + l4));
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static inline struct hpt_dispatch_slot *hpt_spsc_reserve(struct hpt_spsc *q)
+{
+    uint32_t head = q->head;
+
+    if(unlikely(head - ACQUIRE(&q->tail) > q->mask))
+    {
+        return NULL;
+    }
+
+    return &q->slots[head & q->mask];
+}
+
+static inline void hpt_spsc_publish(struct hpt_spsc *q)
+{
+    STORE(&q->head, q->head + 1);
+}
+
+static inline struct hpt_dispatch_slot *hpt_spsc_peek(struct hpt_spsc *q)
+{
+    uint32_t tail = q->tail;
+
+    if(tail == ACQUIRE(&q->head))
+    {
+        return NULL;
+    }
+
+    return &q->slots[tail & q->mask];
+}
+
+static inline void hpt_spsc_release(struct hpt_spsc *q)
+{
+    STORE(&q->tail, q->tail + 1);
+}
+
+static inline struct hpt_steal_cell *hpt_steal_reserve(struct hpt_steal_queue *q)
+{
+    uint32_t head = q->head;
+    struct hpt_steal_cell *cell = &q->cells[head & q->mask];
+
+    if(ACQUIRE(&cell->seq) != head)
+    {
+        return NULL;
+    }
+
+    return cell;
+}
+
+static inline void hpt_steal_publish(struct hpt_steal_queue *q, struct hpt_steal_cell *cell)
+{
+    STORE(&cell->seq, q->head + 1);
+    q->head++;
+}
+
+static int hpt_steal_take(struct hpt_steal_queue *q, struct hpt_dispatch_slot **slot, uint32_t *pos)
+{
+    uint32_t tail = ACQUIRE(&q->tail);
+
+    for(;;)
+    {
+        struct hpt_steal_cell *cell = &q->cells[tail & q->mask];
+        int32_t diff = (int32_t)(ACQUIRE(&cell->seq) - (tail + 1));
+
+        if(diff < 0)
+        {
+            return 0;
+        }
+
+        if(diff == 0 && __atomic_compare_exchange_n(&q->tail, &tail, tail + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *slot = &cell->slot;
+            *pos = tail;
+            return 1;
+        }
+
+        if(diff > 0)
+        {
+            tail = ACQUIRE(&q->tail);
+        }
+    }
+}
+
+static inline void hpt_steal_done(struct hpt_steal_queue *q, uint32_t pos)
+{
+    STORE(&q->cells[pos & q->mask].seq, pos + q->mask + 1);
+}
+
+static inline void hpt_dispatch_copy(struct hpt_dispatch_slot *slot, struct hpt_ring_buffer_element *item)
+{
+    slot->len = item->len;
+    slot->meta.csum_state = item->csum_state;
+    slot->meta.csum_start = item->csum_start;
+    slot->meta.csum_offset = item->csum_offset;
+    slot->meta.flags = item->flags;
+    if(item->flags & HPT_ELEM_F_META)
+    {
+        slot->meta.hash_type = item->meta.hash_type;
+        slot->meta.protocol = item->meta.protocol;
+        slot->meta.hash = item->meta.hash;
+        slot->meta.mark = item->meta.mark;
+        slot->meta.priority = item->meta.priority;
+        slot->meta.tstamp = item->meta.tstamp;
+    }
+    memcpy(slot->data, item->data, item->len);
+}
+
+static void hpt_dispatch_wake(struct hpt_dispatch_worker *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(ACQUIRE(&worker->sleeping))
+    {
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+static int hpt_dispatch_has_work(struct hpt_dispatch_worker *worker)
+{
+    struct hpt_steal_queue *steal = &worker->disp->steal;
+    uint32_t tail = ACQUIRE(&steal->tail);
+
+    return hpt_spsc_peek(&worker->queue) != NULL
+        || ACQUIRE(&steal->cells[tail & steal->mask].seq) == tail + 1;
+}
+
+static void *hpt_dispatch_worker_run(void *arg)
+{
+    struct hpt_dispatch_worker *worker = arg;
+    struct hpt_dispatch *disp = worker->disp;
+    struct hpt_dispatch_slot *slot;
+    uint32_t pos;
+    size_t idle = 0;
+
+    for(;;)
+    {
+        slot = hpt_spsc_peek(&worker->queue);
+        if(slot)
+        {
+            disp->param.worker_cb(disp->param.handle, worker->index, slot->data, slot->len, &slot->meta);
+            hpt_spsc_release(&worker->queue);
+            idle = 0;
+            continue;
+        }
+
+        /* Own flows are done, help out with packets whose order does not matter */
+        if(hpt_steal_take(&disp->steal, &slot, &pos))
+        {
+            disp->param.worker_cb(disp->param.handle, worker->index, slot->data, slot->len, &slot->meta);
+            hpt_steal_done(&disp->steal, pos);
+            idle = 0;
+            continue;
+        }
+
+        if(!ACQUIRE(&disp->running))
+        {
+            break;
+        }
+
+        if(++idle < HPT_DISPATCH_SPIN)
+        {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&worker->mutex);
+        STORE(&worker->sleeping, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(!hpt_dispatch_has_work(worker) && ACQUIRE(&disp->running))
+        {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        }
+        STORE(&worker->sleeping, 0);
+        pthread_mutex_unlock(&worker->mutex);
+        idle = 0;
+    }
+
+    return NULL;
+}
+
+struct hpt_dispatch *hpt_dispatch_create(struct hpt *dev, const struct hpt_dispatch_param *param)
+{
+    struct hpt_dispatch *disp;
+    size_t started = 0;
+    uint32_t items;
+
+    if(!dev || !param || !param->worker_cb || param->workers == 0)
+    {
+        printf("Invalid dispatcher parameters\n");
+        return NULL;
+    }
+
+    disp = calloc(1, sizeof(struct hpt_dispatch));
+    if(!disp)
+    {
+        printf("Cannot allocate 'struct hpt_dispatch'\n");
+        return NULL;
+    }
+
+    disp->dev = dev;
+    disp->param = *param;
+    if(!disp->param.burst)
+    {
+        disp->param.burst = dev->ring_buffer_items;
+    }
+
+    items = hpt_round_pow2(param->queue_items ? param->queue_items : HPT_DISPATCH_DEFAULT_QUEUE_ITEMS);
+
+    disp->workers = calloc(param->workers, sizeof(struct hpt_dispatch_worker));
+    if(!disp->workers)
+    {
+        printf("Cannot allocate dispatcher workers\n");
+        goto end;
+    }
+
+    if(param->unordered_cb)
+    {
+        disp->steal.mask = items - 1;
+        disp->steal.cells = calloc(items, sizeof(struct hpt_steal_cell));
+        if(!disp->steal.cells)
+        {
+            printf("Cannot allocate dispatcher steal queue\n");
+            goto end;
+        }
+        for(uint32_t i = 0; i < items; i++)
+        {
+            disp->steal.cells[i].seq = i;
+        }
+    }
+    else
+    {
+        /* A single cell that never becomes ready keeps the worker fast path branch free */
+        disp->steal.cells = calloc(1, sizeof(struct hpt_steal_cell));
+        if(!disp->steal.cells)
+        {
+            printf("Cannot allocate dispatcher steal queue\n");
+            goto end;
+        }
+        disp->steal.cells[0].seq = UINT32_MAX;
+    }
+
+    disp->running = 1;
+
+    for(size_t i = 0; i < param->workers; i++)
+    {
+        struct hpt_dispatch_worker *worker = &disp->workers[i];
+
+        worker->disp = disp;
+        worker->index = i;
+        worker->queue.mask = items - 1;
+        worker->queue.slots = malloc(items * sizeof(struct hpt_dispatch_slot));
+        if(!worker->queue.slots)
+        {
+            printf("Cannot allocate queue of worker %zu\n", i);
+            goto end;
+        }
+
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+
+        if(pthread_create(&worker->thread, NULL, hpt_dispatch_worker_run, worker) != 0)
+        {
+            printf("Error create dispatcher worker %zu\n", i);
+            pthread_mutex_destroy(&worker->mutex);
+            pthread_cond_destroy(&worker->cond);
+            free(worker->queue.slots);
+            worker->queue.slots = NULL;
+            goto end;
+        }
+        started++;
+    }
+
+    return disp;
+
+end:
+    if(disp->workers)
+    {
+        STORE(&disp->running, 0);
+        for(size_t i = 0; i < started; i++)
+        {
+            hpt_dispatch_wake(&disp->workers[i]);
+            pthread_join(disp->workers[i].thread, NULL);
+            pthread_mutex_destroy(&disp->workers[i].mutex);
+            pthread_cond_destroy(&disp->workers[i].cond);
+            free(disp->workers[i].queue.slots);
+        }
+        free(disp->workers);
+    }
+    free(disp->steal.cells);
+    free(disp);
+    return NULL;
+}
+
+static size_t hpt_dispatch_ring(struct hpt_dispatch *disp, struct hpt_ring_buffer *ring, uint8_t *ring_data,
+                                size_t ring_buffer_items, size_t burst, uint64_t *woken)
+{
+    struct hpt_dispatch_param *param = &disp->param;
+    size_t num = hpt_count_items(ring);
+    struct hpt_ring_buffer_element *item;
+    struct hpt_dispatch_worker *worker;
+    struct hpt_dispatch_slot *slot;
+    struct hpt_steal_cell *cell;
+    uint32_t hash;
+    size_t j;
+
+    if(num > burst)
+    {
+        num = burst;
+    }
+
+    for(j = 0; j < num; j++)
+    {
+        if(j + HPT_PREFETCH_ITEMS < num)
+        {
+            hpt_prefetch_item(ring, ring_buffer_items, ring_data, disp->dev->elem_size, HPT_PREFETCH_ITEMS);
+        }
+        item = hpt_get_item(ring, ring_buffer_items, ring_data, disp->dev->elem_size);
+        if(!item) break;
+
+        if(param->unordered_cb && param->unordered_cb(param->handle, item->data, item->len))
+        {
+            cell = hpt_steal_reserve(&disp->steal);
+            if(cell)
+            {
+                hpt_dispatch_copy(&cell->slot, item);
+                hpt_steal_publish(&disp->steal, cell);
+                hpt_set_read_item(ring);
+                continue;
+            }
+        }
+
+        if((item->flags & HPT_ELEM_F_META) && item->meta.hash_type != HPT_HASH_NONE)
+        {
+            hash = item->meta.hash;
+        }
+        else
+        {
+            hash = hpt_flow_hash(item->data, item->len);
+        }
+
+        worker = &disp->workers[((uint64_t)hash * param->workers) >> 32];
+
+        /* The worker is behind, leave the rest in the ring rather than reorder or drop */
+        slot = hpt_spsc_reserve(&worker->queue);
+        if(!slot) break;
+
+        hpt_dispatch_copy(slot, item);
+        hpt_spsc_publish(&worker->queue);
+        hpt_set_read_item(ring);
+
+        *woken |= 1ULL << (worker->index & 63);
+    }
+
+    return j;
+}
+
+size_t hpt_dispatch_drain(struct hpt_dispatch *disp)
+{
+    struct hpt *dev = disp->dev;
+    struct hpt_dispatch_param *param = &disp->param;
+    uint64_t woken = 0;
+    size_t j = 0;
+
+    /* The priority lane takes its share of the burst first */
+    if(dev->flags & HPT_DEV_F_PRIO_LANE)
+    {
+        j = hpt_dispatch_ring(disp, dev->ring_info_tx_prio, dev->ring_data_tx_prio, HPT_PRIO_ITEMS, param->burst, &woken);
+    }
+
+    j += hpt_dispatch_ring(disp, dev->ring_info_tx, dev->ring_data_tx, dev->ring_buffer_items, param->burst - j, &woken);
+
+    for(size_t i = 0; i < param->workers; i++)
+    {
+        if(param->unordered_cb || (woken & (1ULL << (i & 63))))
+        {
+            hpt_dispatch_wake(&disp->workers[i]);
+        }
+    }
+
+    return j;
+}
+
+void hpt_dispatch_destroy(struct hpt_dispatch *disp)
+{
+    if(!disp) return;
+
+    STORE(&disp->running, 0);
+
+    for(size_t i = 0; i < disp->param.workers; i++)
+    {
+        struct hpt_dispatch_worker *worker = &disp->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->mutex);
+        pthread_cond_destroy(&worker->cond);
+        free(worker->queue.slots);
+    }
+
+    free(disp->workers);
+    free(disp->steal.cells);
+    free(disp);
+}
@@ -0,0 +1,310 @@
+#ifdef HPT_HAVE_LIBURING
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "hpt_uring.h"
+
+/**********************************************************************************************//**
+* @brief hpt_uring_arm_poll: Queue a multishot poll for POLLIN on the device fd
+* @param hu: Attached state
+* @return 0 on success, -EBUSY if the submission queue is full
+**************************************************************************************************/
+static int hpt_uring_arm_poll(struct hpt_uring *hu);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_queue_read: Queue IORING_OP_READ_FIXED into a reserved RX slot
+* @param hu: Attached state
+* @param sockfd: Socket to read from
+* @param item: Reserved slot
+* @param slot: Ring slot of item
+* @return 0 on success, -EBUSY if the submission queue is full
+**************************************************************************************************/
+static int hpt_uring_queue_read(struct hpt_uring *hu, int sockfd, struct hpt_ring_buffer_element *item, uint32_t slot);
+
+static inline uint32_t hpt_uring_slot(uint8_t *ring_data, size_t elem_size, struct hpt_ring_buffer_element *item)
+{
+    return ((uint8_t *)item - ring_data) / elem_size;
+}
+
+/* Clears the bit and returns whether it was set */
+static inline int hpt_uring_bit_take(uint64_t *bitmap, uint32_t slot)
+{
+    uint64_t mask = 1ULL << (slot % 64);
+
+    if(!(bitmap[slot / 64] & mask))
+    {
+        return 0;
+    }
+
+    bitmap[slot / 64] &= ~mask;
+
+    return 1;
+}
+
+static inline void hpt_uring_bit_set(uint64_t *bitmap, uint32_t slot)
+{
+    bitmap[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static int hpt_uring_arm_poll(struct hpt_uring *hu)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(hu->ring);
+
+    if(!sqe)
+    {
+        return -EBUSY;
+    }
+
+    io_uring_prep_poll_multishot(sqe, hu->dev->fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, hu->tag | HPT_URING_UD_POLL);
+
+    return 0;
+}
+
+static int hpt_uring_queue_read(struct hpt_uring *hu, int sockfd, struct hpt_ring_buffer_element *item, uint32_t slot)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(hu->ring);
+
+    if(!sqe)
+    {
+        return -EBUSY;
+    }
+
+    item->csum_state = HPT_CSUM_UNNECESSARY;
+    item->flags = 0;
+
+    io_uring_prep_read_fixed(sqe, sockfd, item->data, hu->dev->elem_size - HPT_RB_ELEMENT_HEADER_SIZE, 0, hu->buf_index);
+    io_uring_sqe_set_data64(sqe, hu->tag | HPT_URING_UD_READ | slot);
+
+    return 0;
+}
+
+int hpt_uring_attach(struct hpt_uring *hu, struct hpt *dev, struct io_uring *ring, unsigned buf_index, uint16_t tag)
+{
+    struct iovec iov;
+    int ret;
+
+    memset(hu, 0, sizeof(struct hpt_uring));
+    hu->dev = dev;
+    hu->ring = ring;
+    hu->buf_index = buf_index;
+    hu->tag = HPT_URING_UD_MAGIC | ((uint64_t)tag << HPT_URING_UD_TAG_SHIFT);
+    hu->rx_sockfd = -1;
+
+    iov.iov_base = dev->ring_memory;
+    iov.iov_len = dev->size_memory;
+
+    ret = io_uring_register_buffers_update_tag(ring, buf_index, &iov, NULL, 1);
+    if(ret == -ENXIO && buf_index == 0)
+    {
+        ret = io_uring_register_buffers(ring, &iov, 1);
+    }
+    if(ret < 0)
+    {
+        printf("Cannot register ring memory as fixed buffer %u: %s\n", buf_index, strerror(-ret));
+        return ret;
+    }
+
+    return hpt_uring_arm_poll(hu);
+}
+
+void hpt_uring_detach(struct hpt_uring *hu)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(hu->ring);
+    struct iovec iov = { 0 };
+
+    if(sqe)
+    {
+        io_uring_prep_poll_remove(sqe, hu->tag | HPT_URING_UD_POLL);
+        io_uring_sqe_set_data64(sqe, 0);
+        io_uring_submit(hu->ring);
+    }
+
+    if(io_uring_register_buffers_update_tag(hu->ring, hu->buf_index, &iov, NULL, 1) < 0)
+    {
+        io_uring_unregister_buffers(hu->ring);
+    }
+}
+
+int hpt_uring_handle_cqe(struct hpt_uring *hu, struct io_uring_cqe *cqe, struct hpt_ring_buffer_element **item)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    uint32_t slot = data & HPT_URING_UD_SLOT_MASK;
+    int ret = HPT_URING_EV_DONE;
+
+    if((data & (HPT_URING_UD_MAGIC_MASK | HPT_URING_UD_TAG_MASK)) != hu->tag)
+    {
+        return HPT_URING_EV_NONE;
+    }
+
+    switch(data & HPT_URING_UD_KIND_MASK)
+    {
+    case HPT_URING_UD_POLL:
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            hpt_uring_arm_poll(hu);
+        }
+        return cqe->res < 0 ? HPT_URING_EV_DONE : HPT_URING_EV_TX;
+
+    case HPT_URING_UD_SEND:
+        /* The send result comes in the first CQE, the notification CQE carries no error */
+        if(!(cqe->flags & IORING_CQE_F_NOTIF) && cqe->res < 0)
+        {
+            hu->tx_errors++;
+            ret = HPT_URING_EV_TX_ERROR;
+        }
+
+        /* With IORING_CQE_F_MORE the buffer is still referenced until the notification CQE */
+        if(cqe->flags & IORING_CQE_F_MORE)
+        {
+            return ret;
+        }
+
+        hpt_uring_bit_set(hu->tx_done, slot);
+        while(hu->tx_submitted)
+        {
+            struct hpt_ring_buffer_element *oldest = hpt_tx_peek(hu->dev, 0);
+            uint32_t ind;
+
+            if(!oldest) break;
+            ind = hpt_uring_slot(hu->dev->ring_data_tx, hu->dev->elem_size, oldest);
+            if(!hpt_uring_bit_take(hu->tx_done, ind)) break;
+
+            hpt_tx_release(hu->dev, 1);
+            hu->tx_submitted--;
+        }
+        return ret;
+
+    case HPT_URING_UD_READ:
+        *item = (struct hpt_ring_buffer_element *)(hu->dev->ring_data_rx + (size_t)slot * hu->dev->elem_size);
+        if(cqe->res <= 0)
+        {
+            /* The slot keeps its place in the ring and reads the next datagram instead, unless
+             * the socket is gone; then hpt_uring_recv_rx() queues it again */
+            hu->rx_errors++;
+            if(cqe->res == -ECANCELED || cqe->res == -EBADF || cqe->res == -ENOTSOCK
+               || hpt_uring_queue_read(hu, hu->rx_sockfd, *item, slot) < 0)
+            {
+                hpt_uring_bit_set(hu->rx_unarmed, slot);
+                hu->rx_idle++;
+            }
+            return HPT_URING_EV_DONE;
+        }
+        (*item)->len = cqe->res;
+        return HPT_URING_EV_RX;
+    }
+
+    return HPT_URING_EV_NONE;
+}
+
+unsigned hpt_uring_send_tx(struct hpt_uring *hu, int sockfd, unsigned max, hpt_do_pkt prepare_cb, void *handle)
+{
+    struct hpt_ring_buffer_element *item;
+    struct io_uring_sqe *sqe;
+    unsigned queued = 0;
+
+    while(queued < max)
+    {
+        item = hpt_tx_peek(hu->dev, hu->tx_submitted);
+        if(!item) break;
+
+        sqe = io_uring_get_sqe(hu->ring);
+        if(!sqe) break;
+
+        if(unlikely(item->csum_state == HPT_CSUM_PARTIAL))
+        {
+            hpt_csum_complete(item->data, item->len, item->csum_start, item->csum_offset);
+        }
+        if(prepare_cb)
+        {
+            prepare_cb(handle, item->data, item->len);
+        }
+
+        io_uring_prep_send_zc_fixed(sqe, sockfd, item->data, item->len, 0, 0, hu->buf_index);
+        io_uring_sqe_set_data64(sqe, hu->tag | HPT_URING_UD_SEND | hpt_uring_slot(hu->dev->ring_data_tx, hu->dev->elem_size, item));
+
+        hu->tx_submitted++;
+        queued++;
+    }
+
+    return queued;
+}
+
+unsigned hpt_uring_recv_rx(struct hpt_uring *hu, int sockfd, unsigned max)
+{
+    struct hpt_ring_buffer_element *item;
+    unsigned queued = 0;
+    uint32_t slot, i;
+
+    hu->rx_sockfd = sockfd;
+
+    for(i = 0; hu->rx_idle && i < hu->rx_reserved && queued < max; i++)
+    {
+        item = hpt_rx_reserve(hu->dev, i);
+        if(!item) break;
+
+        slot = hpt_uring_slot(hu->dev->ring_data_rx, hu->dev->elem_size, item);
+        if(!hpt_uring_bit_take(hu->rx_unarmed, slot)) continue;
+
+        if(hpt_uring_queue_read(hu, sockfd, item, slot) < 0)
+        {
+            hpt_uring_bit_set(hu->rx_unarmed, slot);
+            return queued;
+        }
+
+        hu->rx_idle--;
+        queued++;
+    }
+
+    while(queued < max)
+    {
+        item = hpt_rx_reserve(hu->dev, hu->rx_reserved);
+        if(!item) break;
+
+        slot = hpt_uring_slot(hu->dev->ring_data_rx, hu->dev->elem_size, item);
+        if(hpt_uring_queue_read(hu, sockfd, item, slot) < 0) break;
+
+        hu->rx_reserved++;
+        queued++;
+    }
+
+    return queued;
+}
+
+void hpt_uring_rx_commit(struct hpt_uring *hu, struct hpt_ring_buffer_element *item)
+{
+    struct hpt_ring_buffer_element *first;
+    uint32_t ind;
+
+    hpt_uring_bit_set(hu->rx_ready, hpt_uring_slot(hu->dev->ring_data_rx, hu->dev->elem_size, item));
+
+    /* Extend the filled prefix, dropped packets go out as well since the kernel skips zero
+     * length elements */
+    while(hu->rx_committed < hu->rx_reserved)
+    {
+        first = hpt_rx_reserve(hu->dev, hu->rx_committed);
+        if(!first) break;
+        ind = hpt_uring_slot(hu->dev->ring_data_rx, hu->dev->elem_size, first);
+        if(!hpt_uring_bit_take(hu->rx_ready, ind)) break;
+
+        hu->rx_committed++;
+    }
+}
+
+void hpt_uring_rx_flush(struct hpt_uring *hu)
+{
+    if(!hu->rx_committed)
+    {
+        return;
+    }
+
+    hu->rx_reserved -= hu->rx_committed;
+    hpt_rx_publish(hu->dev, hu->rx_committed);
+    hu->rx_committed = 0;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _HPT_URING_H_
+#define _HPT_URING_H_
+
+#include <liburing.h>
+#include "hpt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * user_data of SQEs issued by the library:
+ * [63:48] magic, [47:40] operation, [39:24] caller tag, [23:0] ring index of the slot
+ */
+#define HPT_URING_UD_MAGIC 0x4850000000000000ULL
+#define HPT_URING_UD_MAGIC_MASK 0xFFFF000000000000ULL
+#define HPT_URING_UD_POLL (1ULL << 40)
+#define HPT_URING_UD_SEND (2ULL << 40)
+#define HPT_URING_UD_READ (3ULL << 40)
+#define HPT_URING_UD_KIND_MASK (0xFFULL << 40)
+#define HPT_URING_UD_TAG_SHIFT 24
+#define HPT_URING_UD_TAG_MASK (0xFFFFULL << HPT_URING_UD_TAG_SHIFT)
+#define HPT_URING_UD_SLOT_MASK 0xFFFFFFULL
+
+/* Return values of hpt_uring_handle_cqe() */
+#define HPT_URING_EV_NONE 0  /* the CQE does not belong to this device */
+#define HPT_URING_EV_DONE 1  /* consumed by the library, nothing to do */
+#define HPT_URING_EV_TX 2    /* the TX ring has new packets, call hpt_uring_send_tx() */
+#define HPT_URING_EV_RX 3    /* a datagram landed in an RX slot, process it then hpt_uring_rx_commit() */
+#define HPT_URING_EV_TX_ERROR 4 /* a send failed and its packet is dropped, cqe->res holds -errno */
+
+/**********************************************************************************************//**
+* @brief State of an HPT device attached to an io_uring instance
+**************************************************************************************************/
+struct hpt_uring
+{
+    struct hpt *dev;
+    struct io_uring *ring;
+    unsigned buf_index;
+    uint64_t tag;             /* magic and caller tag bits of user_data */
+    uint32_t tx_submitted;    /* TX slots handed to SEND_ZC, counted from the read index */
+    uint32_t rx_reserved;     /* RX slots handed to READ_FIXED, counted from the write index */
+    uint32_t rx_committed;    /* reserved RX slots committed in order, published by hpt_uring_rx_flush() */
+    uint32_t rx_idle;         /* reserved RX slots whose read failed and could not be queued again */
+    int rx_sockfd;            /* socket of hpt_uring_recv_rx(), failed reads are queued on it again */
+    uint64_t tx_errors;       /* sends completed with an error */
+    uint64_t rx_errors;       /* reads completed with an error or an empty datagram */
+    uint64_t tx_done[HPT_MAX_ITEMS / 64];  /* bitmaps indexed by ring slot */
+    uint64_t rx_ready[HPT_MAX_ITEMS / 64];
+    uint64_t rx_unarmed[HPT_MAX_ITEMS / 64];
+};
+
+/**********************************************************************************************//**
+* @brief hpt_uring_attach: Attach an HPT device to an io_uring instance
+* Registers the mmap'd ring memory as fixed buffer buf_index and arms a multishot poll on the
+* device fd. If the io_uring already has a (sparse) buffer table the ring memory is placed at
+* buf_index, otherwise a table holding only the ring memory is registered and buf_index must be 0.
+* @param hu: State to initialise
+* @param dev: Pointer to the HPT device structure
+* @param ring: io_uring instance, the library only adds SQEs, the caller submits
+* @param buf_index: Fixed buffer index for the ring memory
+* @param tag: Caller data stored in user_data, to tell devices sharing one io_uring apart
+* @return 0 on success
+* @return Negative errno on failure
+**************************************************************************************************/
+int hpt_uring_attach(struct hpt_uring *hu, struct hpt *dev, struct io_uring *ring, unsigned buf_index, uint16_t tag);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_detach: Cancel the poll and unregister the ring memory
+* In-flight sends and reads must have completed before the device is closed.
+* @param hu: Attached state
+**************************************************************************************************/
+void hpt_uring_detach(struct hpt_uring *hu);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_handle_cqe: Process a completion that may belong to the device
+* Re-arms the poll if the kernel terminated it, and releases TX slots once their zero-copy
+* notification arrived and every older slot was released too. A failed or empty read queues
+* the same RX slot again instead of committing it.
+* @param hu: Attached state
+* @param cqe: Completion to look at
+* @param item: Set to the filled RX slot for HPT_URING_EV_RX
+* @return One of HPT_URING_EV_*
+**************************************************************************************************/
+int hpt_uring_handle_cqe(struct hpt_uring *hu, struct io_uring_cqe *cqe, struct hpt_ring_buffer_element **item);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_send_tx: Queue IORING_OP_SEND_ZC for TX ring packets not yet in flight
+* The packets are sent straight out of the ring slots, which stay owned by the send until the
+* zero-copy notification completes.
+* @param hu: Attached state
+* @param sockfd: Socket to send on, usually a connected UDP socket
+* @param max: Maximum number of sends to queue
+* @param prepare_cb: Optional in-place transform run on each packet before it is queued
+* @param handle: Passed to prepare_cb
+* @return Number of sends queued
+**************************************************************************************************/
+unsigned hpt_uring_send_tx(struct hpt_uring *hu, int sockfd, unsigned max, hpt_do_pkt prepare_cb, void *handle);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_recv_rx: Queue IORING_OP_READ_FIXED from a socket into free RX ring slots
+* Reserved slots whose read failed without being queued again are queued first.
+* @param hu: Attached state
+* @param sockfd: Socket to read from
+* @param max: Maximum number of reads to queue
+* @return Number of reads queued
+**************************************************************************************************/
+unsigned hpt_uring_recv_rx(struct hpt_uring *hu, int sockfd, unsigned max);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_rx_commit: Mark a filled RX slot ready for the kernel
+* item->len holds the length of the packet to inject, 0 drops the slot. Slots are published in
+* the order they were reserved, a slot committed early waits for the ones before it.
+* @param hu: Attached state
+* @param item: Slot returned with HPT_URING_EV_RX
+**************************************************************************************************/
+void hpt_uring_rx_commit(struct hpt_uring *hu, struct hpt_ring_buffer_element *item);
+
+/**********************************************************************************************//**
+* @brief hpt_uring_rx_flush: Publish the committed RX slots with one write index update and kick
+* Call it once per batch of CQEs.
+* @param hu: Attached state
+**************************************************************************************************/
+void hpt_uring_rx_flush(struct hpt_uring *hu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif